@@ -96,6 +96,22 @@ contains(USE_IPV6, -) {
     DEFINES += USE_IPV6=$$USE_IPV6
 }
 
+# use: qmake "USE_GLV_VERIFY=1" ( built-in secp256k1 signature verifier; default)
+#  or: qmake "USE_GLV_VERIFY=0" (OpenSSL's ECDSA_verify)
+count(USE_GLV_VERIFY, 0) {
+    USE_GLV_VERIFY=1
+}
+DEFINES += USE_GLV_VERIFY=$$USE_GLV_VERIFY
+
+# use: qmake "USE_EPOLL=1" ( wait for socket events with epoll on Linux; default)
+#  or: qmake "USE_EPOLL=0" (select)
+linux:!win32 {
+    count(USE_EPOLL, 0) {
+        USE_EPOLL=1
+    }
+    DEFINES += USE_EPOLL=$$USE_EPOLL
+}
+
 contains(BITCOIN_NEED_QT_PLUGINS, 1) {
     DEFINES += BITCOIN_NEED_QT_PLUGINS
     QTPLUGIN += qcncodecs qjpcodecs qtwcodecs qkrcodecs qtaccessiblewidgets
@@ -155,6 +171,10 @@ HEADERS += src/qt/bitcoingui.h \
     src/sync.h \
     src/util.h \
     src/hash.h \
+    src/sha256.h \
+    src/coinsmap.h \
+    src/blockfile.h \
+    src/compactblock.h \
     src/uint256.h \
     src/serialize.h \
     src/core.h \
@@ -236,6 +256,10 @@ SOURCES += src/qt/bitcoin.cpp \
     src/sync.cpp \
     src/util.cpp \
     src/hash.cpp \
+    src/sha256.cpp \
+    src/coinsmap.cpp \
+    src/blockfile.cpp \
+    src/compactblock.cpp \
     src/netbase.cpp \
     src/key.cpp \
     src/script.cpp \
@@ -0,0 +1,148 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+/** A read-only mapping of the first nSize bytes of a file */
+class CFileMapping
+{
+public:
+    const char *pdata;
+    size_t nSize;
+
+    CFileMapping(const char *pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+
+    ~CFileMapping()
+    {
+#ifndef WIN32
+        munmap((void*)pdata, nSize);
+#endif
+    }
+};
+
+CBlockFileReader::CBlockFileReader(const std::string &strPrefixIn, unsigned int nMaxMappedIn) : strPrefix(strPrefixIn), nMaxMapped(nMaxMappedIn)
+{
+}
+
+static boost::filesystem::path GetBlockFilePath(const std::string &strPrefix, int nFile)
+{
+    return GetDataDir() / "blocks" / strprintf("%s%05u.dat", strPrefix.c_str(), nFile);
+}
+
+boost::shared_ptr<CFileMapping> CBlockFileReader::GetMapping(int nFile, size_t nMinSize)
+{
+    std::map<int, boost::shared_ptr<CFileMapping> >::iterator it = mapMapped.find(nFile);
+    if (it != mapMapped.end())
+    {
+        listRecent.remove(nFile);
+        listRecent.push_front(nFile);
+        if (it->second->nSize >= nMinSize)
+            return it->second;
+    }
+
+#ifdef WIN32
+    return boost::shared_ptr<CFileMapping>();
+#else
+    // Map the whole file as it is now; it is mapped again once it has grown
+    // past what is needed
+    boost::filesystem::path path = GetBlockFilePath(strPrefix, nFile);
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return boost::shared_ptr<CFileMapping>();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < nMinSize)
+    {
+        close(fd);
+        return boost::shared_ptr<CFileMapping>();
+    }
+    void *pdata = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pdata == MAP_FAILED)
+    {
+        printf("CBlockFileReader : mapping %s failed\n", path.string().c_str());
+        return boost::shared_ptr<CFileMapping>();
+    }
+
+    boost::shared_ptr<CFileMapping> pmapping(new CFileMapping((const char*)pdata, st.st_size));
+    if (it == mapMapped.end())
+    {
+        listRecent.push_front(nFile);
+        if (listRecent.size() > nMaxMapped)
+        {
+            mapMapped.erase(listRecent.back());
+            listRecent.pop_back();
+        }
+    }
+    mapMapped[nFile] = pmapping;
+    return pmapping;
+#endif
+}
+
+bool CBlockFileReader::Read(const CDiskBlockPos &pos, unsigned int nSize, CBlockFileSpan &span)
+{
+    if (pos.IsNull())
+        return false;
+
+    {
+        LOCK(cs);
+        span.pmapping = GetMapping(pos.nFile, (size_t)pos.nPos + nSize);
+    }
+    if (span.pmapping)
+    {
+        span.vchCopy.clear();
+        span.pbegin = span.pmapping->pdata + pos.nPos;
+        span.pend = span.pbegin + nSize;
+        return true;
+    }
+
+    // Not mapped; read the bytes instead
+    boost::filesystem::path path = GetBlockFilePath(strPrefix, pos.nFile);
+    FILE *file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return error("CBlockFileReader::Read() : unable to open file %s", path.string().c_str());
+    span.vchCopy.resize(nSize);
+    bool fOk = fseek(file, pos.nPos, SEEK_SET) == 0 && (nSize == 0 || fread(&span.vchCopy[0], 1, nSize, file) == nSize);
+    fclose(file);
+    if (!fOk)
+        return error("CBlockFileReader::Read() : unable to read %u bytes at position %u of %s", nSize, pos.nPos, path.string().c_str());
+    span.pbegin = nSize ? &span.vchCopy[0] : NULL;
+    span.pend = span.pbegin + nSize;
+    return true;
+}
+
+bool CBlockFileReader::ReadBlock(const CDiskBlockPos &pos, CBlockFileSpan &span)
+{
+    // A block is preceded by the network's message start and its size
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+    CBlockFileSpan spanHeader;
+    if (!Read(CDiskBlockPos(pos.nFile, pos.nPos - 8), 8, spanHeader))
+        return false;
+    if (memcmp(spanHeader.begin(), Params().MessageStart(), 4) != 0)
+        return error("CBlockFileReader::ReadBlock() : no block header at position %u of file %d", pos.nPos, pos.nFile);
+    unsigned int nSize;
+    memcpy(&nSize, spanHeader.begin() + 4, sizeof(nSize));
+    if (nSize > MAX_BLOCK_SIZE)
+        return error("CBlockFileReader::ReadBlock() : invalid block size %u at position %u of file %d", nSize, pos.nPos, pos.nFile);
+    return Read(pos, nSize, span);
+}
+
+void CBlockFileReader::Forget(int nFile)
+{
+    LOCK(cs);
+    if (mapMapped.erase(nFile))
+        listRecent.remove(nFile);
+}
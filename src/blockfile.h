@@ -0,0 +1,72 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+class CFileMapping;
+
+/** A range of bytes of a block file. If the file is memory-mapped, this
+ *  points into the mapping, and keeps it alive for as long as it exists.
+ */
+class CBlockFileSpan
+{
+private:
+    boost::shared_ptr<CFileMapping> pmapping;
+    std::vector<char> vchCopy; // the bytes, if they were read instead
+    const char *pbegin;
+    const char *pend;
+
+public:
+    CBlockFileSpan() : pbegin(NULL), pend(NULL) {}
+
+    const char *begin() const { return pbegin; }
+    const char *end() const { return pend; }
+    size_t size() const { return pend - pbegin; }
+
+    friend class CBlockFileReader;
+};
+
+/** Reader of the block files (blk?????.dat or rev?????.dat), that maps them
+ *  into memory instead of opening, seeking and reading them on every access.
+ *
+ *  Mappings are kept for the most recently used files. A file that grew
+ *  since it was mapped is mapped again; spans into the old mapping remain
+ *  valid. Where mapping isn't supported, the bytes are read into the span.
+ */
+class CBlockFileReader
+{
+private:
+    std::string strPrefix;
+    unsigned int nMaxMapped;
+
+    CCriticalSection cs;
+    std::map<int, boost::shared_ptr<CFileMapping> > mapMapped;
+    std::list<int> listRecent; // mapped files, most recently used first
+
+    boost::shared_ptr<CFileMapping> GetMapping(int nFile, size_t nMinSize);
+
+public:
+    CBlockFileReader(const std::string &strPrefixIn, unsigned int nMaxMappedIn);
+
+    // Get nSize bytes at pos
+    bool Read(const CDiskBlockPos &pos, unsigned int nSize, CBlockFileSpan &span);
+
+    // Get the serialized block at pos, using the header written in front of it
+    bool ReadBlock(const CDiskBlockPos &pos, CBlockFileSpan &span);
+
+    // Drop the mapping of a file, e.g. because it was truncated
+    void Forget(int nFile);
+};
+
+#endif
@@ -30,7 +30,7 @@ public:
         vAlertPubKey = ParseHex("04fd68acb6a895f3462d91b43eef0da845f0d531958a858554feab3ac330562bf76910700b3f7c29ee273ddc4da2bb5b953858f6958a50e8831eb43ee30c32f21d");
         nDefaultPort = 44252;
         nRPCPort = 44254;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 20);
+        bnProofOfWorkLimit = ~uint256(0) >> 20;
         //nSubsidyHalvingInterval = 100000;
   
         const char* pszTimestamp = "Californium is a radioactive metallic chemical element with symbol Cf and atomic number 98";
@@ -148,7 +148,7 @@ public:
         pchMessageStart[2] = 0xbb;
         pchMessageStart[3] = 0x07;
         nSubsidyHalvingInterval = 150;
-        bnProofOfWorkLimit = CBigNum(~uint256(0) >> 1);
+        bnProofOfWorkLimit = ~uint256(0) >> 1;
         genesis.nTime = 1415510670;
         genesis.nBits = 0x207fffff;
         genesis.nNonce = 655496;
@@ -7,8 +7,10 @@
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/foreach.hpp>
 
 #include <vector>
+#include <deque>
 #include <algorithm>
 
 template<typename T> class CCheckQueueControl;
@@ -17,176 +19,299 @@ template<typename T> class CCheckQueueControl;
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
   *
-  * One thread (the master) is assumed to push batches of verifications
-  * onto the queue, where they are processed by N-1 worker threads. When
-  * the master is done adding work, it temporarily joins the worker pool
-  * as an N'th worker, until all jobs are done.
+  * Verifications are added through a CCheckQueueControl, which tracks
+  * the outcome of its own checks. Several controls may be active at
+  * once, so the checks of one block can run while the next block is
+  * being connected. The thread that waits on a control temporarily joins
+  * the worker pool until all of that control's checks are done.
+  *
+  * Every worker owns a deque of checks: it takes work from the back of
+  * its own deque, and steals half of another worker's deque from the
+  * front when its own is empty. New batches are pushed onto a lock-free
+  * inbox, from which an idle worker moves them into its deque.
   */
 template<typename T> class CCheckQueue {
 private:
-    // Mutex to protect the inner state
-    boost::mutex mutex;
+    // One verification, and the control it was added through
+    struct CJob {
+        T check;
+        CCheckQueueControl<T> *pcontrol;
+    };
 
-    // Worker threads block on this when out of work
-    boost::condition_variable condWorker;
+    // A batch of jobs added at once, waiting in the inbox
+    struct CBatch {
+        std::vector<CJob> vJobs;
+        CBatch *pnext;
+    };
 
-    // Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+    // The deque of one worker, protected by its own mutex
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<CJob> deque;
+    };
 
-    // The queue of elements to be processed.
-    // As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    // Number of worker deques. Deque 0 is shared by the threads that wait
+    // on a control; if there are more workers than deques, they share.
+    static const int nQueues = 32;
+    CWorkerQueue queues[nQueues];
 
-    // The number of workers (including the master) that are idle.
-    int nIdle;
+    // Lock-free stack of batches that no worker has picked up yet
+    CBatch * volatile pinbox;
 
-    // The total number of workers (including the master).
-    int nTotal;
+    // Number of jobs in the inbox and the deques, i.e. not yet being executed
+    volatile unsigned int nQueued;
 
-    // The temporary evaluation result.
-    bool fAllOk;
+    // Number of worker threads started so far, used to assign deques
+    volatile int nWorkers;
 
-    // Number of verifications that haven't completed yet.
-    // This includes elements that are not anymore in queue, but still in
-    // worker's own batches.
-    unsigned int nTodo;
+    // Number of workers sleeping on condWorker
+    volatile int nIdle;
 
-    // Whether we're shutting down.
-    bool fQuit;
+    // Idle workers and waiting masters sleep under this mutex
+    boost::mutex mutexIdle;
+
+    // Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    // Master threads block on this while their checks are being executed by others
+    boost::condition_variable condMaster;
 
     // The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
-    // Internal function that does bulk of the verification work.
-    bool Loop(bool fMaster = false) {
-        boost::condition_variable &cond = fMaster ? condMaster : condWorker;
-        std::vector<T> vChecks;
-        vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
-        do {
+    // Move jobs into deque nQueue
+    void Push(int nQueue, std::vector<CJob> &vJobs) {
+        CWorkerQueue &queue = queues[nQueue];
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        BOOST_FOREACH(CJob &job, vJobs) {
+            queue.deque.push_back(CJob());
+            queue.deque.back().check.swap(job.check);
+            queue.deque.back().pcontrol = job.pcontrol;
+        }
+    }
+
+    // Take a batch of jobs from the back of deque nQueue
+    bool TakeOwn(int nQueue, std::vector<CJob> &vBatch) {
+        CWorkerQueue &queue = queues[nQueue];
+        boost::unique_lock<boost::mutex> lock(queue.mutex);
+        if (queue.deque.empty())
+            return false;
+        // Leave about half for thieves, so all workers finish approximately simultaneously
+        unsigned int nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.deque.size() / 2));
+        vBatch.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            vBatch[i].check.swap(queue.deque.back().check);
+            vBatch[i].pcontrol = queue.deque.back().pcontrol;
+            queue.deque.pop_back();
+        }
+        __sync_fetch_and_sub(&nQueued, nNow);
+        return true;
+    }
+
+    // Wake up idle workers, if there are any, after work was made available
+    void NotifyWorkers(bool fAll) {
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            if (fAll)
+                condWorker.notify_all();
+            else
+                condWorker.notify_one();
+        }
+    }
+
+    // Find a batch of work for the thread owning deque nQueue: from its own
+    // deque, then from the inbox, then by stealing from another deque.
+    bool GetBatch(int nQueue, std::vector<CJob> &vBatch) {
+        if (TakeOwn(nQueue, vBatch))
+            return true;
+
+        CBatch *pbatch = __sync_lock_test_and_set(&pinbox, (CBatch*)NULL);
+        if (pbatch != NULL) {
+            unsigned int nJobs = 0;
+            while (pbatch != NULL) {
+                CBatch *pnext = pbatch->pnext;
+                nJobs += pbatch->vJobs.size();
+                Push(nQueue, pbatch->vJobs);
+                delete pbatch;
+                pbatch = pnext;
+            }
+            if (nJobs > nBatchSize)
+                NotifyWorkers(true);
+            return TakeOwn(nQueue, vBatch);
+        }
+
+        std::vector<CJob> vStolen;
+        for (int i = 1; i < nQueues; i++) {
+            CWorkerQueue &victim = queues[(nQueue + i) % nQueues];
             {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                     // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                     // queue to the local batch vector instead of copying.
-                     vChecks[i].swap(queue.back());
-                     queue.pop_back();
+                boost::unique_lock<boost::mutex> lock(victim.mutex);
+                unsigned int nSteal = (victim.deque.size() + 1) / 2;
+                if (nSteal == 0)
+                    continue;
+                vStolen.resize(nSteal);
+                for (unsigned int j = 0; j < nSteal; j++) {
+                    vStolen[j].check.swap(victim.deque.front().check);
+                    vStolen[j].pcontrol = victim.deque.front().pcontrol;
+                    victim.deque.pop_front();
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
             }
-            // execute work
-            BOOST_FOREACH(T &check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
-        } while(true);
+            Push(nQueue, vStolen);
+            return TakeOwn(nQueue, vBatch);
+        }
+        return false;
+    }
+
+    // Execute a batch, and report the results to the controls it came from
+    void Run(std::vector<CJob> &vBatch) {
+        BOOST_FOREACH(CJob &job, vBatch) {
+            // Checks of a control that already failed or was aborted are skipped
+            if (job.pcontrol->fOk && !job.check())
+                job.pcontrol->fOk = false;
+            T().swap(job.check);
+        }
+        // The control may be destroyed as soon as its last check is accounted
+        // for, so nothing of it may be touched after that.
+        bool fFinished = false;
+        for (unsigned int i = 0; i < vBatch.size(); ) {
+            unsigned int j = i + 1;
+            while (j < vBatch.size() && vBatch[j].pcontrol == vBatch[i].pcontrol)
+                j++;
+            if (__sync_sub_and_fetch(&vBatch[i].pcontrol->nTodo, j - i) == 0)
+                fFinished = true;
+            i = j;
+        }
+        vBatch.clear();
+        if (fFinished) {
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            condMaster.notify_all();
+        }
+    }
+
+    // Join the worker pool until all checks of control are done
+    bool Wait(CCheckQueueControl<T> &control) {
+        std::vector<CJob> vBatch;
+        vBatch.reserve(nBatchSize);
+        while (control.nTodo > 0) {
+            if (GetBatch(0, vBatch)) {
+                Run(vBatch);
+                continue;
+            }
+            // The remaining checks are being executed by other threads
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            if (control.nTodo > 0 && nQueued == 0)
+                condMaster.wait(lock);
+        }
+        return control.fOk;
+    }
+
+    // Add a batch of checks for the given control
+    void Add(std::vector<T> &vChecks, CCheckQueueControl<T> *pcontrol) {
+        if (vChecks.empty())
+            return;
+        CBatch *pbatch = new CBatch();
+        pbatch->vJobs.resize(vChecks.size());
+        for (unsigned int i = 0; i < vChecks.size(); i++) {
+            pbatch->vJobs[i].check.swap(vChecks[i]);
+            pbatch->vJobs[i].pcontrol = pcontrol;
+        }
+        __sync_fetch_and_add(&pcontrol->nTodo, vChecks.size());
+        __sync_fetch_and_add(&nQueued, vChecks.size());
+        do {
+            pbatch->pnext = pinbox;
+        } while (!__sync_bool_compare_and_swap(&pinbox, pbatch->pnext, pbatch));
+        NotifyWorkers(vChecks.size() > 1);
     }
 
 public:
     // Create a new check queue
     CCheckQueue(unsigned int nBatchSizeIn) :
-        nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+        pinbox(NULL), nQueued(0), nWorkers(0), nIdle(0), nBatchSize(nBatchSizeIn) {}
 
     // Worker thread
     void Thread() {
-        Loop();
-    }
-
-    // Wait until execution finishes, and return whether all evaluations where succesful.
-    bool Wait() {
-        return Loop(true);
-    }
-
-    // Add a batch of checks to the queue
-    void Add(std::vector<T> &vChecks) {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH(T &check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
+        int nQueue = 1 + __sync_fetch_and_add(&nWorkers, 1) % (nQueues - 1);
+        std::vector<CJob> vBatch;
+        vBatch.reserve(nBatchSize);
+        while (true) {
+            if (GetBatch(nQueue, vBatch)) {
+                Run(vBatch);
+                continue;
+            }
+            boost::unique_lock<boost::mutex> lock(mutexIdle);
+            __sync_fetch_and_add(&nIdle, 1);
+            // Re-check after announcing ourselves idle: Add either sees nIdle
+            // and notifies us, or its jobs are already counted in nQueued.
+            if (nQueued == 0) {
+                try {
+                    condWorker.wait(lock);
+                } catch (...) {
+                    __sync_fetch_and_sub(&nIdle, 1);
+                    throw;
+                }
+            }
+            __sync_fetch_and_sub(&nIdle, 1);
         }
-        nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
     }
 
     ~CCheckQueue() {
+        CBatch *pbatch = pinbox;
+        while (pbatch != NULL) {
+            CBatch *pnext = pbatch->pnext;
+            delete pbatch;
+            pbatch = pnext;
+        }
     }
 
     friend class CCheckQueueControl<T>;
 };
 
-/** RAII-style controller object for a CCheckQueue that guarantees the passed
- *  queue is finished before continuing.
+/** RAII-style controller object for a CCheckQueue that guarantees the
+ *  checks added through it are finished before continuing.
+ *  Several controls can be in use on the same queue at the same time.
  */
 template<typename T> class CCheckQueueControl {
 private:
     CCheckQueue<T> *pqueue;
     bool fDone;
 
+    // Number of checks added through this control that haven't completed yet
+    volatile unsigned int nTodo;
+
+    // Whether all checks so far succeeded. Once false, remaining checks are skipped.
+    volatile bool fOk;
+
 public:
-    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false) {
-        // passed queue is supposed to be unused, or NULL
-        if (pqueue != NULL) {
-            assert(pqueue->nTotal == pqueue->nIdle);
-            assert(pqueue->nTodo == 0);
-            assert(pqueue->fAllOk == true);
-        }
+    CCheckQueueControl(CCheckQueue<T> *pqueueIn) : pqueue(pqueueIn), fDone(false), nTodo(0), fOk(true) {
     }
 
+    // Wait until all checks finish, and return whether all of them were successful.
     bool Wait() {
         if (pqueue == NULL)
             return true;
-        bool fRet = pqueue->Wait();
+        bool fRet = pqueue->Wait(*this);
         fDone = true;
         return fRet;
     }
 
     void Add(std::vector<T> &vChecks) {
         if (pqueue != NULL)
-            pqueue->Add(vChecks);
+            pqueue->Add(vChecks, this);
+    }
+
+    // Skip the checks that haven't started yet; Wait() will return false.
+    void Abort() {
+        fOk = false;
     }
 
     ~CCheckQueueControl() {
-        if (!fDone)
+        // Nobody is interested in the result anymore
+        if (!fDone) {
+            Abort();
             Wait();
+        }
     }
+
+    friend class CCheckQueue<T>;
 };
 
 #endif
@@ -0,0 +1,99 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsmap.h"
+#include "hash.h"
+#include "util.h"
+
+CCoinsMap::CCoinsMap()
+{
+    k0 = GetRand(std::numeric_limits<uint64>::max());
+    k1 = GetRand(std::numeric_limits<uint64>::max());
+}
+
+size_t CCoinsMap::FindSlot(const uint256 &txid, uint64 nHash) const
+{
+    size_t nMask = vSlots.size() - 1;
+    uint32_t nTag = nHash >> 32;
+    for (size_t i = nHash & nMask; ; i = (i + 1) & nMask)
+    {
+        const CSlot &slot = vSlots[i];
+        if (slot.nEntry == 0)
+            return i;
+        if (slot.nTag == nTag && entries[slot.nEntry - 1].txid == txid)
+            return i;
+    }
+}
+
+void CCoinsMap::Rehash(size_t nSlots)
+{
+    CSlot slotEmpty = {0, 0};
+    std::vector<CSlot>(nSlots, slotEmpty).swap(vSlots);
+    for (size_t n = 0; n < entries.size(); n++)
+    {
+        uint64 nHash = SipHashUint256(k0, k1, entries[n].txid);
+        CSlot &slot = vSlots[FindSlot(entries[n].txid, nHash)];
+        slot.nTag = nHash >> 32;
+        slot.nEntry = n + 1;
+    }
+}
+
+CCoinsMap::iterator CCoinsMap::find(const uint256 &txid)
+{
+    if (entries.empty())
+        return entries.end();
+    const CSlot &slot = vSlots[FindSlot(txid, SipHashUint256(k0, k1, txid))];
+    return slot.nEntry ? entries.begin() + (slot.nEntry - 1) : entries.end();
+}
+
+CCoinsMap::const_iterator CCoinsMap::find(const uint256 &txid) const
+{
+    if (entries.empty())
+        return entries.end();
+    const CSlot &slot = vSlots[FindSlot(txid, SipHashUint256(k0, k1, txid))];
+    return slot.nEntry ? entries.begin() + (slot.nEntry - 1) : entries.end();
+}
+
+std::pair<CCoinsMap::iterator, bool> CCoinsMap::insert(const uint256 &txid)
+{
+    // Keep the index at most half full, so probe sequences stay short
+    if (2 * (entries.size() + 1) > vSlots.size())
+        Rehash(std::max(vSlots.size() * 2, (size_t)64));
+
+    uint64 nHash = SipHashUint256(k0, k1, txid);
+    CSlot &slot = vSlots[FindSlot(txid, nHash)];
+    if (slot.nEntry)
+        return std::make_pair(entries.begin() + (slot.nEntry - 1), false);
+
+    entries.push_back(CCoinsCacheEntry());
+    entries.back().txid = txid;
+    slot.nTag = nHash >> 32;
+    slot.nEntry = entries.size();
+    return std::make_pair(entries.end() - 1, true);
+}
+
+void CCoinsMap::clear()
+{
+    std::deque<CCoinsCacheEntry>().swap(entries);
+    std::vector<CSlot>().swap(vSlots);
+}
+
+void CCoinsMap::swap(CCoinsMap &map)
+{
+    entries.swap(map.entries);
+    vSlots.swap(map.vSlots);
+    std::swap(k0, map.k0);
+    std::swap(k1, map.k1);
+}
+
+size_t CCoinsMap::DynamicMemoryUsage() const
+{
+    // A deque allocates its elements in blocks of about 512 bytes (at least one
+    // element), plus an array of pointers to those blocks.
+    size_t nPerBlock = std::max((size_t)1, 512 / sizeof(CCoinsCacheEntry));
+    size_t nBlocks = (entries.size() + nPerBlock - 1) / nPerBlock + 1;
+    return MallocUsage(vSlots.capacity() * sizeof(CSlot)) +
+           nBlocks * MallocUsage(nPerBlock * sizeof(CCoinsCacheEntry)) +
+           MallocUsage((nBlocks + 2) * sizeof(void*));
+}
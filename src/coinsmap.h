@@ -0,0 +1,97 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COINSMAP_H
+#define BITCOIN_COINSMAP_H
+
+#include "core.h"
+#include "uint256.h"
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+/** An entry of a CCoinsMap */
+struct CCoinsCacheEntry
+{
+    uint256 txid;
+    CCoins coins;
+
+    // coins.DynamicMemoryUsage() as last accounted for by the owner of the map
+    size_t nUsage;
+
+    unsigned char nFlags;
+    enum
+    {
+        // The coins differ from the version in the parent view
+        DIRTY = (1 << 0),
+        // The parent view has no unspent version of these coins, so if they
+        // get fully spent before being flushed, nothing needs to be written
+        FRESH = (1 << 1),
+    };
+
+    CCoinsCacheEntry() : nUsage(0), nFlags(0) {}
+};
+
+/** Hash table from txid to CCoins, used by CCoinsViewCache.
+ *
+ *  The entries are kept back to back in a deque, in insertion order, so
+ *  references to them stay valid while the map grows. Lookups go through a
+ *  separate open-addressing index with linear probing. Each 8-byte index slot
+ *  holds the position of an entry and the high half of its key's hash, so a
+ *  lookup usually touches a single cache line of the index and compares a full
+ *  txid only when the tags match.
+ *
+ *  Txids are hashed with SipHash under a random per-map key: they are chosen by
+ *  whoever creates the transactions, and must not be able to force collisions.
+ */
+class CCoinsMap
+{
+public:
+    typedef CCoinsCacheEntry value_type;
+    typedef std::deque<CCoinsCacheEntry>::iterator iterator;
+    typedef std::deque<CCoinsCacheEntry>::const_iterator const_iterator;
+
+private:
+    struct CSlot
+    {
+        uint32_t nTag;    // high 32 bits of the hash of the key
+        uint32_t nEntry;  // 1 + position of the entry in entries; 0 for an empty slot
+    };
+
+    std::deque<CCoinsCacheEntry> entries;
+    std::vector<CSlot> vSlots;  // size is zero or a power of two
+    uint64 k0, k1;
+
+    // Index of the slot holding txid, or of the empty slot where it would go
+    size_t FindSlot(const uint256 &txid, uint64 nHash) const;
+    void Rehash(size_t nSlots);
+
+public:
+    CCoinsMap();
+
+    iterator begin() { return entries.begin(); }
+    iterator end() { return entries.end(); }
+    const_iterator begin() const { return entries.begin(); }
+    const_iterator end() const { return entries.end(); }
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+
+    iterator find(const uint256 &txid);
+    const_iterator find(const uint256 &txid) const;
+
+    // Insert an entry with empty coins for txid, unless there already is one.
+    // Returns the entry, and whether it was inserted.
+    std::pair<iterator, bool> insert(const uint256 &txid);
+
+    // Remove all entries, and release the memory used
+    void clear();
+
+    void swap(CCoinsMap &map);
+
+    // Heap memory used by the table itself, not counting the coins' outputs
+    size_t DynamicMemoryUsage() const;
+};
+
+#endif
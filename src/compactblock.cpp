@@ -0,0 +1,129 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+#include <limits>
+
+#include <openssl/sha.h>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nNonce(GetRand(std::numeric_limits<uint64>::max()))
+{
+    header = block.GetBlockHeader();
+    FillShortIDKeys();
+    if (block.vtx.empty())
+        return;
+    vPrefilledTxn.push_back(CPrefilledTransaction(0, block.vtx[0]));
+    vShortTxIDs.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortIDKeys()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nNonce;
+    uint256 hashKey;
+    SHA256((unsigned char*)&ss[0], ss.size(), (unsigned char*)&hashKey);
+    nShortIDKey0 = hashKey.Get64(0);
+    nShortIDKey1 = hashKey.Get64(1);
+}
+
+uint64 CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortIDKey0, nShortIDKey1, txhash) & 0xffffffffffffULL;
+}
+
+// No transaction is smaller than this, so no block has more of them than
+// MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+bool CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    unsigned int nTxCount = cmpctblock.BlockTxCount();
+    if (cmpctblock.header.IsNull() || nTxCount == 0 || nTxCount > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return false;
+
+    header = cmpctblock.header;
+    vtx.assign(nTxCount, CTransaction());
+    vHave.assign(nTxCount, false);
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTxCount)
+            return false;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The remaining indexes, in order, go to the short IDs
+    std::map<uint64, unsigned int> mapShortIDs;
+    unsigned int nIndex = 0;
+    BOOST_FOREACH(uint64 nShortID, cmpctblock.vShortTxIDs)
+    {
+        while (nIndex < nTxCount && vHave[nIndex])
+            nIndex++;
+        if (nIndex == nTxCount)
+            return false;
+        if (!mapShortIDs.insert(std::make_pair(nShortID, nIndex)).second)
+            return false;
+        nIndex++;
+    }
+
+    // A short ID that more than one transaction of the pool matches is left
+    // missing, to be asked for
+    std::vector<bool> vCollision(nTxCount, false);
+    {
+        LOCK(pool.cs);
+        for (std::map<uint256, CTransaction>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); it++)
+        {
+            std::map<uint64, unsigned int>::iterator mi = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (mi == mapShortIDs.end())
+                continue;
+            unsigned int n = mi->second;
+            if (vHave[n])
+            {
+                vtx[n] = CTransaction();
+                vHave[n] = false;
+                vCollision[n] = true;
+            }
+            else if (!vCollision[n])
+            {
+                vtx[n] = it->second;
+                vHave[n] = true;
+            }
+        }
+    }
+    return true;
+}
+
+void CPartialBlock::GetMissing(std::vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const
+{
+    block = CBlock(header);
+    block.vtx = vtx;
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return false;
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return false;
+
+    return block.BuildMerkleTree() == header.hashMerkleRoot;
+}
@@ -0,0 +1,211 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COMPACTBLOCK_H
+#define BITCOIN_COMPACTBLOCK_H
+
+#include "core.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+/** A transaction sent in full in a compact block, with its index in the block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+};
+
+/** The "cmpctblock" message: the header of a new block, and its transactions
+ *  as short IDs, except for a few (at least the coinbase) that are sent in
+ *  full. The receiver finds most of them in its memory pool.
+ *
+ *  A short ID is the SipHash of the txid under a key taken from the header
+ *  and a random nonce, cut to 6 bytes. The key differs per message, so
+ *  transactions can't be made to collide with the short IDs of every block.
+ *
+ *  Indexes of prefilled transactions are sent as the difference to the
+ *  previous one, less one.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    uint64 nShortIDKey0, nShortIDKey1;
+
+    void FillShortIDKeys();
+
+public:
+    static const unsigned int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    uint64 nNonce;
+    std::vector<uint64> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nShortIDKey0(0), nShortIDKey1(0), nNonce(0) {}
+
+    // Short IDs of all transactions of block but the coinbase, under a random nonce
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64 GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = ::GetSerializeSize(header, nType, nVersion) + sizeof(nNonce);
+        nSize += GetSizeOfCompactSize(vShortTxIDs.size()) + vShortTxIDs.size() * SHORTTXIDS_LENGTH;
+        nSize += GetSizeOfCompactSize(vPrefilledTxn.size());
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+        {
+            unsigned int nDiff = vPrefilledTxn[i].nIndex - (i ? vPrefilledTxn[i-1].nIndex + 1 : 0);
+            nSize += GetSizeOfCompactSize(nDiff) + ::GetSerializeSize(vPrefilledTxn[i].tx, nType, nVersion);
+        }
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nNonce, nType, nVersion);
+        WriteCompactSize(s, vShortTxIDs.size());
+        BOOST_FOREACH(uint64 nShortID, vShortTxIDs)
+        {
+            // little endian, like the other integers
+            unsigned char pch[SHORTTXIDS_LENGTH];
+            for (unsigned int i = 0; i < SHORTTXIDS_LENGTH; i++)
+                pch[i] = (nShortID >> (8 * i)) & 0xff;
+            s.write((char*)pch, sizeof(pch));
+        }
+        WriteCompactSize(s, vPrefilledTxn.size());
+        for (unsigned int i = 0; i < vPrefilledTxn.size(); i++)
+        {
+            WriteCompactSize(s, vPrefilledTxn[i].nIndex - (i ? vPrefilledTxn[i-1].nIndex + 1 : 0));
+            ::Serialize(s, vPrefilledTxn[i].tx, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nNonce, nType, nVersion);
+        uint64 nCount = ReadCompactSize(s);
+        vShortTxIDs.clear();
+        for (uint64 n = 0; n < nCount; n++)
+        {
+            // grow as the IDs arrive, rather than trusting the count
+            unsigned char pch[SHORTTXIDS_LENGTH];
+            s.read((char*)pch, sizeof(pch));
+            uint64 nShortID = 0;
+            for (unsigned int i = 0; i < SHORTTXIDS_LENGTH; i++)
+                nShortID |= (uint64)pch[i] << (8 * i);
+            vShortTxIDs.push_back(nShortID);
+        }
+        nCount = ReadCompactSize(s);
+        vPrefilledTxn.clear();
+        uint64 nIndex = 0;
+        for (uint64 n = 0; n < nCount; n++)
+        {
+            nIndex += ReadCompactSize(s) + (n ? 1 : 0);
+            if (nIndex > 0xffff)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs::Unserialize() : index overflow");
+            vPrefilledTxn.push_back(CPrefilledTransaction(nIndex, CTransaction()));
+            ::Unserialize(s, vPrefilledTxn.back().tx, nType, nVersion);
+        }
+        FillShortIDKeys();
+    }
+};
+
+/** The "getblocktxn" message: the indexes of the transactions of a compact
+ *  block that the receiver couldn't find, differentially encoded like the
+ *  indexes of prefilled transactions
+ */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> vIndexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        unsigned int nSize = sizeof(blockhash) + GetSizeOfCompactSize(vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            nSize += GetSizeOfCompactSize(vIndexes[i] - (i ? vIndexes[i-1] + 1 : 0));
+        return nSize;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        WriteCompactSize(s, vIndexes.size());
+        for (unsigned int i = 0; i < vIndexes.size(); i++)
+            WriteCompactSize(s, vIndexes[i] - (i ? vIndexes[i-1] + 1 : 0));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64 nCount = ReadCompactSize(s);
+        vIndexes.clear();
+        uint64 nIndex = 0;
+        for (uint64 n = 0; n < nCount; n++)
+        {
+            nIndex += ReadCompactSize(s) + (n ? 1 : 0);
+            if (nIndex > 0xffff)
+                throw std::ios_base::failure("CBlockTransactionsRequest::Unserialize() : index overflow");
+            vIndexes.push_back(nIndex);
+        }
+    }
+};
+
+/** The "blocktxn" message: the transactions asked for with "getblocktxn" */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being put together from a compact block, the memory pool and the
+ *  transactions that were missing from it
+ */
+class CPartialBlock
+{
+private:
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    // Take the prefilled transactions and those of pool that match a short ID.
+    // Returns false if the compact block can't be used (it's malformed, or
+    // has duplicate short IDs), so that the full block is to be asked for.
+    bool Init(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+
+    // Indexes of the transactions that are still missing, in increasing order
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+
+    // Fill in the missing transactions, in the order of GetMissing, and put
+    // the block together. Returns false if they don't fit, or the block
+    // doesn't match its merkle root (a short ID matched the wrong transaction).
+    bool FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
+#endif
@@ -46,6 +46,12 @@ typedef int socklen_t;
 #define SOCKET_ERROR        -1
 #endif
 
+// Sockets are opened with SOCK_CLOEXEC where it exists, so that the commands
+// run by -blocknotify and -walletnotify don't inherit them
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC        0
+#endif
+
 inline int myclosesocket(SOCKET& hSocket)
 {
     if (hSocket == INVALID_SOCKET)
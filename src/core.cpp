@@ -233,20 +233,51 @@ uint256 CBlockHeader::GetHash() const
 uint256 CBlock::BuildMerkleTree() const
 {
     vMerkleTree.clear();
+    if (vtx.empty())
+        return 0;
+
+    // Serialize all transactions back to back, and compute their txids in one batch
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    std::vector<unsigned int> vOffset;
+    vOffset.reserve(vtx.size() + 1);
     BOOST_FOREACH(const CTransaction& tx, vtx)
-        vMerkleTree.push_back(tx.GetHash());
+    {
+        vOffset.push_back(ss.size());
+        ss << tx;
+    }
+    vOffset.push_back(ss.size());
+
+    std::vector<std::pair<const unsigned char*, size_t> > vInputs;
+    vInputs.reserve(vtx.size());
+    const unsigned char* pchTxs = (const unsigned char*)&ss.begin()[0];
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        vInputs.push_back(std::make_pair(pchTxs + vOffset[i], (size_t)(vOffset[i+1] - vOffset[i])));
+    HashBatch(vInputs, vMerkleTree);
+
+    // Every level of the tree is hashed as one batch too. Sibling nodes are adjacent
+    // in vMerkleTree, so a pair can be hashed in place as 64 contiguous bytes; only
+    // an odd last node, which is paired with itself, needs to be copied.
+    std::vector<uint256> vLevel;
+    uint256 pairLast[2];
     int j = 0;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
+        vInputs.clear();
         for (int i = 0; i < nSize; i += 2)
         {
-            int i2 = std::min(i+1, nSize-1);
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+            if (i + 1 < nSize)
+                vInputs.push_back(std::make_pair((const unsigned char*)&vMerkleTree[j+i], (size_t)64));
+            else
+            {
+                pairLast[0] = pairLast[1] = vMerkleTree[j+i];
+                vInputs.push_back(std::make_pair((const unsigned char*)&pairLast[0], (size_t)64));
+            }
         }
+        HashBatch(vInputs, vLevel);
+        vMerkleTree.insert(vMerkleTree.end(), vLevel.begin(), vLevel.end());
         j += nSize;
     }
-    return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
+    return vMerkleTree.back();
 }
 
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
@@ -1,4 +1,5 @@
 #include "hash.h"
+#include "sha256.h"
 
 inline uint32_t ROTL32 ( uint32_t x, int8_t r )
 {
@@ -56,3 +57,60 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     return h1;
 }
+
+#define ROTL64(x, b) (uint64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val)
+{
+    // The specialization of SipHash-2-4 for a 32-byte message
+    uint64 v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64 v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64 v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64 v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64 m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64 b = ((uint64)32) << 56;
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void HashBatch(const std::vector<std::pair<const unsigned char*, size_t> >& vInputs, std::vector<uint256>& vOutputs)
+{
+    vOutputs.resize(vInputs.size());
+    if (vInputs.empty())
+        return;
+
+    std::vector<const unsigned char*> vpIn(vInputs.size());
+    std::vector<size_t> vnLen(vInputs.size());
+    for (unsigned int i = 0; i < vInputs.size(); i++)
+    {
+        vpIn[i] = vInputs[i].first;
+        vnLen[i] = vInputs[i].second;
+    }
+    SHA256DBatch(&vpIn[0], &vnLen[0], (unsigned char*)&vOutputs[0], vInputs.size());
+}
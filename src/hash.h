@@ -10,6 +10,7 @@
 
 #include <openssl/sha.h>
 #include <openssl/ripemd.h>
+#include <utility>
 #include <vector>
 
 template<typename T1>
@@ -97,6 +98,11 @@ inline uint256 Hash(const T1 p1begin, const T1 p1end,
     return hash2;
 }
 
+/** Compute Hash() of many independent byte ranges at once. The ranges are spread
+ *  over the lanes of the multi-buffer SHA256 engine (see sha256.h), so this is
+ *  considerably faster than hashing them one by one on SIMD-capable CPUs. */
+void HashBatch(const std::vector<std::pair<const unsigned char*, size_t> >& vInputs, std::vector<uint256>& vOutputs);
+
 template<typename T>
 uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL_VERSION)
 {
@@ -123,4 +129,9 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4 of a 256-bit value, keyed by (k0, k1). Used to hash txids in
+ *  in-memory tables with a per-table random key, so that peers cannot pick
+ *  transactions that collide in them. */
+uint64 SipHashUint256(uint64 k0, uint64 k1, const uint256& val);
+
 #endif
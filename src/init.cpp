@@ -14,6 +14,7 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "sha256.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -115,6 +116,7 @@ void Shutdown()
         if (pcoinsTip)
             pcoinsTip->Flush();
         delete pcoinsTip; pcoinsTip = NULL;
+        delete pcoinsWriter; pcoinsWriter = NULL;
         delete pcoinsdbview; pcoinsdbview = NULL;
         delete pblocktree; pblocktree = NULL;
     }
@@ -172,6 +174,7 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbwritebehind         " + _("Write the coin database in the background while validation continues, which halves the in-memory coins cache taken from -dbcache (default: 1)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
     strUsage += "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n";
@@ -193,6 +196,8 @@ std::string HelpMessage()
     strUsage += "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msghandlers=<n>       " + _("Set the number of threads handling peers' messages (up to 16, default: 4)") + "\n";
+    strUsage += "  -compactblocks         " + _("Ask for new blocks as compact blocks, made up from the memory pool (default: 1)") + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -237,7 +242,10 @@ std::string HelpMessage()
     strUsage += "  -txindex               " + _("Maintain a full transaction index (default: 0)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + "\n";
+    strUsage += "  -sigcachemb=<n>        " + _("Set the signature cache size in megabytes (default: 16)") + "\n";
     strUsage += "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n";
+    strUsage += "  -prefetchthreads=<n>   " + _("Set the number of threads reading block inputs ahead of validation (0 = off, up to 16, default: 4)") + "\n";
+    strUsage += "  -batchverify           " + _("Verify the signatures of standard scripts in blocks in batches (default: 1)") + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
@@ -410,9 +418,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#if USE_EPOLL
+    // Sockets are waited on with epoll, which isn't limited to FD_SETSIZE
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -433,6 +446,11 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nPrefetchThreads = std::max(0, std::min((int)GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS), MAX_PREFETCH_THREADS));
+    fBatchVerify = GetBoolArg("-batchverify", true);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
+    nMessageHandlerThreads = std::max(1, std::min((int)GetArg("-msghandlers", DEFAULT_MESSAGE_HANDLER_THREADS), MAX_MESSAGE_HANDLER_THREADS));
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -518,6 +536,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("Californium version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    printf("Using %s SHA256 backend for batched hashing\n", SHA256BackendName(SHA256GetBackend()));
     if (!fLogTimestamps)
         printf("Startup time: %s\n", DateTimeStrFormat("%Y-%m-%d %H:%M:%S", GetTime()).c_str());
     printf("Default data directory %s\n", GetDefaultDataDir().string().c_str());
@@ -534,6 +553,12 @@ bool AppInit2(boost::thread_group& threadGroup)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    if (nPrefetchThreads) {
+        printf("Using %u threads for input prefetching\n", nPrefetchThreads);
+        for (int i=0; i<nPrefetchThreads; i++)
+            threadGroup.create_thread(&ThreadPrefetchInputs);
+    }
+
     int64 nStart;
 
     // ********************************************************* Step 5: verify wallet database integrity
@@ -648,6 +673,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
 
+    std::string strSocketError;
+    if (!InitSocketEvents(strSocketError))
+        return InitError(strSocketError);
+
     bool fBound = false;
     if (!fNoListen) {
         if (mapArgs.count("-bind")) {
@@ -723,9 +752,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest bounds the memory used by the in-memory coins cache
+    if (GetBoolArg("-dbwritebehind", true))
+        nCoinCacheUsage /= 2; // a flushed cache is held until written, so it takes up to as much again
 
     bool fLoaded = false;
+    int64 nLoadTime = 0, nVerifyTime = 0;
     while (!fLoaded) {
         bool fReset = fReindex;
         std::string strLoadError;
@@ -737,12 +769,14 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
+                delete pcoinsWriter;
                 delete pcoinsdbview;
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+                pcoinsWriter = new CCoinsViewWriteBehind(*pcoinsdbview, GetBoolArg("-dbwritebehind", true));
+                pcoinsTip = new CCoinsViewCache(*pcoinsWriter);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -751,6 +785,7 @@ bool AppInit2(boost::thread_group& threadGroup)
                     strLoadError = _("Error loading block database");
                     break;
                 }
+                nLoadTime = GetTimeMillis() - nStart;
 
                 // If the loaded chain has a wrong genesis, bail out immediately
                 // (we're likely using a testnet datadir, or the other way around).
@@ -770,11 +805,13 @@ bool AppInit2(boost::thread_group& threadGroup)
                 }
 
                 uiInterface.InitMessage(_("Verifying blocks..."));
+                int64 nStartVerify = GetTimeMillis();
                 if (!VerifyDB(GetArg("-checklevel", 3),
                               GetArg( "-checkblocks", 288))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+                nVerifyTime = GetTimeMillis() - nStartVerify;
             } catch(std::exception &e) {
                 strLoadError = _("Error opening block database");
                 break;
@@ -810,7 +847,8 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Shutdown requested. Exiting.\n");
         return false;
     }
-    printf(" block index %15"PRI64d"ms\n", GetTimeMillis() - nStart);
+    printf(" block index %15"PRI64d"ms (%"PRIszu" entries, loaded in %"PRI64d"ms, verified in %"PRI64d"ms)\n",
+           GetTimeMillis() - nStart, mapBlockIndex.size(), nLoadTime, nVerifyTime);
 
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
@@ -822,7 +860,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -6,12 +6,73 @@
 #include <openssl/rand.h>
 #include <openssl/obj_mac.h>
 
+#include <map>
+
 #include "key.h"
 
 
 // anonymous namespace with local implementation code (OpenSSL interaction)
 namespace {
 
+// The secp256k1 group shared by all keys, with the multiples of the generator
+// precomputed, and the constants of the curve's endomorphism: for a point
+// (x, y), (beta*x, y) is the point multiplied by lambda.
+class CSecp256k1
+{
+public:
+    EC_GROUP *group;
+    BIGNUM *order;
+    BIGNUM *halforder;
+    BIGNUM *field;
+    BIGNUM *beta;
+    // Short vectors (a1, b1), (a2, b2) with a + b*lambda = 0 (mod n),
+    // to split a multiplier into two halves
+    BIGNUM *a1, *minusb1, *a2, *b2;
+
+    CSecp256k1()
+    {
+        BN_CTX *ctx = BN_CTX_new();
+        assert(ctx != NULL);
+        group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        assert(group != NULL);
+        assert(EC_GROUP_precompute_mult(group, ctx));
+
+        order = BN_new();
+        halforder = BN_new();
+        field = BN_new();
+        assert(EC_GROUP_get_order(group, order, ctx));
+        assert(BN_rshift1(halforder, order));
+        assert(EC_GROUP_get_curve_GFp(group, field, NULL, NULL, ctx));
+
+        beta = minusb1 = a1 = a2 = b2 = NULL;
+        assert(BN_hex2bn(&beta, "7ae96a2b657c07106e64479eac3434e99cf0497512f58995c1396c28719501ee"));
+        assert(BN_hex2bn(&a1, "3086d221a7d46bcde86c90e49284eb15"));
+        assert(BN_hex2bn(&minusb1, "e4437ed6010e88286f547fa90abfe4c3"));
+        assert(BN_hex2bn(&a2, "114ca50f7a8e2f3f657c1108d9d44cfd8"));
+        assert(BN_hex2bn(&b2, "3086d221a7d46bcde86c90e49284eb15"));
+        BN_CTX_free(ctx);
+    }
+
+    ~CSecp256k1()
+    {
+        BN_free(order);
+        BN_free(halforder);
+        BN_free(field);
+        BN_free(beta);
+        BN_free(a1);
+        BN_free(minusb1);
+        BN_free(a2);
+        BN_free(b2);
+        EC_GROUP_free(group);
+    }
+};
+
+const CSecp256k1 &GetSecp256k1()
+{
+    static CSecp256k1 secp256k1;
+    return secp256k1;
+}
+
 // Generate a private key from just the secret parameter
 int EC_KEY_regenerate_key(EC_KEY *eckey, BIGNUM *priv_key)
 {
@@ -123,6 +184,274 @@ err:
     return ret;
 }
 
+#if USE_GLV_VERIFY
+// Parse a signature, accepting nothing but its DER encoding, like ECDSA_verify
+ECDSA_SIG *ECDSA_SIG_parse_DER(const unsigned char *sigbuf, int siglen)
+{
+    ECDSA_SIG *sig = ECDSA_SIG_new();
+    const unsigned char *p = sigbuf;
+    unsigned char *der = NULL;
+    if (sig == NULL)
+        return NULL;
+    if (d2i_ECDSA_SIG(&sig, &p, siglen) != NULL) {
+        int derlen = i2d_ECDSA_SIG(sig, &der);
+        bool fStrict = (derlen == siglen && memcmp(sigbuf, der, derlen) == 0);
+        if (der != NULL) OPENSSL_free(der);
+        if (fStrict)
+            return sig;
+    }
+    ECDSA_SIG_free(sig);
+    return NULL;
+}
+
+// Whether r and s of a signature are in [1, n-1]
+bool ECDSA_SIG_in_range(const CSecp256k1 &curve, const ECDSA_SIG *sig)
+{
+    return !BN_is_zero(sig->r) && !BN_is_negative(sig->r) && BN_ucmp(sig->r, curve.order) < 0 &&
+           !BN_is_zero(sig->s) && !BN_is_negative(sig->s) && BN_ucmp(sig->s, curve.order) < 0;
+}
+
+// Split u (mod n) into k1 + k2*lambda, with k1 and k2 of about 128 bits each;
+// either may come out negative.
+// c1 = round(b2*u/n), c2 = round(-b1*u/n); k1 = u - c1*a1 - c2*a2, k2 = -c1*b1 - c2*b2
+int GLV_split(const CSecp256k1 &curve, const BIGNUM *u, BIGNUM *k1, BIGNUM *k2, BN_CTX *ctx)
+{
+    int ret = 0;
+    BN_CTX_start(ctx);
+    BIGNUM *c1 = BN_CTX_get(ctx);
+    BIGNUM *c2 = BN_CTX_get(ctx);
+    BIGNUM *t = BN_CTX_get(ctx);
+    if (t == NULL) goto err;
+    if (!BN_mul(t, curve.b2, u, ctx) || !BN_add(t, t, curve.halforder) || !BN_div(c1, NULL, t, curve.order, ctx)) goto err;
+    if (!BN_mul(t, curve.minusb1, u, ctx) || !BN_add(t, t, curve.halforder) || !BN_div(c2, NULL, t, curve.order, ctx)) goto err;
+    if (!BN_mul(t, c1, curve.a1, ctx) || !BN_sub(k1, u, t)) goto err;
+    if (!BN_mul(t, c2, curve.a2, ctx) || !BN_sub(k1, k1, t)) goto err;
+    if (!BN_mul(k2, c1, curve.minusb1, ctx)) goto err;
+    if (!BN_mul(t, c2, curve.b2, ctx) || !BN_sub(k2, k2, t)) goto err;
+    ret = 1;
+err:
+    BN_CTX_end(ctx);
+    return ret;
+}
+
+// Set QL to lambda*Q, for an affine point Q
+int EC_POINT_mul_lambda(const CSecp256k1 &curve, EC_POINT *QL, const EC_POINT *Q, BN_CTX *ctx)
+{
+    int ret = 0;
+    BN_CTX_start(ctx);
+    BIGNUM *x = BN_CTX_get(ctx);
+    BIGNUM *y = BN_CTX_get(ctx);
+    if (y == NULL) goto err;
+    if (!EC_POINT_get_affine_coordinates_GFp(curve.group, Q, x, y, ctx)) goto err;
+    if (!BN_mod_mul(x, x, curve.beta, curve.field, ctx)) goto err;
+    if (!EC_POINT_set_affine_coordinates_GFp(curve.group, QL, x, y, ctx)) goto err;
+    ret = 1;
+err:
+    BN_CTX_end(ctx);
+    return ret;
+}
+
+// Verify an ECDSA signature of a digest with a public key, with the same
+// outcome as ECDSA_verify with an EC_KEY of that public key:
+// -1 = error (including a signature that isn't DER), 0 = bad sig, 1 = good.
+//
+// The check is whether u1*G + u2*Q has x coordinate r (mod n), for
+// u1 = e/s and u2 = r/s. ECDSA_verify computes the sum from two 256-bit
+// multipliers. Here u2 is split into two 128-bit halves with
+// u2 = k1 + k2*lambda, so it becomes u1*G + k1*Q + k2*(lambda*Q), which
+// needs half the doublings, and u1*G uses the precomputed multiples of G.
+int ECDSA_verify_GLV(const unsigned char *pubkey, int pubkeylen, const unsigned char *dgst, int dgstlen, const unsigned char *sigbuf, int siglen)
+{
+    const CSecp256k1 &curve = GetSecp256k1();
+    const EC_GROUP *group = curve.group;
+
+    int ret = -1;
+    BN_CTX *ctx = NULL;
+    ECDSA_SIG *sig = NULL;
+    EC_POINT *Q = NULL;
+    EC_POINT *QL = NULL;
+    EC_POINT *R = NULL;
+    BIGNUM *e, *w, *u1, *u2, *k1, *k2, *x;
+    const EC_POINT *points[2];
+    const BIGNUM *scalars[2];
+
+    if ((sig = ECDSA_SIG_parse_DER(sigbuf, siglen)) == NULL) goto err;
+
+    if ((ctx = BN_CTX_new()) == NULL) goto err;
+    BN_CTX_start(ctx);
+    e = BN_CTX_get(ctx);
+    w = BN_CTX_get(ctx);
+    u1 = BN_CTX_get(ctx);
+    u2 = BN_CTX_get(ctx);
+    k1 = BN_CTX_get(ctx);
+    k2 = BN_CTX_get(ctx);
+    x = BN_CTX_get(ctx);
+    if (x == NULL) goto err;
+
+    if (!ECDSA_SIG_in_range(curve, sig)) { ret = 0; goto err; }
+
+    if ((Q = EC_POINT_new(group)) == NULL) goto err;
+    if (!EC_POINT_oct2point(group, Q, pubkey, pubkeylen, ctx)) goto err;
+
+    // u1 = e/s, u2 = r/s (mod n); the digest is no longer than n, so it is used whole
+    if (!BN_bin2bn(dgst, dgstlen, e)) goto err;
+    if (!BN_mod_inverse(w, sig->s, curve.order, ctx)) goto err;
+    if (!BN_mod_mul(u1, e, w, curve.order, ctx)) goto err;
+    if (!BN_mod_mul(u2, sig->r, w, curve.order, ctx)) goto err;
+    if (!GLV_split(curve, u2, k1, k2, ctx)) goto err;
+
+    // lambda*Q, and the points negated for negative halves
+    if ((QL = EC_POINT_new(group)) == NULL) goto err;
+    if (!EC_POINT_mul_lambda(curve, QL, Q, ctx)) goto err;
+    if (BN_is_negative(k1)) {
+        if (!EC_POINT_invert(group, Q, ctx)) goto err;
+        BN_set_negative(k1, 0);
+    }
+    if (BN_is_negative(k2)) {
+        if (!EC_POINT_invert(group, QL, ctx)) goto err;
+        BN_set_negative(k2, 0);
+    }
+
+    if ((R = EC_POINT_new(group)) == NULL) goto err;
+    points[0] = Q;
+    points[1] = QL;
+    scalars[0] = k1;
+    scalars[1] = k2;
+    if (!EC_POINTs_mul(group, R, u1, 2, points, scalars, ctx)) goto err;
+    if (!EC_POINT_get_affine_coordinates_GFp(group, R, x, NULL, ctx)) goto err;
+    if (!BN_nnmod(x, x, curve.order, ctx)) goto err;
+    ret = (BN_ucmp(x, sig->r) == 0);
+
+err:
+    if (ctx) {
+        BN_CTX_end(ctx);
+        BN_CTX_free(ctx);
+    }
+    if (sig != NULL) ECDSA_SIG_free(sig);
+    if (Q != NULL) EC_POINT_free(Q);
+    if (QL != NULL) EC_POINT_free(QL);
+    if (R != NULL) EC_POINT_free(R);
+    return ret;
+}
+
+// Verify a batch of signatures; true if all of them are good.
+//
+// Each signature gets the check of ECDSA_verify_GLV, but what can be shared
+// is done once for the batch:
+// - the s values are inverted together (Montgomery's trick), with one
+//   modular inversion and three multiplications per signature instead of
+//   an inversion each;
+// - a public key that signed more than once is decoded, and multiplied by
+//   lambda, once;
+// - the sums are brought to affine coordinates together, with one field
+//   inversion instead of one per signature.
+// The sums themselves can't be merged into a single multi-scalar
+// multiplication, as with Schnorr signatures: an ECDSA signature holds the
+// x coordinate of R only, so R isn't known to add in.
+bool ECDSA_verify_GLV_batch(const std::vector<CPendingSignature> &vSigs)
+{
+    const CSecp256k1 &curve = GetSecp256k1();
+    const EC_GROUP *group = curve.group;
+    size_t nSigs = vSigs.size();
+    if (nSigs == 0)
+        return true;
+
+    bool ret = false;
+    BN_CTX *ctx = NULL;
+    std::vector<ECDSA_SIG*> vSig(nSigs, (ECDSA_SIG*)NULL);
+    std::vector<BIGNUM*> vInv(nSigs, (BIGNUM*)NULL); // 1/s, by way of the products of the s values before it
+    std::vector<EC_POINT*> vR(nSigs, (EC_POINT*)NULL);
+    std::vector<EC_POINT*> vKeyPoints;               // Q, -Q, lambda*Q and -lambda*Q of each key
+    std::vector<size_t> vKey(nSigs);                 // index of the key's points
+    std::map<CPubKey, size_t> mapKey;
+    BIGNUM *e, *u1, *u2, *k1, *k2, *x, *inv;
+    const EC_POINT *points[2];
+    const BIGNUM *scalars[2];
+
+    if ((ctx = BN_CTX_new()) == NULL) goto err;
+    BN_CTX_start(ctx);
+    e = BN_CTX_get(ctx);
+    u1 = BN_CTX_get(ctx);
+    u2 = BN_CTX_get(ctx);
+    k1 = BN_CTX_get(ctx);
+    k2 = BN_CTX_get(ctx);
+    x = BN_CTX_get(ctx);
+    inv = BN_CTX_get(ctx);
+    if (inv == NULL) goto err;
+
+    for (size_t i = 0; i < nSigs; i++) {
+        const CPendingSignature &pending = vSigs[i];
+        if (!pending.pubkey.IsValid() || pending.vchSig.empty()) goto err;
+        if ((vSig[i] = ECDSA_SIG_parse_DER(&pending.vchSig[0], pending.vchSig.size())) == NULL) goto err;
+        if (!ECDSA_SIG_in_range(curve, vSig[i])) goto err;
+
+        std::pair<std::map<CPubKey, size_t>::iterator, bool> ins = mapKey.insert(std::make_pair(pending.pubkey, vKeyPoints.size()));
+        vKey[i] = ins.first->second;
+        if (!ins.second)
+            continue;
+        for (int j = 0; j < 4; j++) {
+            vKeyPoints.push_back(EC_POINT_new(group));
+            if (vKeyPoints.back() == NULL) goto err;
+        }
+        EC_POINT **pQ = &vKeyPoints[vKey[i]];
+        if (!EC_POINT_oct2point(group, pQ[0], pending.pubkey.begin(), pending.pubkey.size(), ctx)) goto err;
+        if (!EC_POINT_mul_lambda(curve, pQ[2], pQ[0], ctx)) goto err;
+        if (!EC_POINT_copy(pQ[1], pQ[0]) || !EC_POINT_invert(group, pQ[1], ctx)) goto err;
+        if (!EC_POINT_copy(pQ[3], pQ[2]) || !EC_POINT_invert(group, pQ[3], ctx)) goto err;
+    }
+
+    // vInv[i] = s[0]*...*s[i], then inv = 1/(s[0]*...*s[n-1]), and walking
+    // back, vInv[i] = inv*s[0]*...*s[i-1] = 1/s[i]
+    for (size_t i = 0; i < nSigs; i++) {
+        if ((vInv[i] = BN_new()) == NULL) goto err;
+        if (i == 0 ? !BN_copy(vInv[i], vSig[i]->s) : !BN_mod_mul(vInv[i], vInv[i-1], vSig[i]->s, curve.order, ctx)) goto err;
+    }
+    if (!BN_mod_inverse(inv, vInv[nSigs-1], curve.order, ctx)) goto err;
+    for (size_t i = nSigs - 1; i > 0; i--) {
+        if (!BN_mod_mul(vInv[i], inv, vInv[i-1], curve.order, ctx)) goto err;
+        if (!BN_mod_mul(inv, inv, vSig[i]->s, curve.order, ctx)) goto err;
+    }
+    if (!BN_copy(vInv[0], inv)) goto err;
+
+    for (size_t i = 0; i < nSigs; i++) {
+        if (!BN_bin2bn((const unsigned char*)&vSigs[i].hash, sizeof(vSigs[i].hash), e)) goto err;
+        if (!BN_mod_mul(u1, e, vInv[i], curve.order, ctx)) goto err;
+        if (!BN_mod_mul(u2, vSig[i]->r, vInv[i], curve.order, ctx)) goto err;
+        if (!GLV_split(curve, u2, k1, k2, ctx)) goto err;
+        points[0] = vKeyPoints[vKey[i] + (BN_is_negative(k1) ? 1 : 0)];
+        points[1] = vKeyPoints[vKey[i] + (BN_is_negative(k2) ? 3 : 2)];
+        BN_set_negative(k1, 0);
+        BN_set_negative(k2, 0);
+        scalars[0] = k1;
+        scalars[1] = k2;
+        if ((vR[i] = EC_POINT_new(group)) == NULL) goto err;
+        if (!EC_POINTs_mul(group, vR[i], u1, 2, points, scalars, ctx)) goto err;
+    }
+
+    if (!EC_POINTs_make_affine(group, nSigs, &vR[0], ctx)) goto err;
+    for (size_t i = 0; i < nSigs; i++) {
+        if (!EC_POINT_get_affine_coordinates_GFp(group, vR[i], x, NULL, ctx)) goto err;
+        if (!BN_nnmod(x, x, curve.order, ctx)) goto err;
+        if (BN_ucmp(x, vSig[i]->r) != 0) goto err;
+    }
+    ret = true;
+
+err:
+    if (ctx) {
+        BN_CTX_end(ctx);
+        BN_CTX_free(ctx);
+    }
+    for (size_t i = 0; i < nSigs; i++) {
+        if (vSig[i] != NULL) ECDSA_SIG_free(vSig[i]);
+        if (vInv[i] != NULL) BN_free(vInv[i]);
+        if (vR[i] != NULL) EC_POINT_free(vR[i]);
+    }
+    for (size_t i = 0; i < vKeyPoints.size(); i++)
+        if (vKeyPoints[i] != NULL) EC_POINT_free(vKeyPoints[i]);
+    return ret;
+}
+#endif
+
 // RAII Wrapper around OpenSSL's EC_KEY
 class CECKey {
 private:
@@ -130,8 +459,10 @@ private:
 
 public:
     CECKey() {
-        pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        // A copy of the shared group, which shares its precomputed multiples
+        pkey = EC_KEY_new();
         assert(pkey != NULL);
+        assert(EC_KEY_set_group(pkey, GetSecp256k1().group));
     }
 
     ~CECKey() {
@@ -343,12 +674,29 @@ bool CKey::SignCompact(const uint256 &hash, std::vector<unsigned char>& vchSig)
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
     if (!IsValid())
         return false;
+#if USE_GLV_VERIFY
+    if (vchSig.empty())
+        return false;
+    return ECDSA_verify_GLV(begin(), size(), (unsigned char*)&hash, sizeof(hash), &vchSig[0], vchSig.size()) == 1;
+#else
     CECKey key;
     if (!key.SetPubKey(*this))
         return false;
     if (!key.Verify(hash, vchSig))
         return false;
     return true;
+#endif
+}
+
+bool VerifySignatureBatch(const std::vector<CPendingSignature> &vSigs) {
+#if USE_GLV_VERIFY
+    return ECDSA_verify_GLV_batch(vSigs);
+#else
+    for (unsigned int i = 0; i < vSigs.size(); i++)
+        if (!vSigs[i].pubkey.Verify(vSigs[i].hash, vSigs[i].vchSig))
+            return false;
+    return true;
+#endif
 }
 
 bool CPubKey::RecoverCompact(const uint256 &hash, const std::vector<unsigned char>& vchSig) {
@@ -163,6 +163,21 @@ public:
     bool Decompress();
 };
 
+/** A DER signature of a hash, waiting to be verified with others. */
+struct CPendingSignature {
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+
+    CPendingSignature() {}
+    CPendingSignature(const CPubKey &pubkeyIn, const uint256 &hashIn, const std::vector<unsigned char> &vchSigIn) :
+        pubkey(pubkeyIn), hash(hashIn), vchSig(vchSigIn) {}
+};
+
+// Verify all of vSigs; true if every one of them is valid, as CPubKey::Verify
+// would tell. Doesn't say which signature failed.
+bool VerifySignatureBatch(const std::vector<CPendingSignature> &vSigs);
+
 
 // secure_allocator is defined in allocators.h
 // CPrivKey is a serialized private key, with all parameters included (279 bytes)
@@ -50,6 +50,10 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear() {
+        batch.Clear();
+    }
 };
 
 class CLevelDB
@@ -13,9 +13,13 @@
 #include "ui_interface.h"
 #include "checkqueue.h"
 #include "chainparams.h"
+#include "sha256.h"
+#include "blockfile.h"
+#include "compactblock.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 using namespace boost;
@@ -28,12 +32,50 @@ CCriticalSection cs_setpwalletRegistered;
 set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
+CCriticalSection cs_blockIndex;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+
+/** Storage for the entries of mapBlockIndex. They are allocated in large
+ *  chunks rather than one by one, and stay where they are until the block
+ *  index is unloaded, or at shutdown.
+ */
+class CBlockIndexArena
+{
+private:
+    static const unsigned int nChunkEntries = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(nChunkEntries) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Allocate()
+    {
+        if (nUsed == nChunkEntries) {
+            vChunks.push_back(new CBlockIndex[nChunkEntries]);
+            nUsed = 0;
+        }
+        return &vChunks.back()[nUsed++];
+    }
+
+    void Clear()
+    {
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = nChunkEntries;
+    }
+};
+static CBlockIndexArena arenaBlockIndex;
+
 std::vector<CBlockIndex*> vBlockIndexByHeight;
+CBlockIndex* pindexBestHeader = NULL; // end of the header chain with the most work
+std::vector<CBlockIndex*> vHeaderIndexByHeight;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
@@ -43,11 +85,14 @@ CBlockIndex* pindexBest = NULL;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
+bool fBatchVerify = true;
+bool fCompactBlocks = true;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
 bool fTxIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 bool fHaveGUI = false;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -60,6 +105,16 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 map<uint256, CBlock*> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Blocks we have the transactions of, but not yet those of all their ancestors, by parent
+multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
+
+// Blocks requested from peers, with the peer asked and the time of the request
+map<uint256, pair<CNode*, int64> > mapBlocksInFlight;
+
+// Blocks in flight that came as compact blocks, waiting for the transactions
+// they were missing
+map<uint256, CPartialBlock> mapPartialBlocks;
+
 map<uint256, CDataStream*> mapOrphanTransactions;
 map<uint256, map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
 
@@ -196,7 +251,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 
 CBlockLocator::CBlockLocator(uint256 hashBlock)
 {
-    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi != mapBlockIndex.end())
         Set((*mi).second);
 }
@@ -208,14 +263,20 @@ void CBlockLocator::Set(const CBlockIndex* pindex)
     while (pindex)
     {
         vHave.push_back(pindex->GetBlockHash());
+        if (pindex->nHeight == 0)
+            break;
 
         // Exponentially larger steps back
-        for (int i = 0; pindex && i < nStep; i++)
-            pindex = pindex->pprev;
+        int nHeight = std::max(pindex->nHeight - nStep, 0);
+        if (pindex->IsInMainChain())
+            pindex = vBlockIndexByHeight[nHeight];
+        else
+            pindex = pindex->GetAncestor(nHeight);
         if (vHave.size() > 10)
             nStep *= 2;
     }
-    vHave.push_back(Params().HashGenesisBlock());
+    if (vHave.empty() || vHave.back() != Params().HashGenesisBlock())
+        vHave.push_back(Params().HashGenesisBlock());
 }
 
 int CBlockLocator::GetDistanceBack()
@@ -225,7 +286,7 @@ int CBlockLocator::GetDistanceBack()
     int nStep = 1;
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -244,7 +305,7 @@ CBlockIndex *CBlockLocator::GetBlockIndex()
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -260,7 +321,7 @@ uint256 CBlockLocator::GetBlockHash()
     // Find the first block the caller has in the main chain
     BOOST_FOREACH(const uint256& hash, vHave)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
         if (mi != mapBlockIndex.end())
         {
             CBlockIndex* pindex = (*mi).second;
@@ -289,7 +350,7 @@ bool CCoinsView::SetCoins(const uint256 &txid, const CCoins &coins) { return fal
 bool CCoinsView::HaveCoins(const uint256 &txid) { return false; }
 CBlockIndex *CCoinsView::GetBestBlock() { return NULL; }
 bool CCoinsView::SetBestBlock(CBlockIndex *pindex) { return false; }
-bool CCoinsView::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return false; }
+bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) { return false; }
 
 
@@ -300,46 +361,67 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) { return base->HaveCoins(t
 CBlockIndex *CCoinsViewBacked::GetBestBlock() { return base->GetBestBlock(); }
 bool CCoinsViewBacked::SetBestBlock(CBlockIndex *pindex) { return base->SetBestBlock(pindex); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
-bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
+bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), cachedCoinsUsage(0), nLookups(0), nMisses(0) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
-    if (cacheCoins.count(txid)) {
-        coins = cacheCoins[txid];
-        return true;
-    }
-    if (base->GetCoins(txid, coins)) {
-        cacheCoins[txid] = coins;
-        return true;
-    }
-    return false;
+    CCoinsMap::iterator it = FetchCoins(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->coins;
+    return true;
 }
 
-std::map<uint256,CCoins>::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = cacheCoins.lower_bound(txid);
-    if (it != cacheCoins.end() && it->first == txid)
+CCoinsMap::iterator CCoinsViewCache::FetchCoins(const uint256 &txid) {
+    nLookups++;
+    CCoinsMap::iterator it = cacheCoins.find(txid);
+    if (it != cacheCoins.end())
         return it;
+    nMisses++;
     CCoins tmp;
     if (!base->GetCoins(txid,tmp))
         return cacheCoins.end();
-    std::map<uint256,CCoins>::iterator ret = cacheCoins.insert(it, std::make_pair(txid, CCoins()));
-    tmp.swap(ret->second);
+    CCoinsMap::iterator ret = cacheCoins.insert(txid).first;
+    tmp.swap(ret->coins);
+    ret->nUsage = ret->coins.DynamicMemoryUsage();
+    cachedCoinsUsage += ret->nUsage;
     return ret;
 }
 
 CCoins &CCoinsViewCache::GetCoins(const uint256 &txid) {
-    std::map<uint256,CCoins>::iterator it = FetchCoins(txid);
+    CCoinsMap::iterator it = FetchCoins(txid);
+    assert(it != cacheCoins.end());
+    it->nFlags |= CCoinsCacheEntry::DIRTY;
+    return it->coins;
+}
+
+const CCoins &CCoinsViewCache::AccessCoins(const uint256 &txid) {
+    CCoinsMap::iterator it = FetchCoins(txid);
     assert(it != cacheCoins.end());
-    return it->second;
+    return it->coins;
 }
 
 bool CCoinsViewCache::SetCoins(const uint256 &txid, const CCoins &coins) {
-    cacheCoins[txid] = coins;
+    CCoinsMap::iterator it = cacheCoins.insert(txid).first;
+    it->coins = coins;
+    it->nFlags |= CCoinsCacheEntry::DIRTY;
+    cachedCoinsUsage -= it->nUsage;
+    it->nUsage = it->coins.DynamicMemoryUsage();
+    cachedCoinsUsage += it->nUsage;
     return true;
 }
 
+bool CCoinsViewCache::SetNewCoins(const uint256 &txid, const CCoins &coins) {
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(txid);
+    // An existing entry, such as the spent coins of an earlier transaction
+    // with the same txid, may have a version in the base already.
+    if (ret.second)
+        ret.first->nFlags |= CCoinsCacheEntry::FRESH;
+    return SetCoins(txid, coins);
+}
+
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) {
     return FetchCoins(txid) != cacheCoins.end();
 }
@@ -355,17 +437,36 @@ bool CCoinsViewCache::SetBestBlock(CBlockIndex *pindex) {
     return true;
 }
 
-bool CCoinsViewCache::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        cacheCoins[it->first] = it->second;
+bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        // Unmodified coins are the same as ours, or as our base's
+        if (!(it->nFlags & CCoinsCacheEntry::DIRTY))
+            continue;
+        CCoinsMap::iterator itUs = cacheCoins.find(it->txid);
+        if (itUs == cacheCoins.end()) {
+            // Created and spent in the child, without ever reaching us
+            if ((it->nFlags & CCoinsCacheEntry::FRESH) && it->coins.IsPruned())
+                continue;
+            itUs = cacheCoins.insert(it->txid).first;
+            itUs->nFlags = it->nFlags & CCoinsCacheEntry::FRESH;
+        }
+        // If our entry is FRESH, it stays so: our base still doesn't have it
+        itUs->coins.swap(it->coins);
+        itUs->nFlags |= CCoinsCacheEntry::DIRTY;
+        cachedCoinsUsage -= itUs->nUsage;
+        itUs->nUsage = itUs->coins.DynamicMemoryUsage();
+        cachedCoinsUsage += itUs->nUsage;
+    }
     pindexTip = pindex;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
-    if (fOk)
+    if (fOk) {
         cacheCoins.clear();
+        cachedCoinsUsage = 0;
+    }
     return fOk;
 }
 
@@ -373,6 +474,32 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const {
+    return cacheCoins.DynamicMemoryUsage() + cachedCoinsUsage;
+}
+
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
+    return cacheCoins.find(txid) != cacheCoins.end();
+}
+
+void CCoinsViewCache::AddPrefetchedCoins(const uint256 &txid, CCoins &coins, bool fFound) {
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(txid);
+    if (!ret.second)
+        return;
+    if (fFound) {
+        ret.first->coins.swap(coins);
+        ret.first->nUsage = ret.first->coins.DynamicMemoryUsage();
+        cachedCoinsUsage += ret.first->nUsage;
+    } else {
+        ret.first->nFlags = CCoinsCacheEntry::FRESH;
+    }
+}
+
+void CCoinsViewCache::GetFetchStats(uint64 &nLookupsOut, uint64 &nMissesOut) const {
+    nLookupsOut = nLookups;
+    nMissesOut = nMisses;
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -393,6 +520,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewWriteBehind *pcoinsWriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -685,7 +813,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1041,7 +1169,7 @@ int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1178,6 +1306,21 @@ CBlockIndex* FindBlockByHeight(int nHeight)
     return vBlockIndexByHeight[nHeight];
 }
 
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb)
+{
+    if (pa == NULL || pb == NULL)
+        return NULL;
+    if (pa->nHeight > pb->nHeight)
+        pa = pa->GetAncestor(pb->nHeight);
+    else if (pb->nHeight > pa->nHeight)
+        pb = pb->GetAncestor(pa->nHeight);
+    while (pa != pb && pa && pb) {
+        pa = pa->pprev;
+        pb = pb->pprev;
+    }
+    return pa == pb ? pa : NULL;
+}
+
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
 {
     // Open history file to append
@@ -1204,18 +1347,22 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+// Block files are mapped into memory, so reading a block costs no system call
+// once its file is mapped. Keep fewer mappings where address space is scarce.
+static CBlockFileReader blockfilereader("blk", sizeof(void*) >= 8 ? 64 : 4);
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (!filein)
-        return error("ReadBlockFromDisk(CBlock&, CDiskBlockPos&) : OpenBlockFile failed");
+    CBlockFileSpan span;
+    if (!blockfilereader.ReadBlock(pos, span))
+        return error("ReadBlockFromDisk(CBlock&, CDiskBlockPos&) : reading block file failed");
 
     // Read block
     try {
-        filein >> block;
+        CSpanReader reader(span.begin(), span.end(), SER_DISK, CLIENT_VERSION);
+        reader >> block;
     }
     catch (std::exception &e) {
         return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1237,6 +1384,15 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CBlockIndex* pindex)
+{
+    if (!blockfilereader.ReadBlock(pindex->GetBlockPos(), span))
+        return error("ReadRawBlockFromDisk() : reading block file failed");
+    if (span.size() < 80 || Hash(span.begin(), span.begin() + 80) != pindex->GetBlockHash())
+        return error("ReadRawBlockFromDisk() : block header doesn't match index");
+    return true;
+}
+
 uint256 static GetOrphanRoot(const CBlockHeader* pblock)
 {
     // Work back to the first block in the orphan chain
@@ -1277,7 +1433,7 @@ static const int64 nTargetTimespanAdjDown = nTargetTimespan * (100 + nMaxAdjustD
 // minimum amount of work that could possibly be required nTime after
 // minimum work required was nBase
 //
-CBigNum bnProofOfWorkLimit = CBigNum(~uint256(0) >> 20); // yes, totally sloppy.  Fuck off.
+uint256 bnProofOfWorkLimit = ~uint256(0) >> 20; // yes, totally sloppy.  Fuck off.
 
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
 {
@@ -1286,7 +1442,7 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     if (TestNet() && nTime > nTargetSpacing*2)
         return bnProofOfWorkLimit.GetCompact();
 
-    CBigNum bnResult;
+    uint256 bnResult;
     bnResult.SetCompact(nBase);
     while (nTime > 0 && bnResult < bnProofOfWorkLimit)
     {
@@ -1344,29 +1500,49 @@ unsigned int static GetNextWorkRequired_V1(const CBlockIndex* pindexLast, const
 
     // Limit adjustment step
     int64 nActualTimespan = pindexLast->GetBlockTime() - pindexFirst->GetBlockTime();
-    printf("  nActualTimespan = %"PRI64d"  before bounds\n", nActualTimespan);
+    if (fDebug)
+        printf("  nActualTimespan = %"PRI64d"  before bounds\n", nActualTimespan);
     if (nActualTimespan < nMinActualTimespan)
         nActualTimespan = nMinActualTimespan;
     if (nActualTimespan > nMaxActualTimespan)
         nActualTimespan = nMaxActualTimespan;
 
     // Retarget
-    CBigNum bnNew;
+    uint256 bnNew;
     bnNew.SetCompact(pindexLast->nBits);
-    bnNew *= nActualTimespan;
-    bnNew /= nAveragingTargetTimespan;
-
-    if (bnNew > Params().ProofOfWorkLimit())
+    if (!bnNew.MulDiv(nActualTimespan, nAveragingTargetTimespan) || bnNew > Params().ProofOfWorkLimit())
         bnNew = Params().ProofOfWorkLimit();
 
     /// debug print
-    printf("GetNextWorkRequired RETARGET\n");
-    printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nAveragingTargetTimespan, nActualTimespan);
-    printf("Before: %08x  %s\n", pindexLast->nBits, CBigNum().SetCompact(pindexLast->nBits).getuint256().ToString().c_str());
-    printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    if (fDebug)
+    {
+        printf("GetNextWorkRequired RETARGET\n");
+        printf("nTargetTimespan = %"PRI64d"    nActualTimespan = %"PRI64d"\n", nAveragingTargetTimespan, nActualTimespan);
+        printf("Before: %08x  %s\n", pindexLast->nBits, uint256().SetCompact(pindexLast->nBits).ToString().c_str());
+        printf("After:  %08x  %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
+    }
 
     return bnNew.GetCompact();
 }
+
+// The event horizon of Kimoto Gravity Well after looking at nMass blocks. It is
+// the same for every retarget, and pow() is the most expensive part of each
+// step of the well, so it is computed once for the masses that are used.
+double static KimotoEventHorizonDeviation(uint64 nMass)
+{
+    static const uint64 nCachedMasses = 1024;
+    static struct CDeviations {
+        double d[nCachedMasses];
+        CDeviations() {
+            for (uint64 n = 0; n < nCachedMasses; n++)
+                d[n] = 1 + (0.7084 * pow((double(n)/double(28.2)), -1.228));
+        }
+    } deviations;
+    if (nMass < nCachedMasses)
+        return deviations.d[nMass];
+    return 1 + (0.7084 * pow((double(nMass)/double(28.2)), -1.228));
+}
+
 unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBlockHeader *pblock, uint64 TargetBlocksSpacingSeconds, uint64 PastBlocksMin, uint64 PastBlocksMax) {
         /* current difficulty formula, megacoin - kimoto gravity well */
         const CBlockIndex *BlockLastSolved = pindexLast;
@@ -1377,8 +1553,8 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
         int64 PastRateActualSeconds = 0;
         int64 PastRateTargetSeconds = 0;
         double PastRateAdjustmentRatio = double(1);
-        CBigNum PastDifficultyAverage;
-        CBigNum PastDifficultyAveragePrev;
+        uint256 PastDifficultyAverage;
+        uint256 PastDifficultyAveragePrev;
         double EventHorizonDeviation;
         double EventHorizonDeviationFast;
         double EventHorizonDeviationSlow;
@@ -1390,7 +1566,12 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
                 PastBlocksMass++;
                 
                 if (i == 1) { PastDifficultyAverage.SetCompact(BlockReading->nBits); }
-                else { PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev; }
+                else {
+                        // Moves towards the new value by a fraction of the difference, rounded towards the old value
+                        uint256 bnReading = uint256().SetCompact(BlockReading->nBits);
+                        if (bnReading >= PastDifficultyAveragePrev) { PastDifficultyAverage = PastDifficultyAveragePrev + (bnReading - PastDifficultyAveragePrev) / i; }
+                        else { PastDifficultyAverage = PastDifficultyAveragePrev - (PastDifficultyAveragePrev - bnReading) / i; }
+                }
                 PastDifficultyAveragePrev = PastDifficultyAverage;
                 
                 PastRateActualSeconds = BlockLastSolved->GetBlockTime() - BlockReading->GetBlockTime();
@@ -1400,7 +1581,7 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
                 if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
                 PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
                 }
-                EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(28.2)), -1.228));
+                EventHorizonDeviation = KimotoEventHorizonDeviation(PastBlocksMass);
                 EventHorizonDeviationFast = EventHorizonDeviation;
                 EventHorizonDeviationSlow = 1 / EventHorizonDeviation;
                 
@@ -1411,18 +1592,20 @@ unsigned int static KimotoGravityWell(const CBlockIndex* pindexLast, const CBloc
                 BlockReading = BlockReading->pprev;
         }
         
-        CBigNum bnNew(PastDifficultyAverage);
+        uint256 bnNew(PastDifficultyAverage);
+        bool fFits = true;
         if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
-                bnNew *= PastRateActualSeconds;
-                bnNew /= PastRateTargetSeconds;
+                fFits = bnNew.MulDiv(PastRateActualSeconds, PastRateTargetSeconds);
         }
-    if (bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
+    if (!fFits || bnNew > bnProofOfWorkLimit) { bnNew = bnProofOfWorkLimit; }
         
     /// debug print
-    printf("Difficulty Retarget - Kimoto Gravity Well\n");
-    printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
-    printf("Before: %08x %s\n", BlockLastSolved->nBits, CBigNum().SetCompact(BlockLastSolved->nBits).getuint256().ToString().c_str());
-    printf("After: %08x %s\n", bnNew.GetCompact(), bnNew.getuint256().ToString().c_str());
+    if (fDebug) {
+        printf("Difficulty Retarget - Kimoto Gravity Well\n");
+        printf("PastRateAdjustmentRatio = %g\n", PastRateAdjustmentRatio);
+        printf("Before: %08x %s\n", BlockLastSolved->nBits, uint256().SetCompact(BlockLastSolved->nBits).ToString().c_str());
+        printf("After: %08x %s\n", bnNew.GetCompact(), bnNew.ToString().c_str());
+    }
         
         return bnNew.GetCompact();
 }
@@ -1436,10 +1619,14 @@ unsigned int static GetNextWorkRequired_V2(const CBlockIndex* pindexLast, const
         uint64 PastBlocksMin = PastSecondsMin / BlocksTargetSpacing;
         uint64 PastBlocksMax = PastSecondsMax / BlocksTargetSpacing;
         
-        return KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+        // The well only looks at pindexLast and its ancestors, so its outcome is
+        // kept for every other header, block and block template built on pindexLast
+        if (pindexLast->nNextBits == 0)
+                pindexLast->nNextBits = KimotoGravityWell(pindexLast, pblock, BlocksTargetSpacing, PastBlocksMin, PastBlocksMax);
+        return pindexLast->nNextBits;
 }
 
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
         int DiffMode = 1;
         if (TestNet()) {
@@ -1456,15 +1643,16 @@ unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBl
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    uint256 bnTarget;
+    bool fNegative, fOverflow;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > Params().ProofOfWorkLimit())
+    if (fNegative || fOverflow || bnTarget == 0 || bnTarget > Params().ProofOfWorkLimit())
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1491,6 +1679,46 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
 }
 
+// Make pindex the end of the best header chain
+void static SetBestHeader(CBlockIndex* pindex)
+{
+    pindexBestHeader = pindex;
+    vHeaderIndexByHeight.resize(pindex->nHeight + 1);
+    while (pindex && vHeaderIndexByHeight[pindex->nHeight] != pindex) {
+        vHeaderIndexByHeight[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+// Find the header chain with the most work that isn't known to be invalid
+void static FindBestHeader()
+{
+    while (true) {
+        CBlockIndex *pindexNew = NULL;
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+            CBlockIndex *pindex = item.second;
+            if (!(pindex->nStatus & BLOCK_FAILED_MASK) && (pindexNew == NULL || CBlockIndexWorkComparator()(pindexNew, pindex)))
+                pindexNew = pindex;
+        }
+        if (pindexNew == NULL)
+            return;
+
+        // Headers are only marked invalid themselves; check their ancestors too
+        CBlockIndex *pindexFailed = NULL;
+        for (CBlockIndex *pindex = pindexNew; pindex && !pindex->IsInMainChain(); pindex = pindex->pprev)
+            if (pindex->nStatus & BLOCK_FAILED_MASK)
+                pindexFailed = pindex;
+        if (pindexFailed == NULL) {
+            SetBestHeader(pindexNew);
+            return;
+        }
+        for (CBlockIndex *pindex = pindexNew; pindex != pindexFailed; pindex = pindex->pprev) {
+            pindex->nStatus |= BLOCK_FAILED_CHILD;
+            pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+        }
+    }
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (pindexNew->nChainWork > nBestInvalidWork)
@@ -1506,8 +1734,11 @@ void static InvalidChainFound(CBlockIndex* pindexNew)
     printf("InvalidChainFound:  current best=%s  height=%d  log2_work=%.8g  date=%s\n",
       hashBestChain.ToString().c_str(), nBestHeight, log(nBestChainWork.getdouble())/log(2.0),
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
         printf("InvalidChainFound: Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.\n");
+
+    // Stop downloading the invalid chain
+    FindBestHeader();
 }
 
 void static InvalidBlockFound(CBlockIndex *pindex) {
@@ -1557,11 +1788,25 @@ bool ConnectBestBlock(CValidationState &state) {
 
             if (pindexTest->pprev == NULL || pindexTest->GetNextInMainChain()) {
                 reverse(vAttach.begin(), vAttach.end());
-                BOOST_FOREACH(CBlockIndex *pindexSwitch, vAttach) {
+                // Connect the run up to MAX_BLOCKS_TO_CONNECT blocks at a time, so
+                // SetBestChain can pipeline the blocks of each part
+                for (unsigned int nFirst = 0; nFirst < vAttach.size(); nFirst += MAX_BLOCKS_TO_CONNECT) {
                     boost::this_thread::interruption_point();
+                    unsigned int nLast = std::min(nFirst + MAX_BLOCKS_TO_CONNECT, (unsigned int)vAttach.size()) - 1;
                     try {
-                        if (!SetBestChain(state, pindexSwitch))
-                            return false;
+                        if (SetBestChain(state, vAttach[nLast]))
+                            continue;
+                        // Nothing of the part was connected. Still connect the
+                        // blocks before the one that failed, as the tip would
+                        // have moved to them when connected one by one.
+                        unsigned int nFailed = nFirst;
+                        while (nFailed < nLast && !(vAttach[nFailed]->nStatus & BLOCK_FAILED_MASK))
+                            nFailed++;
+                        if (state.IsInvalid() && nFailed > nFirst) {
+                            CValidationState statePrefix;
+                            SetBestChain(statePrefix, vAttach[nFailed - 1]);
+                        }
+                        return false;
                     } catch(std::runtime_error &e) {
                         return state.Abort(_("System error: ") + e.what());
                     }
@@ -1594,7 +1839,7 @@ void UpdateTime(CBlockHeader& block, const CBlockIndex* pindexPrev)
 
 const CTxOut &CCoinsViewCache::GetOutputFor(const CTxIn& input)
 {
-    const CCoins &coins = GetCoins(input.prevout.hash);
+    const CCoins &coins = AccessCoins(input.prevout.hash);
     assert(coins.IsAvailable(input.prevout.n));
     return coins.vout[input.prevout.n];
 }
@@ -1624,7 +1869,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
     }
 
     // add outputs
-    assert(inputs.SetCoins(txhash, CCoins(tx, nHeight)));
+    assert(inputs.SetNewCoins(txhash, CCoins(tx, nHeight)));
 }
 
 bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
@@ -1640,7 +1885,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
         // then check whether the actual outputs are available
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins &coins = GetCoins(prevout.hash);
+            const CCoins &coins = AccessCoins(prevout.hash);
             if (!coins.IsAvailable(prevout.n))
                 return false;
         }
@@ -1650,17 +1895,27 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
 
 bool CScriptCheck::operator()() const {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashContext))
         return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().c_str());
     return true;
 }
 
+bool CScriptCheck::CanDefer() const {
+    return CanDeferSignatures(ptxTo->vin[nIn].scriptSig, scriptPubKey);
+}
+
+bool CScriptCheck::Defer(std::vector<CPendingSignature> &vDeferred) const {
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    return VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pSigHashContext, &vDeferred);
+}
+
 bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
 {
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
 }
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, std::vector<CScriptCheck> *pvChecks,
+                 const CSigHashContext *pSigHashContext)
 {
     if (!tx.IsCoinBase())
     {
@@ -1680,7 +1935,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins &coins = inputs.GetCoins(prevout.hash);
+            const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
             // If prev is coinbase, check that it's matured
             if (coins.IsCoinBase()) {
@@ -1714,12 +1969,19 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // Checked here and now, the inputs can share a context of our own
+            CSigHashContext sighashLocal;
+            if (pSigHashContext == NULL && pvChecks == NULL && tx.vin.size() > 1) {
+                sighashLocal.Set(tx);
+                pSigHashContext = &sighashLocal;
+            }
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins &coins = inputs.GetCoins(prevout.hash);
+                const CCoins &coins = inputs.AccessCoins(prevout.hash);
 
                 // Verify signature
-                CScriptCheck check(coins, tx, i, flags, 0);
+                CScriptCheck check(coins, tx, i, flags, 0, pSigHashContext);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1727,7 +1989,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCach
                     if (flags & SCRIPT_VERIFY_STRICTENC) {
                         // For now, check whether the failure was caused by non-canonical
                         // encodings or not; if so, don't trigger DoS protection.
-                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                        CScriptCheck check(coins, tx, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0, pSigHashContext);
                         if (check())
                             return state.Invalid();
                     }
@@ -1832,8 +2094,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
+        if (fFinalize) {
             TruncateFile(fileOld, infoLastBlockFile.nSize);
+            blockfilereader.Forget(nLastBlockFile);
+        }
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -1849,14 +2113,196 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** A group of script checks, run as one job on the script check threads.
+ *
+ *  With fBatch, the signatures of the scripts that allow it (see
+ *  CScriptCheck::CanDefer) are collected while the scripts run, and verified
+ *  together with VerifySignatureBatch at the end. If the batch fails, those
+ *  scripts are checked again one by one, so the failing input is reported.
+ */
+class CScriptCheckGroup
+{
+private:
+    std::vector<CScriptCheck> vChecks;
+    bool fBatch;
+
+public:
+    CScriptCheckGroup() : fBatch(false) {}
+
+    void Add(std::vector<CScriptCheck> &vChecksIn, bool fBatchIn) {
+        fBatch = fBatchIn;
+        vChecks.reserve(vChecks.size() + vChecksIn.size());
+        BOOST_FOREACH(CScriptCheck &check, vChecksIn) {
+            vChecks.push_back(CScriptCheck());
+            vChecks.back().swap(check);
+        }
+    }
+
+    size_t size() const { return vChecks.size(); }
+
+    bool operator()() const {
+        std::vector<char> vDeferred(vChecks.size(), false);
+        std::vector<CPendingSignature> vSigs;
+        bool fOk = true;
+        for (unsigned int i = 0; i < vChecks.size() && fOk; i++) {
+            if (fBatch && vChecks[i].CanDefer()) {
+                vDeferred[i] = true;
+                fOk = vChecks[i].Defer(vSigs);
+            } else if (!vChecks[i]())
+                return false;
+        }
+        if (fOk && VerifySignatureBatch(vSigs))
+            return true;
+
+        for (unsigned int i = 0; i < vChecks.size(); i++)
+            if (vDeferred[i] && !vChecks[i]())
+                return false;
+        return true;
+    }
+
+    void swap(CScriptCheckGroup &group) {
+        vChecks.swap(group.vChecks);
+        std::swap(fBatch, group.fBatch);
+    }
+};
+
+// Script checks are queued in groups of up to this many; batches much larger
+// than that don't save any more
+static const unsigned int MAX_SCRIPT_CHECK_GROUP = 32;
+
+static CCheckQueue<CScriptCheckGroup> scriptcheckqueue(4);
 
 void ThreadScriptCheck() {
     RenameThread("bitcoin-scriptch");
     scriptcheckqueue.Thread();
 }
 
-bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+/** Reads the coins of one transaction from the coin database, for PrefetchInputs */
+class CCoinsPrefetch
+{
+private:
+    const uint256 *ptxid;
+    CCoins *pcoins;
+    int *pnResult;
+
+public:
+    CCoinsPrefetch() : ptxid(NULL), pcoins(NULL), pnResult(NULL) {}
+    CCoinsPrefetch(const uint256 *ptxidIn, CCoins *pcoinsIn, int *pnResultIn) : ptxid(ptxidIn), pcoins(pcoinsIn), pnResult(pnResultIn) {}
+
+    bool operator()() const {
+        // A read error leaves the result unset; the connecting thread will
+        // then run into it itself
+        try {
+            *pnResult = pcoinsWriter->GetCoins(*ptxid, *pcoins) ? 1 : 0;
+        } catch (std::exception &e) {
+        }
+        return true;
+    }
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(ptxid, check.ptxid);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pnResult, check.pnResult);
+    }
+};
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(8);
+
+void ThreadPrefetchInputs() {
+    RenameThread("bitcoin-prefetch");
+    prefetchqueue.Thread();
+}
+
+// Look up the coins that connecting block will need, and that aren't in
+// memory yet, on the prefetch threads, so the connect doesn't wait for each
+// database read in turn. view must be a cache on top of pcoinsTip; the coins
+// are read from the view below pcoinsTip, and stored in pcoinsTip. Txids the
+// database doesn't have are only noted in view: they are about to be created
+// by block, and must not look spent in pcoinsTip if it isn't connected (or
+// only checked, as for a block template).
+static void PrefetchInputs(const CBlock& block, CCoinsViewCache& view)
+{
+    if (nPrefetchThreads == 0)
+        return;
+
+    // The block's own transactions are looked up for the BIP30 check, and
+    // inputs created by earlier blocks to be spent
+    std::vector<uint256> vTxid;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        vTxid.push_back(block.GetTxHash(i));
+    std::set<uint256> setCreated(vTxid.begin(), vTxid.end());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (!setCreated.count(txin.prevout.hash))
+                vTxid.push_back(txin.prevout.hash);
+    }
+    std::sort(vTxid.begin(), vTxid.end());
+    vTxid.erase(std::unique(vTxid.begin(), vTxid.end()), vTxid.end());
+
+    std::vector<uint256> vMissing;
+    BOOST_FOREACH(const uint256& txid, vTxid)
+        if (!view.HaveCoinsInCache(txid) && !pcoinsTip->HaveCoinsInCache(txid))
+            vMissing.push_back(txid);
+    if (vMissing.empty())
+        return;
+
+    std::vector<CCoins> vCoins(vMissing.size());
+    std::vector<int> vResult(vMissing.size(), -1);
+    {
+        CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+        std::vector<CCoinsPrefetch> vReads;
+        vReads.reserve(vMissing.size());
+        for (unsigned int i = 0; i < vMissing.size(); i++)
+            vReads.push_back(CCoinsPrefetch(&vMissing[i], &vCoins[i], &vResult[i]));
+        control.Add(vReads);
+        control.Wait();
+    }
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        if (vResult[i] == 1)
+            pcoinsTip->AddPrefetchedCoins(vMissing[i], vCoins[i], true);
+        else if (vResult[i] == 0)
+            view.AddPrefetchedCoins(vMissing[i], vCoins[i], false);
+    }
+}
+
+/** A block whose transactions have been applied to a view, but whose script
+ *  checks may still be running on the script check threads. */
+struct CBlockConnection
+{
+    std::vector<CSigHashContext> vSigHashContexts; // used by the checks in control, so it must be destroyed after it
+    CCheckQueueControl<CScriptCheckGroup> control;
+    CScriptCheckGroup group; // checks not queued yet
+    unsigned int nGroupSize;
+    CBlockUndo blockundo;
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    int nInputs;
+    int64 nStart;
+    bool fGenesis;
+
+    CBlockConnection(CBlockIndex* pindex) : control(pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate() && nScriptCheckThreads ? &scriptcheckqueue : NULL),
+                                            nGroupSize(1), nInputs(0), nStart(GetTimeMicros()), fGenesis(false) {}
+
+    // Queue script checks, once there are enough of them for a group
+    void AddChecks(std::vector<CScriptCheck> &vChecks) {
+        group.Add(vChecks, fBatchVerify);
+        if (group.size() >= nGroupSize)
+            FlushChecks();
+    }
+
+    void FlushChecks() {
+        if (group.size() == 0)
+            return;
+        std::vector<CScriptCheckGroup> vGroups(1);
+        vGroups[0].swap(group);
+        control.Add(vGroups);
+    }
+};
+
+// First half of ConnectBlock: check the block's transactions and apply them to
+// view, queueing their script checks in conn.control.
+static bool ConnectBlockInputs(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, CBlockConnection& conn, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, !fJustCheck, !fJustCheck))
@@ -1870,11 +2316,18 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     if (block.GetHash() == Params().HashGenesisBlock()) {
         view.SetBestBlock(pindex);
         pindexGenesisBlock = pindex;
+        conn.fGenesis = true;
         return true;
     }
 
     bool fScriptChecks = pindex->nHeight >= Checkpoints::GetTotalBlocksEstimate();
 
+    int64 nPrefetchStart = GetTimeMicros();
+    PrefetchInputs(block, view);
+    int64 nPrefetchTime = GetTimeMicros() - nPrefetchStart;
+    uint64 nLookupsStart, nMissesStart;
+    pcoinsTip->GetFetchStats(nLookupsStart, nMissesStart);
+
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     // If such overwrites are allowed, coinbases and transactions depending upon those
@@ -1889,7 +2342,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     // initial block download.
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
         uint256 hash = block.GetTxHash(i);
-        if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+        if (view.HaveCoins(hash) && !view.AccessCoins(hash).IsPruned())
             return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
     }
 
@@ -1900,17 +2353,23 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     unsigned int flags = SCRIPT_VERIFY_NOCACHE |
                          (fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
 
-    CBlockUndo blockundo;
-
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    CBlockUndo& blockundo = conn.blockundo;
 
     int64 nStart = GetTimeMicros();
     int64 nFees = 0;
-    int nInputs = 0;
+    int& nInputs = conn.nInputs;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    std::vector<std::pair<uint256, CDiskTxPos> >& vPos = conn.vPos;
     vPos.reserve(block.vtx.size());
+    // The queued script checks point into this, so it must not be reallocated
+    conn.vSigHashContexts.reserve(block.vtx.size());
+    // Small blocks are spread over all threads; large ones are checked in
+    // groups large enough to batch their signatures
+    unsigned int nBlockInputs = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        nBlockInputs += tx.vin.size();
+    conn.nGroupSize = std::max(1U, std::min(MAX_SCRIPT_CHECK_GROUP, nBlockInputs / (2 * std::max(nScriptCheckThreads, 1))));
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
@@ -1938,9 +2397,15 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             nFees += view.GetValueIn(tx)-GetValueOut(tx);
 
             std::vector<CScriptCheck> vChecks;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL))
+            const CSigHashContext* pSigHashContext = NULL;
+            if (fScriptChecks && nScriptCheckThreads && tx.vin.size() > 1) {
+                conn.vSigHashContexts.push_back(CSigHashContext());
+                conn.vSigHashContexts.back().Set(tx);
+                pSigHashContext = &conn.vSigHashContexts.back();
+            }
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, nScriptCheckThreads ? &vChecks : NULL, pSigHashContext))
                 return false;
-            control.Add(vChecks);
+            conn.AddChecks(vChecks);
         }
 
         CTxUndo txundo;
@@ -1951,18 +2416,49 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         vPos.push_back(std::make_pair(block.GetTxHash(i), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
+    conn.FlushChecks();
     int64 nTime = GetTimeMicros() - nStart;
     if (fBenchmark)
+    {
+        uint64 nLookups, nMisses;
+        pcoinsTip->GetFetchStats(nLookups, nMisses);
+        nLookups -= nLookupsStart;
+        nMisses -= nMissesStart;
+        printf("- Prefetch: %.2fms, %.1f%% hits of %"PRI64u" coin lookups\n", 0.001 * nPrefetchTime, nLookups ? 100.0 * (nLookups - nMisses) / nLookups : 100.0, nLookups);
         printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)block.vtx.size(), 0.001 * nTime, 0.001 * nTime / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+    }
 
     if (GetValueOut(block.vtx[0]) > GetBlockValue(pindex->nHeight, nFees))
         return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%"PRI64d" vs limit=%"PRI64d")", GetValueOut(block.vtx[0]), GetBlockValue(pindex->nHeight, nFees)));
 
-    if (!control.Wait())
+    // add this block to the view's block chain; the next block can be connected
+    // on top of it while the script checks are still running
+    if (!fJustCheck)
+        assert(view.SetBestBlock(pindex));
+
+    conn.nStart = nStart;
+    return true;
+}
+
+// Second half of ConnectBlock: wait for the script checks, then write the
+// block's undo and index data.
+static bool ConnectBlockFinish(CBlock& block, CValidationState& state, CBlockIndex* pindex, CBlockConnection& conn, bool fJustCheck)
+{
+    if (conn.fGenesis)
+        return true;
+
+    CBlockUndo& blockundo = conn.blockundo;
+    int nInputs = conn.nInputs;
+    if (!conn.control.Wait())
         return state.DoS(100, false);
-    int64 nTime2 = GetTimeMicros() - nStart;
+    int64 nTime2 = GetTimeMicros() - conn.nStart;
     if (fBenchmark)
+    {
         printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+        CSignatureCacheStats statsSigCache = GetSignatureCacheStats();
+        printf("- Signature cache: %.1f%% hits of %"PRI64u" lookups, %"PRI64u" contended, %"PRI64u" evicted\n",
+               100.0 * statsSigCache.HitRate(), statsSigCache.nLookups, statsSigCache.nContention, statsSigCache.nEvictions);
+    }
 
     if (fJustCheck)
         return true;
@@ -1990,12 +2486,9 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     }
 
     if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
+        if (!pblocktree->WriteTxIndex(conn.vPos))
             return state.Abort(_("Failed to write transaction index"));
 
-    // add this block to the view's block chain
-    assert(view.SetBestBlock(pindex));
-
     // Watch for transactions paying to me
     for (unsigned int i = 0; i < block.vtx.size(); i++)
         SyncWithWallets(block.GetTxHash(i), block.vtx[i], &block, true);
@@ -2003,6 +2496,14 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     return true;
 }
 
+bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+{
+    CBlockConnection conn(pindex);
+    if (!ConnectBlockInputs(block, state, pindex, view, conn, fJustCheck))
+        return false;
+    return ConnectBlockFinish(block, state, pindex, conn, fJustCheck);
+}
+
 bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 {
     // All modifications to the coin state will be done in this cache.
@@ -2010,19 +2511,8 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     CCoinsViewCache view(*pcoinsTip, true);
 
     // Find the fork (typically, there is none)
-    CBlockIndex* pfork = view.GetBestBlock();
-    CBlockIndex* plonger = pindexNew;
-    while (pfork && pfork != plonger)
-    {
-        while (plonger->nHeight > pfork->nHeight) {
-            plonger = plonger->pprev;
-            assert(plonger != NULL);
-        }
-        if (pfork == plonger)
-            break;
-        pfork = pfork->pprev;
-        assert(pfork != NULL);
-    }
+    CBlockIndex* pfork = LastCommonAncestor(view.GetBestBlock(), pindexNew);
+    assert(pfork != NULL || view.GetBestBlock() == NULL);
 
     // List of what to disconnect (typically nothing)
     vector<CBlockIndex*> vDisconnect;
@@ -2060,26 +2550,54 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
                 vResurrect.push_back(tx);
     }
 
-    // Connect longer branch
+    // Connect longer branch. The script checks of each block keep running while
+    // the transactions of the next one are applied to the view. If any block
+    // fails, the checks still queued for its successor are aborted, and the
+    // view, which holds all changes of this call, is discarded.
     vector<CTransaction> vDelete;
-    BOOST_FOREACH(CBlockIndex *pindex, vConnect) {
-        CBlock block;
-        if (!ReadBlockFromDisk(block, pindex))
-            return state.Abort(_("Failed to read block"));
-        int64 nStart = GetTimeMicros();
-        if (!ConnectBlock(block, state, pindex, view)) {
-            if (state.IsInvalid()) {
-                InvalidChainFound(pindexNew);
-                InvalidBlockFound(pindex);
+    boost::scoped_ptr<CBlock> pblock, pblockPrev;
+    boost::scoped_ptr<CBlockConnection> pconn, pconnPrev;
+    CBlockIndex* pindexPrev = NULL;
+    for (unsigned int i = 0; i <= vConnect.size(); i++) {
+        CBlockIndex* pindex = NULL;
+        if (i < vConnect.size()) {
+            pindex = vConnect[i];
+            pblock.reset(new CBlock());
+            if (!ReadBlockFromDisk(*pblock, pindex))
+                return state.Abort(_("Failed to read block"));
+            pconn.reset(new CBlockConnection(pindex));
+            if (!ConnectBlockInputs(*pblock, state, pindex, view, *pconn, false)) {
+                if (state.IsInvalid()) {
+                    InvalidChainFound(pindexNew);
+                    InvalidBlockFound(pindex);
+                }
+                return error("SetBestBlock() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
             }
-            return error("SetBestBlock() : ConnectBlock %s failed", pindex->GetBlockHash().ToString().c_str());
         }
-        if (fBenchmark)
-            printf("- Connect: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
 
-        // Queue memory transactions to delete
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            vDelete.push_back(tx);
+        if (pconnPrev) {
+            if (!ConnectBlockFinish(*pblockPrev, state, pindexPrev, *pconnPrev, false)) {
+                if (pconn)
+                    pconn->control.Abort();
+                if (state.IsInvalid()) {
+                    InvalidChainFound(pindexNew);
+                    InvalidBlockFound(pindexPrev);
+                }
+                return error("SetBestBlock() : ConnectBlock %s failed", pindexPrev->GetBlockHash().ToString().c_str());
+            }
+            if (fBenchmark)
+                printf("- Connect: %.2fms\n", (GetTimeMicros() - pconnPrev->nStart) * 0.001);
+
+            // Queue memory transactions to delete
+            BOOST_FOREACH(const CTransaction& tx, pblockPrev->vtx)
+                vDelete.push_back(tx);
+        }
+
+        // The connection refers to the block, so release it first
+        pconnPrev.reset();
+        pblockPrev.swap(pblock);
+        pconnPrev.swap(pconn);
+        pindexPrev = pindex;
     }
 
     // Flush changes to global coin state
@@ -2090,9 +2608,10 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     if (fBenchmark)
         printf("- Flush %i transactions: %.2fms (%.4fms/tx)\n", nModified, 0.001 * nTime, 0.001 * nTime / nModified);
 
-    // Make sure it's successfully written to disk before changing memory structure
+    // Make sure it's successfully written to disk before changing memory structure.
+    // The coins themselves are written in the background by pcoinsWriter.
     bool fIsInitialDownload = IsInitialBlockDownload();
-    if (!fIsInitialDownload || pcoinsTip->GetCacheSize() > nCoinCacheSize) {
+    if (!fIsInitialDownload || pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2110,9 +2629,12 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
     // Proceed by updating the memory structures.
 
     // Register new best chain
-    vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        vBlockIndexByHeight[pindex->nHeight] = pindex;
+    {
+        LOCK(cs_blockIndex);
+        vBlockIndexByHeight.resize(pindexNew->nHeight + 1);
+        BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+            vBlockIndexByHeight[pindex->nHeight] = pindex;
+    }
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect) {
@@ -2127,18 +2649,26 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
         mempool.removeConflicts(tx);
     }
 
-    // Update best block in wallet (so we can detect restored wallets)
-    if ((pindexNew->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindexNew->nHeight % 144) == 0))
+    // Update best block in wallet (so we can detect restored wallets), when
+    // any of the connected blocks is at one of the intervals
+    bool fUpdateLocator = false;
+    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+        if ((pindex->nHeight % 20160) == 0 || (!fIsInitialDownload && (pindex->nHeight % 144) == 0))
+            fUpdateLocator = true;
+    if (fUpdateLocator)
     {
         const CBlockLocator locator(pindexNew);
         ::SetBestChain(locator);
     }
 
     // New best block
-    hashBestChain = pindexNew->GetBlockHash();
-    pindexBest = pindexNew;
+    {
+        LOCK(cs_blockIndex);
+        hashBestChain = pindexNew->GetBlockHash();
+        pindexBest = pindexNew;
+        nBestHeight = pindexBest->nHeight;
+    }
     pblockindexFBBHLast = NULL;
-    nBestHeight = pindexBest->nHeight;
     nBestChainWork = pindexNew->nChainWork;
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
@@ -2177,32 +2707,73 @@ bool SetBestChain(CValidationState &state, CBlockIndex* pindexNew)
 }
 
 
+// Add a block header to the block index, or return the entry it already has
+static CBlockIndex* AddHeaderToBlockIndex(const CBlockHeader& block)
+{
+    uint256 hash = block.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+
+    // Construct new block index object
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate();
+    *pindexNew = CBlockIndex(block);
+    {
+        LOCK(cs_blockIndex);
+        mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+        BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+        if (miPrev != mapBlockIndex.end())
+        {
+            pindexNew->pprev = (*miPrev).second;
+            pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+            pindexNew->BuildSkip();
+        }
+        pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork();
+        pindexNew->nStatus = BLOCK_VALID_TREE;
+    }
+
+    if (pindexBestHeader == NULL || pindexNew->nChainWork > pindexBestHeader->nChainWork)
+        SetBestHeader(pindexNew);
+    return pindexNew;
+}
+
 bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos)
 {
     // Check for duplicate
     uint256 hash = block.GetHash();
-    if (mapBlockIndex.count(hash))
+    CBlockIndex* pindexNew = AddHeaderToBlockIndex(block);
+    if (pindexNew->nStatus & BLOCK_HAVE_DATA)
         return state.Invalid(error("AddToBlockIndex() : %s already exists", hash.ToString().c_str()));
 
-    // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
-    if (miPrev != mapBlockIndex.end())
     {
-        pindexNew->pprev = (*miPrev).second;
-        pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
-    }
-    pindexNew->nTx = block.vtx.size();
-    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWork().getuint256();
-    pindexNew->nChainTx = (pindexNew->pprev ? pindexNew->pprev->nChainTx : 0) + pindexNew->nTx;
-    pindexNew->nFile = pos.nFile;
-    pindexNew->nDataPos = pos.nPos;
-    pindexNew->nUndoPos = 0;
-    pindexNew->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
-    setBlockIndexValid.insert(pindexNew);
+        LOCK(cs_blockIndex);
+        pindexNew->nTx = block.vtx.size();
+        pindexNew->nFile = pos.nFile;
+        pindexNew->nDataPos = pos.nPos;
+        pindexNew->nUndoPos = 0;
+        pindexNew->nStatus = (pindexNew->nStatus & ~BLOCK_VALID_MASK) | BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    }
+
+    // Blocks can only be connected once the transactions of all their
+    // ancestors are here; with headers first, they needn't arrive in order
+    if (pindexNew->pprev == NULL || pindexNew->pprev->nChainTx) {
+        deque<CBlockIndex*> queue;
+        queue.push_back(pindexNew);
+        while (!queue.empty()) {
+            CBlockIndex *pindex = queue.front();
+            queue.pop_front();
+            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+            setBlockIndexValid.insert(pindex);
+            std::pair<multimap<CBlockIndex*, CBlockIndex*>::iterator, multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+            while (range.first != range.second) {
+                queue.push_back(range.first->second);
+                mapBlocksUnlinked.erase(range.first++);
+            }
+        }
+    } else {
+        mapBlocksUnlinked.insert(make_pair(pindexNew->pprev, pindexNew));
+    }
 
     if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexNew)))
         return state.Abort(_("Failed to write block index"));
@@ -2322,6 +2893,19 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+{
+    // Check proof of work matches claimed amount
+    if (fCheckPOW && !CheckProofOfWork(block.GetHash(), block.nBits))
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"));
+
+    // Check timestamp
+    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"));
+
+    return true;
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
@@ -2331,13 +2915,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return state.DoS(100, error("CheckBlock() : size limits failed"));
 
-    // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetHash(), block.nBits))
-        return state.DoS(50, error("CheckBlock() : proof of work failed"));
-
-    // Check timestamp
-    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
-        return state.Invalid(error("CheckBlock() : block timestamp too far in the future"));
+    if (!CheckBlockHeader(block, state, fCheckPOW))
+        return false;
 
     // First transaction must be coinbase, the rest must not be
     if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
@@ -2354,7 +2933,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Build the merkle tree already. We need it anyway later, and it makes the
     // block cache the transaction hashes, which means they don't need to be
     // recalculated many times during this block's validation.
-    block.BuildMerkleTree();
+    // The whole tree is computed through batched SHA256 (see HashBatch), so
+    // it is built only once and its root reused for the check below.
+    uint256 hashMerkleRoot = block.BuildMerkleTree();
 
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
@@ -2374,45 +2955,49 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && block.hashMerkleRoot != block.BuildMerkleTree())
+    if (fCheckMerkleRoot && block.hashMerkleRoot != hashMerkleRoot)
         return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
 {
     // Check for duplicate
     uint256 hash = block.GetHash();
-    if (mapBlockIndex.count(hash))
-        return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
+    BlockMap::iterator miSelf = mapBlockIndex.find(hash);
+    if (miSelf != mapBlockIndex.end()) {
+        if (ppindex)
+            *ppindex = (*miSelf).second;
+        if ((*miSelf).second->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block is marked invalid"));
+        return true;
+    }
+
+    if (!CheckBlockHeader(block, state))
+        return false;
 
     // Get prev block index
-    CBlockIndex* pindexPrev = NULL;
-    int nHeight = 0;
     if (hash != Params().HashGenesisBlock()) {
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(block.hashPrevBlock);
         if (mi == mapBlockIndex.end())
-            return state.DoS(10, error("AcceptBlock() : prev block not found"));
-        pindexPrev = (*mi).second;
-        nHeight = pindexPrev->nHeight+1;
+            return state.DoS(10, error("AcceptBlockHeader() : prev block not found"));
+        CBlockIndex* pindexPrev = (*mi).second;
+        int nHeight = pindexPrev->nHeight+1;
+        if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+            return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"));
 
         // Check proof of work
         if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
-            return state.DoS(100, error("AcceptBlock() : incorrect proof of work"));
+            return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"));
 
         // Check timestamp against prev
         if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
-            return state.Invalid(error("AcceptBlock() : block's timestamp is too early"));
-
-        // Check that all transactions are finalized
-        BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            if (!IsFinalTx(tx, nHeight, block.GetBlockTime()))
-                return state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
+            return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"));
 
         // Check that the block chain matches the known block chain up to a checkpoint
         if (!Checkpoints::CheckBlock(nHeight, hash))
-            return state.DoS(100, error("AcceptBlock() : rejected by checkpoint lock-in at %d", nHeight));
+            return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight));
 
         // Reject block.nVersion=1 blocks when 95% (75% on testnet) of the network has upgraded:
         if (block.nVersion < 2)
@@ -2420,21 +3005,62 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
             if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 950, 1000)) ||
                 (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 75, 100)))
             {
-                return state.Invalid(error("AcceptBlock() : rejected nVersion=1 block"));
+                return state.Invalid(error("AcceptBlockHeader() : rejected nVersion=1 block"));
             }
         }
-        // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
-        if (block.nVersion >= 2)
-        {
-            // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
-            if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 750, 1000)) ||
+    }
+
+    CBlockIndex* pindex = AddHeaderToBlockIndex(block);
+    if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex)))
+        return state.Abort(_("Failed to write block index"));
+    if (ppindex)
+        *ppindex = pindex;
+    return true;
+}
+
+bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
+{
+    // The header may be known already, from headers-first synchronization
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindex = NULL;
+    if (!AcceptBlockHeader(block, state, &pindex))
+        return false;
+    if (pindex->nStatus & BLOCK_HAVE_DATA)
+        return state.Invalid(error("AcceptBlock() : block already in mapBlockIndex"));
+
+    CBlockIndex* pindexPrev = pindex->pprev;
+    int nHeight = pindex->nHeight;
+    if (pindexPrev) {
+        // Check that all transactions are finalized
+        bool fValid = true;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            if (!IsFinalTx(tx, nHeight, block.GetBlockTime())) {
+                fValid = state.DoS(10, error("AcceptBlock() : contains a non-final transaction"));
+                break;
+            }
+        }
+
+        // Enforce block.nVersion=2 rule that the coinbase starts with serialized block height
+        if (fValid && block.nVersion >= 2)
+        {
+            // if 750 of the last 1,000 blocks are version 2 or greater (51/100 if testnet):
+            if ((!TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 750, 1000)) ||
                 (TestNet() && CBlockIndex::IsSuperMajority(2, pindexPrev, 51, 100)))
             {
                 CScript expect = CScript() << nHeight;
                 if (!std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin()))
-                    return state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
+                    fValid = state.DoS(100, error("AcceptBlock() : block height mismatch in coinbase"));
             }
         }
+
+        // The transactions are committed to by the header, so it is invalid as well
+        if (!fValid) {
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            pblocktree->WriteBlockIndex(CDiskBlockIndex(pindex));
+            if (nHeight < (int)vHeaderIndexByHeight.size() && vHeaderIndexByHeight[nHeight] == pindex)
+                FindBestHeader();
+            return false;
+        }
     }
 
     // Write block to history file
@@ -2467,6 +3093,53 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
     return true;
 }
 
+// Turn the lowest '1' bit in the binary representation of a number into a '0'
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+// Compute what height to jump back to with the skip pointer of a block at height
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+    // Jumps are a power of two or less, and odd heights jump less far so that
+    // any height can be reached from any other in O(log n) jumps
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 && heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2479,44 +3152,46 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+void PushGetHeaders(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
 {
     // Filter out duplicate requests
-    if (pindexBegin == pnode->pindexLastGetBlocksBegin && hashEnd == pnode->hashLastGetBlocksEnd)
+    if (pindexBegin == pnode->pindexLastGetHeadersBegin && hashEnd == pnode->hashLastGetHeadersEnd)
         return;
-    pnode->pindexLastGetBlocksBegin = pindexBegin;
-    pnode->hashLastGetBlocksEnd = hashEnd;
+    pnode->pindexLastGetHeadersBegin = pindexBegin;
+    pnode->hashLastGetHeadersEnd = hashEnd;
 
-    pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+    pnode->PushMessage("getheaders", CBlockLocator(pindexBegin), hashEnd);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
-    // Check for duplicate
+    // Check for duplicate; only the header may be known
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
+    if (mapBlockIndex.count(hash) && (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA))
         return state.Invalid(error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().c_str()));
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
     // Preliminary checks
-    if (!CheckBlock(*pblock, state))
+    if (!fChecked && !CheckBlock(*pblock, state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain)
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !mapBlockIndex.count(hash))
     {
         // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        // (not needed for blocks whose header was accepted, and so checked fully)
         int64 deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
         if (deltaTime < 0)
         {
             return state.DoS(100, error("ProcessBlock() : block with timestamp before last checkpoint"));
         }
-        CBigNum bnNewBlock;
-        bnNewBlock.SetCompact(pblock->nBits);
-        CBigNum bnRequired;
+        uint256 bnNewBlock;
+        bool fNegative, fOverflow;
+        bnNewBlock.SetCompact(pblock->nBits, &fNegative, &fOverflow);
+        uint256 bnRequired;
         bnRequired.SetCompact(ComputeMinWork(pcheckpoint->nBits, deltaTime));
-        if (bnNewBlock > bnRequired)
+        if (!fNegative && (fOverflow || bnNewBlock > bnRequired))
         {
             return state.DoS(100, error("ProcessBlock() : block with too little proof-of-work"));
         }
@@ -2535,7 +3210,7 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
 
             // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(pblock2));
+            PushGetHeaders(pfrom, pindexBestHeader, GetOrphanRoot(pblock2));
         }
         return true;
     }
@@ -2789,24 +3464,70 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// A background write of the coin database that was interrupted leaves some
+// coins at the state of its target block, and others at that of the best
+// block before it. Connecting the blocks in between again, without any
+// checks, brings all of them to the target state: outputs created in those
+// blocks are overwritten as a whole, and spends of outputs that were already
+// spent are ignored.
+bool static ReplayCoinsWrite()
+{
+    CBlockIndex *pindexTarget = pcoinsWriter->GetInterruptedWrite();
+    if (pindexTarget == NULL)
+        return true;
+    CBlockIndex *pindexFrom = pcoinsTip->GetBestBlock();
+    if (pindexFrom == NULL)
+        return error("ReplayCoinsWrite() : no best block");
+
+    vector<CBlockIndex*> vReplay;
+    for (CBlockIndex *pindex = pindexTarget; pindex != pindexFrom; pindex = pindex->pprev) {
+        if (pindex == NULL)
+            return error("ReplayCoinsWrite() : %s does not descend from the best block", pindexTarget->GetBlockHash().ToString().c_str());
+        vReplay.push_back(pindex);
+    }
+    printf("ReplayCoinsWrite() : completing coin database write from height %d to %d\n", pindexFrom->nHeight, pindexTarget->nHeight);
+
+    CCoinsViewCache view(*pcoinsTip, true);
+    for (int i = vReplay.size() - 1; i >= 0; i--) {
+        CBlockIndex *pindex = vReplay[i];
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("ReplayCoinsWrite() : failed to read block %s", pindex->GetBlockHash().ToString().c_str());
+        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn &txin, tx.vin) {
+                    if (!view.HaveCoins(txin.prevout.hash))
+                        continue;
+                    CCoins &coins = view.GetCoins(txin.prevout.hash);
+                    if (coins.IsAvailable(txin.prevout.n))
+                        coins.Spend(txin.prevout.n);
+                }
+            }
+            view.SetCoins(tx.GetHash(), CCoins(tx, pindex->nHeight));
+        }
+    }
+    view.SetBestBlock(pindexTarget);
+    return view.Flush() && pcoinsTip->Flush();
+}
+
 bool static LoadBlockIndexDB()
 {
+    int64 nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts())
         return false;
+    int64 nTimeRead = GetTimeMillis() - nStart;
 
     boost::this_thread::interruption_point();
 
@@ -2822,11 +3543,21 @@ bool static LoadBlockIndexDB()
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork().getuint256();
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWork();
+        pindex->BuildSkip();
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            continue;
+        // Blocks downloaded ahead of an ancestor wait for it to be linked
+        if (pindex->pprev && !pindex->pprev->nChainTx) {
+            mapBlocksUnlinked.insert(make_pair(pindex->pprev, pindex));
+            continue;
+        }
         pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
         if ((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS && !(pindex->nStatus & BLOCK_FAILED_MASK))
             setBlockIndexValid.insert(pindex);
     }
+    printf("LoadBlockIndexDB(): %"PRIszu" entries read and checked in %"PRI64d"ms, chain work computed in %"PRI64d"ms\n",
+           mapBlockIndex.size(), nTimeRead, GetTimeMillis() - nStart - nTimeRead);
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
@@ -2848,6 +3579,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     printf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Finish writing the coin database, if that was interrupted
+    if (!ReplayCoinsWrite())
+        return false;
+
     // Load hashBestChain pointer to end of best chain
     pindexBest = pcoinsTip->GetBestBlock();
     if (pindexBest == NULL)
@@ -2867,6 +3602,10 @@ bool static LoadBlockIndexDB()
         hashBestChain.ToString().c_str(), nBestHeight,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", pindexBest->GetBlockTime()).c_str());
 
+    FindBestHeader();
+    if (pindexBestHeader)
+        printf("LoadBlockIndexDB(): best header height=%d\n", pindexBestHeader->nHeight);
+
     return true;
 }
 
@@ -2909,7 +3648,7 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth)
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= 2*nCoinCacheSize + 32000) {
+        if (nCheckLevel >= 3 && pindex == pindexState && coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
@@ -2947,12 +3686,20 @@ void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
+    mapBlocksUnlinked.clear();
+    pindexBestHeader = NULL;
+    vHeaderIndexByHeight.clear();
+    vBlockIndexByHeight.clear();
     pindexGenesisBlock = NULL;
+    pblockindexFBBHLast = NULL;
     nBestHeight = 0;
     nBestChainWork = 0;
     nBestInvalidWork = 0;
     hashBestChain = 0;
     pindexBest = NULL;
+
+    // Nothing points into the entries anymore
+    arenaBlockIndex.Clear();
 }
 
 bool LoadBlockIndex()
@@ -3002,7 +3749,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3068,69 +3815,269 @@ void PrintBlockTree()
     }
 }
 
+/** Loader of the blocks in a block file, as a pipeline: a reader thread scans
+ *  the file for blocks, a pool of threads deserializes and checks them, and
+ *  the caller takes them in file order through Next. The stages pass blocks
+ *  through a ring of slots, so the reader can't run ahead by more than that.
+ */
+class CBlockFileLoader
+{
+public:
+    struct CSlot
+    {
+        uint64 nPos;              // position of the block in the file
+        std::vector<char> vchRaw; // the block, as read
+        CBlock block;
+        bool fDeserialized;
+        bool fChecked;            // whether CheckBlock passed
+        bool fReady;              // whether the checkers are done with it
+    };
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRead;    // a slot was freed
+    boost::condition_variable condCheck;   // a block was read, or reading ended
+    boost::condition_variable condProcess; // a block was checked, or reading ended
+    std::vector<CSlot> vSlots;
+    uint64 nRead;       // blocks read so far
+    uint64 nClaimed;    // blocks taken by a checker so far
+    uint64 nProcessed;  // blocks released by the caller so far
+    bool fDone;         // the reader reached the end of the file
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void ThreadRead(FILE *fileIn, uint64 nStartByte)
+    {
+        try {
+            CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+            if (nStartByte)
+                blkdat.Seek(nStartByte);
+            uint64 nRewind = blkdat.GetPos();
+            while (blkdat.good() && !blkdat.eof()) {
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    // locate a header
+                    unsigned char buf[4];
+                    blkdat.FindByte(Params().MessageStart()[0]);
+                    nRewind = blkdat.GetPos()+1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, Params().MessageStart(), 4))
+                        continue;
+                    // read size
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                        continue;
+                } catch (std::exception &e) {
+                    // no valid block header found; don't complain
+                    break;
+                }
+
+                uint64 nBlockPos = blkdat.GetPos();
+                if (nBlockPos < nStartByte)
+                    continue;
+
+                // wait for a free slot; it is ours until nRead moves past it
+                CSlot *pslot;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (!fStop && nRead == nProcessed + vSlots.size())
+                        condRead.wait(lock);
+                    if (fStop)
+                        break;
+                    pslot = &vSlots[nRead % vSlots.size()];
+                }
+                try {
+                    pslot->vchRaw.resize(nSize);
+                    blkdat.read(&pslot->vchRaw[0], nSize);
+                } catch (std::exception &e) {
+                    printf("%s() : I/O error caught during load\n", __PRETTY_FUNCTION__);
+                    continue;
+                }
+                nRewind = blkdat.GetPos();
+                pslot->nPos = nBlockPos;
+                pslot->fReady = false;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    nRead++;
+                }
+                condCheck.notify_one();
+            }
+        } catch (std::exception &e) {
+            PrintExceptionContinue(&e, "CBlockFileLoader::ThreadRead()");
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fDone = true;
+        }
+        condCheck.notify_all();
+        condProcess.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        while (true) {
+            CSlot *pslot;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && !fDone && nClaimed == nRead)
+                    condCheck.wait(lock);
+                if (fStop || nClaimed == nRead)
+                    return;
+                pslot = &vSlots[nClaimed % vSlots.size()];
+                nClaimed++;
+            }
+
+            // Deserialize and check the block; CheckBlock also builds its
+            // merkle tree, which the block keeps
+            CBlock &block = pslot->block;
+            block.SetNull();
+            pslot->fDeserialized = false;
+            pslot->fChecked = false;
+            try {
+                CSpanReader reader(&pslot->vchRaw[0], &pslot->vchRaw[0] + pslot->vchRaw.size(), SER_DISK, CLIENT_VERSION);
+                reader >> block;
+                pslot->fDeserialized = true;
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize error caught during load\n", __PRETTY_FUNCTION__);
+            }
+            if (pslot->fDeserialized) {
+                CValidationState state;
+                pslot->fChecked = CheckBlock(block, state);
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pslot->fReady = true;
+            }
+            condProcess.notify_one();
+        }
+    }
+
+public:
+    CBlockFileLoader(unsigned int nSlots) : vSlots(nSlots), nRead(0), nClaimed(0), nProcessed(0), fDone(false), fStop(false) {}
+
+    ~CBlockFileLoader()
+    {
+        Stop();
+    }
+
+    void Start(FILE *fileIn, uint64 nStartByte, int nCheckThreads)
+    {
+        threadGroup.create_thread(boost::bind(&CBlockFileLoader::ThreadRead, this, fileIn, nStartByte));
+        for (int i = 0; i < nCheckThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockFileLoader::ThreadCheck, this));
+    }
+
+    // Wait for the next block of the file, and return its slot, or NULL at
+    // the end. The slot is valid until Release is called.
+    CSlot *Next()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            if (nProcessed < nRead && vSlots[nProcessed % vSlots.size()].fReady)
+                return &vSlots[nProcessed % vSlots.size()];
+            if (fDone && nProcessed == nRead)
+                return NULL;
+            condProcess.wait(lock);
+        }
+    }
+
+    void Release()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nProcessed++;
+        }
+        condRead.notify_one();
+    }
+
+    void Stop()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        condRead.notify_all();
+        condCheck.notify_all();
+        boost::this_thread::disable_interruption di;
+        threadGroup.join_all();
+    }
+};
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
+    // Blocks of the block files whose parent wasn't known yet, by the hash of
+    // that parent. They are read back from their position once it is known.
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
             // (try to) skip already indexed part
             CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
+            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info))
                 nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
         }
-        uint64 nRewind = blkdat.GetPos();
-        while (blkdat.good() && !blkdat.eof()) {
+        int nCheckThreads = std::max(nScriptCheckThreads, 1);
+        CBlockFileLoader loader(std::max(8, 4 * nCheckThreads));
+        loader.Start(fileIn, nStartByte, nCheckThreads);
+        while (CBlockFileLoader::CSlot *pslot = loader.Next()) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[4];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), 4))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (std::exception &e) {
-                // no valid block header found; don't complain
-                break;
+            // Blocks that failed to deserialize or CheckBlock were reported already
+            if (!pslot->fChecked) {
+                loader.Release();
+                continue;
             }
-            try {
-                // read block
-                uint64 nBlockPos = blkdat.GetPos();
-                blkdat.SetLimit(nBlockPos + nSize);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
 
-                // process block
-                if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+            LOCK(cs_main);
+            CBlock &block = pslot->block;
+            uint256 hash = block.GetHash();
+            CDiskBlockPos pos;
+            if (dbp)
+                pos = CDiskBlockPos(dbp->nFile, pslot->nPos);
+            if (dbp && block.hashPrevBlock != 0 && !mapBlockIndex.count(block.hashPrevBlock)) {
+                mapBlocksUnknownParent.insert(make_pair(block.hashPrevBlock, pos));
+                loader.Release();
+                continue;
+            }
+
+            CValidationState state;
+            if (ProcessBlock(state, NULL, &block, dbp ? &pos : NULL, true))
+                nLoaded++;
+            loader.Release();
+            if (state.IsError())
+                break;
+
+            // Process the blocks that were waiting for this one, recursively
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 hashParent = queue.front();
+                queue.pop_front();
+                std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(hashParent);
+                while (range.first != range.second) {
+                    CDiskBlockPos posChild = range.first->second;
+                    mapBlocksUnknownParent.erase(range.first++);
+                    CBlock blockChild;
+                    if (ReadBlockFromDisk(blockChild, posChild)) {
+                        CValidationState stateChild;
+                        if (ProcessBlock(stateChild, NULL, &blockChild, &posChild)) {
+                            nLoaded++;
+                            queue.push_back(blockChild.GetHash());
+                        }
+                    }
                 }
-            } catch (std::exception &e) {
-                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
         }
+        loader.Stop();
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(_("Error: system error: ") + e.what());
@@ -3177,7 +4124,7 @@ string GetWarnings(string strFor)
     }
 
     // Longer invalid proof-of-work chain
-    if (pindexBest && nBestInvalidWork > nBestChainWork + (pindexBest->GetBlockWork() * 6).getuint256())
+    if (pindexBest && nBestInvalidWork > nBestChainWork + pindexBest->GetBlockWork() * 6)
     {
         nPriority = 2000;
         strStatusBar = strRPC = _("Warning: Displayed transactions may not be correct! You may need to upgrade, or other nodes may need to upgrade.");
@@ -3233,8 +4180,11 @@ bool static AlreadyHave(const CInv& inv)
                 pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+            return (mi != mapBlockIndex.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA)) ||
+                   mapOrphanBlocks.count(inv.hash);
+        }
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3243,6 +4193,157 @@ bool static AlreadyHave(const CInv& inv)
 
 
 
+// Note that pnode has the given block, and so all of its ancestors
+void static UpdateBlockAvailability(CNode* pnode, const uint256& hash)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+    {
+        // Resolved once the headers leading to it arrive
+        pnode->hashLastUnknownBlock = hash;
+        return;
+    }
+    CBlockIndex* pindex = (*mi).second;
+    if (pnode->pindexBestKnownBlock == NULL || pindex->nChainWork >= pnode->pindexBestKnownBlock->nChainWork)
+        pnode->pindexBestKnownBlock = pindex;
+    if (hash == pnode->hashLastUnknownBlock)
+        pnode->hashLastUnknownBlock = 0;
+}
+
+void static MarkBlockInFlight(CNode* pnode, const uint256& hash)
+{
+    mapBlocksInFlight[hash] = make_pair(pnode, GetTime());
+
+    // Keep the peer around for as long as blocks are requested from it
+    if (pnode->nBlocksInFlight++ == 0)
+    {
+        LOCK(cs_vNodes);
+        pnode->AddRef();
+    }
+}
+
+// Forget the request for a block, because it arrived or is to be made to another peer
+void static MarkBlockNotInFlight(const uint256& hash)
+{
+    map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
+        return;
+    CNode* pnode = (*it).second.first;
+    mapBlocksInFlight.erase(it);
+    mapPartialBlocks.erase(hash);
+    if (--pnode->nBlocksInFlight == 0)
+    {
+        LOCK(cs_vNodes);
+        pnode->Release();
+    }
+}
+
+void static ReleaseBlocksInFlight(CNode* pnode)
+{
+    vector<uint256> vHash;
+    for (map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); it++)
+        if ((*it).second.first == pnode)
+            vHash.push_back((*it).first);
+    BOOST_FOREACH(const uint256& hash, vHash)
+        MarkBlockNotInFlight(hash);
+}
+
+// Request blocks from pto: those of the best header chain that we don't have
+// and didn't request yet, in a window past the end of the best chain. All
+// peers download from the same window, each with a limited number of blocks
+// in flight, so blocks are downloaded from many peers at once.
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    if (pindexBestHeader == NULL || pindexBest == NULL)
+        return;
+    int64 nNow = GetTime();
+
+    // Requests that took too long, or were made to peers that went away, are made to others
+    vector<uint256> vExpired;
+    for (map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); it++)
+        if ((*it).second.first->fDisconnect || (*it).second.second < nNow - BLOCK_DOWNLOAD_TIMEOUT)
+            vExpired.push_back((*it).first);
+    BOOST_FOREACH(const uint256& hash, vExpired)
+        MarkBlockNotInFlight(hash);
+
+    // The window starts where the best chain and the best header chain part
+    CBlockIndex* pindexFork = LastCommonAncestor(pindexBest, pindexBestHeader);
+    int nStart = pindexFork ? pindexFork->nHeight : 0;
+    int nEnd = std::min(pindexBestHeader->nHeight, nStart + BLOCK_DOWNLOAD_WINDOW);
+
+    // How far along the best header chain pto has blocks: as far as we know
+    // it has, also if what it has is a fork of it, or else as far as it
+    // claimed when it connected
+    int nPeerHeight = std::min(pto->nStartingHeight, pindexBestHeader->nHeight);
+    CBlockIndex* pindexKnown = LastCommonAncestor(pto->pindexBestKnownBlock, pindexBestHeader);
+    if (pindexKnown)
+        nPeerHeight = std::max(nPeerHeight, pindexKnown->nHeight);
+
+    // The request for the first missing block of the window, if it was made to another peer
+    pair<CNode*, int64>* pFirstInFlight = NULL;
+    bool fFirstMissing = true;
+    int nHeight = nStart + 1;
+    for (; nHeight <= nEnd && nHeight <= nPeerHeight && pto->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; nHeight++)
+    {
+        CBlockIndex* pindex = vHeaderIndexByHeight[nHeight];
+        if (pindex->nStatus & BLOCK_HAVE_DATA)
+            continue;
+        uint256 hash = pindex->GetBlockHash();
+        map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.find(hash);
+        if (it == mapBlocksInFlight.end())
+        {
+            // A new block on top of the best chain has its transactions in
+            // the memory pool, mostly; get those that aren't
+            bool fCompact = fCompactBlocks && pto->nVersion >= COMPACT_BLOCKS_VERSION && pindex->pprev == pindexBest;
+            vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, hash));
+            MarkBlockInFlight(pto, hash);
+        }
+        else if (fFirstMissing && (*it).second.first != pto)
+            pFirstInFlight = &(*it).second;
+        fFirstMissing = false;
+    }
+
+    // pto could take more blocks, but the whole window is downloaded or in
+    // flight. If a single peer holds up its start, give its blocks to others.
+    if (nHeight > nEnd && nEnd == nStart + BLOCK_DOWNLOAD_WINDOW && pto->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER &&
+        pFirstInFlight && pFirstInFlight->second < nNow - BLOCK_STALLING_TIMEOUT)
+    {
+        CNode* pnodeStalling = pFirstInFlight->first;
+        printf("Peer %s is stalling block download, disconnecting\n", pnodeStalling->addr.ToString().c_str());
+        pnodeStalling->fDisconnect = true;
+        ReleaseBlocksInFlight(pnodeStalling);
+    }
+}
+
+// The "block" messages of the last few blocks served. When a new block is
+// announced, the peers that ask for it all get the same serialized message.
+static const unsigned int MAX_RECENT_BLOCK_MESSAGES = 4;
+static CCriticalSection cs_recentBlockMessages;
+static list<pair<uint256, CSendBuffer> > listRecentBlockMessages;
+
+static CSendBuffer GetBlockMessage(const CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_recentBlockMessages);
+        for (list<pair<uint256, CSendBuffer> >::iterator it = listRecentBlockMessages.begin(); it != listRecentBlockMessages.end(); it++)
+            if (it->first == hash)
+                return it->second;
+    }
+
+    // Forward the block as it is stored, without deserializing it
+    CBlockFileSpan span;
+    if (!ReadRawBlockFromDisk(span, pindex))
+        return CSendBuffer();
+    CSendBuffer pbuf = SerializeMessage("block", CFlatData((void*)span.begin(), (void*)span.end()));
+
+    LOCK(cs_recentBlockMessages);
+    listRecentBlockMessages.push_front(make_pair(hash, pbuf));
+    if (listRecentBlockMessages.size() > MAX_RECENT_BLOCK_MESSAGES)
+        listRecentBlockMessages.pop_back();
+    return pbuf;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -3259,18 +4360,39 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Send block from disk. Where a block is stored doesn't change
+                // once it's there, so only the lookup needs the lock.
+                CBlockIndex* pindex = NULL;
+                uint256 hashBest;
+                int nBestHeightNow;
                 {
-                    CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    LOCK(cs_blockIndex);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end() && ((*mi).second->nStatus & BLOCK_HAVE_DATA))
+                        pindex = (*mi).second;
+                    hashBest = hashBestChain;
+                    nBestHeightNow = nBestHeight;
+                }
+                if (pindex)
+                {
+                    if (inv.type == MSG_CMPCT_BLOCK && pindex->nHeight > nBestHeightNow - MAX_CMPCTBLOCK_DEPTH)
+                    {
+                        CBlock block;
+                        if (ReadBlockFromDisk(block, pindex))
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        CSendBuffer pbuf = GetBlockMessage(pindex);
+                        if (pbuf)
+                            pfrom->PushSerializedMessage(pbuf);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        CBlock block;
+                        ReadBlockFromDisk(block, pindex);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3283,9 +4405,15 @@ void static ProcessGetData(CNode* pfrom)
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            vector<unsigned int> vTxToSend;
+                            {
+                                LOCK(pfrom->cs_inventory);
+                                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                        vTxToSend.push_back(pair.first);
+                            }
+                            BOOST_FOREACH(unsigned int nTx, vTxToSend)
+                                pfrom->PushMessage("tx", block.vtx[nTx]);
                         }
                         // else
                             // no response
@@ -3298,7 +4426,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBest));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3351,6 +4479,43 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// A block from pfrom, received in full or put together from a compact block
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    pfrom->AddInventoryKnown(inv);
+
+    MarkBlockNotInFlight(inv.hash);
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block))
+    {
+        mapAlreadyAskedFor.erase(inv);
+        UpdateBlockAvailability(pfrom, inv.hash);
+    }
+    int nDoS;
+    if (state.IsInvalid(nDoS))
+        pfrom->Misbehaving(nDoS);
+}
+
+// Put together the block of a compact block from pfrom with the transactions
+// that were missing from it. If that fails, because a short ID matched the
+// wrong transaction or pfrom sent the wrong ones, ask for the whole block.
+void static ProcessCompactBlock(CNode* pfrom, const uint256& hash, const vector<CTransaction>& vtxMissing)
+{
+    map<uint256, CPartialBlock>::iterator it = mapPartialBlocks.find(hash);
+    CBlock block;
+    bool fFilled = (*it).second.FillBlock(block, vtxMissing);
+    mapPartialBlocks.erase(it);
+    if (!fFilled)
+    {
+        printf("compact block %s could not be put together, asking for the full block\n", hash.ToString().c_str());
+        vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+        pfrom->PushMessage("getdata", vGetData);
+        return;
+    }
+    ProcessReceivedBlock(pfrom, block);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3559,14 +4724,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             return error("message inv size() = %"PRIszu"", vInv.size());
         }
 
-        // find last block in inv vector
-        unsigned int nLastBlock = (unsigned int)(-1);
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
-            if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
-                nLastBlock = vInv.size() - 1 - nInv;
-                break;
-            }
-        }
         for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
         {
             const CInv &inv = vInv[nInv];
@@ -3578,18 +4735,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave) {
-                if (!fImporting && !fReindex)
-                    pfrom->AskFor(inv);
-            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
-                // In case we are on a very long side-chain, it is possible that we already have
-                // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                PushGetBlocks(pfrom, mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    printf("force request: %s\n", inv.ToString().c_str());
+            if (inv.type == MSG_BLOCK) {
+                UpdateBlockAvailability(pfrom, inv.hash);
+                if (fImporting || fReindex) {
+                } else if (mapOrphanBlocks.count(inv.hash)) {
+                    PushGetHeaders(pfrom, pindexBestHeader, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+                } else if (!mapBlockIndex.count(inv.hash)) {
+                    // Get the headers leading up to it first; the block is
+                    // then downloaded along with the others
+                    PushGetHeaders(pfrom, pindexBestHeader, inv.hash);
+                }
+            } else if (!fAlreadyHave && !fImporting && !fReindex) {
+                pfrom->AskFor(inv);
             }
 
             // Track requests for our stuff
@@ -3625,6 +4782,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
+        LOCK(cs_blockIndex);
+
         // Find the last block the caller has in the main chain
         CBlockIndex* pindex = locator.GetBlockIndex();
 
@@ -3659,34 +4818,83 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         uint256 hashStop;
         vRecv >> locator >> hashStop;
 
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
+        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
+        vector<CBlock> vHeaders;
         {
-            // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
+            LOCK(cs_blockIndex);
+            CBlockIndex* pindex = NULL;
+            if (locator.IsNull())
+            {
+                // If locator is null, return the hashStop block
+                BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+                if (mi == mapBlockIndex.end())
+                    return true;
+                pindex = (*mi).second;
+            }
+            else
+            {
+                // Find the last block the caller has in the main chain
+                pindex = locator.GetBlockIndex();
+                if (pindex)
+                    pindex = pindex->GetNextInMainChain();
+            }
+
+            int nLimit = 2000;
+            printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
+            for (; pindex; pindex = pindex->GetNextInMainChain())
+            {
+                vHeaders.push_back(pindex->GetBlockHeader());
+                if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+                    break;
+            }
         }
-        else
+        pfrom->PushMessage("headers", vHeaders);
+    }
+
+
+    else if (strCommand == "headers" && !fImporting && !fReindex) // Ignore headers received while importing
+    {
+        // Headers are sent as blocks without transactions; read them without
+        // deserializing up to 2000 full blocks
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS)
         {
-            // Find the last block the caller has in the main chain
-            pindex = locator.GetBlockIndex();
-            if (pindex)
-                pindex = pindex->GetNextInMainChain();
+            pfrom->Misbehaving(20);
+            return error("headers message size = %u", nCount);
+        }
+        vector<CBlockHeader> vHeaders(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            vRecv >> vHeaders[n];
+            ReadCompactSize(vRecv); // number of transactions, always 0
         }
 
-        // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
-        vector<CBlock> vHeaders;
-        int nLimit = 2000;
-        printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
-        for (; pindex; pindex = pindex->GetNextInMainChain())
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
+            if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
+            {
+                pfrom->Misbehaving(20);
+                return error("non-continuous headers sequence");
+            }
+            CValidationState state;
+            if (!AcceptBlockHeader(header, state, &pindexLast))
+            {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    pfrom->Misbehaving(nDoS);
+                return error("invalid header received");
+            }
         }
-        pfrom->PushMessage("headers", vHeaders);
+
+        if (pindexLast)
+            UpdateBlockAvailability(pfrom, pindexLast->GetBlockHash());
+        if (pfrom->hashLastUnknownBlock != 0)
+            UpdateBlockAvailability(pfrom, pfrom->hashLastUnknownBlock);
+
+        // A full message means the peer may have more
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast)
+            PushGetHeaders(pfrom, pindexLast, uint256(0));
     }
 
 
@@ -3779,21 +4987,98 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        ProcessReceivedBlock(pfrom, block);
+    }
 
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS;
-        if (state.IsInvalid(nDoS))
-            pfrom->Misbehaving(nDoS);
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // Only compact blocks that were asked for are taken
+        uint256 hash = cmpctblock.header.GetHash();
+        map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.find(hash);
+        if (it == mapBlocksInFlight.end() || (*it).second.first != pfrom || mapPartialBlocks.count(hash))
+            return true;
+
+        CPartialBlock& partial = mapPartialBlocks[hash];
+        if (!partial.Init(cmpctblock, mempool))
+        {
+            mapPartialBlocks.erase(hash);
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        partial.GetMissing(req.vIndexes);
+        printf("received compact block %s, %"PRIszu" of %u transactions missing\n", hash.ToString().c_str(), req.vIndexes.size(), cmpctblock.BlockTxCount());
+        if (req.vIndexes.empty())
+            ProcessCompactBlock(pfrom, hash, vector<CTransaction>());
+        else
+            pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !((*mi).second->nStatus & BLOCK_HAVE_DATA))
+            return true;
+        CBlockIndex* pindex = (*mi).second;
+
+        // Deeper blocks aren't sent as compact blocks; send the whole block
+        if (pindex->nHeight <= nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+        {
+            CSendBuffer pbuf = GetBlockMessage(pindex);
+            if (pbuf)
+                pfrom->PushSerializedMessage(pbuf);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("getblocktxn : failed to read block %s", req.blockhash.ToString().c_str());
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.vtx.reserve(req.vIndexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn with out-of-bounds tx indexes");
+            }
+            resp.vtx.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, pair<CNode*, int64> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || (*it).second.first != pfrom || !mapPartialBlocks.count(resp.blockhash))
+            return true;
+
+        ProcessCompactBlock(pfrom, resp.blockhash, resp.vtx);
     }
 
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -3877,12 +5162,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         CBloomFilter filter;
         vRecv >> filter;
 
+        LOCK(pfrom->cs_filter);
         if (!filter.IsWithinSizeConstraints())
             // There is no excuse for sending a too-large filter
             pfrom->Misbehaving(100);
         else
         {
-            LOCK(pfrom->cs_filter);
             delete pfrom->pfilter;
             pfrom->pfilter = new CBloomFilter(filter);
         }
@@ -3934,6 +5219,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Messages that only touch the peer itself, the address manager, the relay
+// memory, the memory pool or (under cs_blockIndex) the block index are
+// processed without cs_main, so serving them doesn't hold up other peers
+static bool MessageNeedsMain(const string& strCommand)
+{
+    return !(strCommand == "getdata" || strCommand == "getblocks" || strCommand == "getheaders" ||
+             strCommand == "addr" || strCommand == "getaddr" || strCommand == "ping" ||
+             strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear");
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3953,6 +5248,26 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
+    // Compute the payload hashes of all complete messages that have not been
+    // hashed yet in one batch, rather than one message at a time below
+    std::vector<CNetMessage*> vpmsgHash;
+    std::vector<std::pair<const unsigned char*, size_t> > vHashInputs;
+    for (std::deque<CNetMessage>::iterator mi = pfrom->vRecvMsg.begin(); mi != pfrom->vRecvMsg.end() && mi->complete(); mi++) {
+        if (mi->fHashed)
+            continue;
+        const unsigned char* pch = mi->vRecv.empty() ? NULL : (const unsigned char*)&mi->vRecv.begin()[0];
+        vpmsgHash.push_back(&(*mi));
+        vHashInputs.push_back(std::make_pair(pch, (size_t)mi->hdr.nMessageSize));
+    }
+    if (!vHashInputs.empty()) {
+        std::vector<uint256> vHashes;
+        HashBatch(vHashInputs, vHashes);
+        for (unsigned int i = 0; i < vpmsgHash.size(); i++) {
+            vpmsgHash[i]->hashData = vHashes[i];
+            vpmsgHash[i]->fHashed = true;
+        }
+    }
+
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
@@ -3995,9 +5310,8 @@ bool ProcessMessages(CNode* pfrom)
 
         // Checksum
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
         unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+        memcpy(&nChecksum, &msg.hashData, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
         {
             printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
@@ -4009,10 +5323,13 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (MessageNeedsMain(strCommand))
             {
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
+            else
+                fRet = ProcessMessage(pfrom, strCommand, vRecv);
             boost::this_thread::interruption_point();
         }
         catch (std::ios_base::failure& e)
@@ -4074,7 +5391,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            PushGetHeaders(pto, pindexBestHeader, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4095,7 +5412,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4114,25 +5434,21 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrToSend, vAddr;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.swap(pto->vAddrToSend);
+                vAddr.reserve(vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(i + 1000, (unsigned int)vAddr.size())));
         }
 
 
@@ -4198,6 +5514,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata
         //
         vector<CInv> vGetData;
+        if (!pto->fDisconnect && !pto->fClient && !pto->fOneShot && !fImporting && !fReindex)
+            FindBlocksToDownload(pto, vGetData);
         int64 nNow = GetTime() * 1000000;
         while (!pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow)
         {
@@ -4282,32 +5600,33 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 // All input buffers are 16-byte aligned.  nNonce is usually preserved
 // between calls, but periodically or if nNonce is 0xffff0000 or above,
 // the block is rebuilt and nNonce starts over at zero.
+// The nonces are tried in batches through SHA256ScanNonces, which works
+// on 4 or 8 of them per pass depending on the SHA256 backend of this CPU.
 //
-unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+unsigned int static ScanHash(char* pmidstate, char* pdata, char* phash, unsigned int& nHashesDone)
 {
     unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    nHashesDone = 0;
     for (;;)
     {
-        // Crypto++ SHA256
-        // Hash pdata using pmidstate as the starting state into
-        // pre-formatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
+        // Try the nonces up to the next multiple of 0x1000, starting at nNonce+1
+        unsigned int nCount = 0x1000 - (nNonce & 0xfff);
+        unsigned int nNonceFound;
+        if (SHA256ScanNonces((uint32_t*)pmidstate, (uint32_t*)pdata, nNonce + 1, nCount, nNonceFound, (uint32_t*)phash))
+        {
+            // Return the nonce if the hash has at least some zero bits,
+            // caller will check if it has enough to reach the target
+            nHashesDone += nNonceFound - nNonce;
+            nNonce = nNonceFound;
             return nNonce;
+        }
+        nHashesDone += nCount;
+        nNonce += nCount;
 
         // If nothing found after trying for a while, return -1
         if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
             return (unsigned int) -1;
-        }
-        if ((nNonce & 0xfff) == 0)
-            boost::this_thread::interruption_point();
+        boost::this_thread::interruption_point();
     }
 }
 
@@ -4456,7 +5775,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
                     nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                const CCoins &coins = view.AccessCoins(txin.prevout.hash);
 
                 int64 nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
@@ -4673,7 +5992,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     uint256 hash = pblock->GetHash();
-    uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+    uint256 hashTarget = uint256().SetCompact(pblock->nBits);
 
     if (hash > hashTarget)
         return false;
@@ -4710,7 +6029,7 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 
 void static BitcoinMiner(CWallet *pwallet)
 {
-    printf("CaliforniumMiner started\n");
+    printf("CaliforniumMiner started, scanning nonces with the %s SHA256 backend\n", SHA256BackendName(SHA256GetBackend()));
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitcoin-miner");
 
@@ -4759,7 +6078,7 @@ void static BitcoinMiner(CWallet *pwallet)
         // Search
         //
         int64 nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = uint256().SetCompact(pblock->nBits);
         uint256 hashbuf[2];
         uint256& hash = *alignup<16>(hashbuf);
         loop
@@ -4767,9 +6086,7 @@ void static BitcoinMiner(CWallet *pwallet)
             unsigned int nHashesDone = 0;
             unsigned int nNonceFound;
 
-            // Crypto++ SHA256
-            nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1,
-                                            (char*)&hash, nHashesDone);
+            nNonceFound = ScanHash(pmidstate, pdata + 64, (char*)&hash, nHashesDone);
 
             // Check if something found
             if (nNonceFound != (unsigned int) -1)
@@ -4843,7 +6160,7 @@ void static BitcoinMiner(CWallet *pwallet)
             {
                 // Changing pblock->nTime can change work required on testnet:
                 nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+                hashTarget = uint256().SetCompact(pblock->nBits);
             }
         }
     } }
@@ -4889,10 +6206,8 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        std::map<uint256, CBlockIndex*>::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        arenaBlockIndex.Clear();
 
         // orphan blocks
         std::map<uint256, CBlock*>::iterator it2 = mapOrphanBlocks.begin();
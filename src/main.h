@@ -10,9 +10,12 @@
 #include "sync.h"
 #include "net.h"
 #include "script.h"
+#include "coinsmap.h"
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CWallet;
 class CBlock;
 class CBlockIndex;
@@ -52,6 +55,27 @@ static const int COINBASE_MATURITY = 100;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Default number of threads reading block inputs from the coin database ahead of validation */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Maximum number of input prefetch threads */
+static const int MAX_PREFETCH_THREADS = 16;
+/** Maximum number of blocks connected by one SetBestChain call. Script checks
+ *  of one block overlap with the inputs of the next only within a call, while
+ *  the coins cache is flushed and the tip moves only between calls. */
+static const unsigned int MAX_BLOCKS_TO_CONNECT = 32;
+/** Number of blocks that can be requested from a single peer at the same time */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Number of blocks past the best chain that are downloaded in parallel. A peer
+ *  that holds up the start of this window gets its blocks given to others. */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds a peer may hold up the download window before it counts as stalling */
+static const int64 BLOCK_STALLING_TIMEOUT = 10;
+/** Seconds after which a block that was requested, but not received, is requested elsewhere */
+static const int64 BLOCK_DOWNLOAD_TIMEOUT = 120;
+/** Depth up to which blocks are sent as compact blocks; deeper ones go in full */
+static const int MAX_CMPCTBLOCK_DEPTH = 10;
+/** Maximum number of headers in a headers message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
 /** Default amount of block size reserved for high-priority transactions (in bytes) */
 static const int DEFAULT_BLOCK_PRIORITY_SIZE = 27000;
 #ifdef USE_UPNP
@@ -65,12 +89,25 @@ extern CScript COINBASE_FLAGS;
 
 
 
-
+/** Block hashes are the outcome of proof of work, so any part of them is a
+ *  good hash for a hash table */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Lets the message handlers look up blocks and walk the main chain without
+ *  cs_main. Whoever adds to mapBlockIndex, stores a block or changes the main
+ *  chain (vBlockIndexByHeight, hashBestChain, pindexBest, nBestHeight) after
+ *  startup holds both. */
+extern CCriticalSection cs_blockIndex;
+extern BlockMap mapBlockIndex;
 extern std::vector<CBlockIndex*> vBlockIndexByHeight;
+extern CBlockIndex* pindexBestHeader;
+extern std::vector<CBlockIndex*> vHeaderIndexByHeight;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
@@ -91,8 +128,11 @@ extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
+extern bool fBatchVerify;
+extern bool fCompactBlocks;
 extern bool fTxIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
 extern bool fHaveGUI;
 
 // Settings
@@ -105,7 +145,9 @@ static const uint64 nMinDiskSpace = 52428800;
 class CReserveKey;
 class CCoinsDB;
 class CBlockTreeDB;
+class CCoinsViewWriteBehind;
 struct CDiskBlockPos;
+class CBlockFileSpan;
 class CCoins;
 class CTxUndo;
 class CCoinsView;
@@ -129,10 +171,10 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
+void PushGetHeaders(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-/** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+/** Process an incoming block; fChecked means CheckBlock already passed for it */
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -153,12 +195,16 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth);
 void PrintBlockTree();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
+/** Find the last block that is an ancestor of both pa and pb, or NULL if there is none */
+CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the input prefetching thread */
+void ThreadPrefetchInputs();
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
 /** Generate a new block, without valid proof-of-work */
@@ -173,6 +219,8 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
 unsigned int ComputeMinWork(unsigned int nBase, int64 nTime);
+/** Calculate the proof-of-work requirement (nBits) of the block that follows pindexLast */
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock);
 /** Get the number of active peers */
 int GetNumBlocksOfPeers();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -312,10 +360,10 @@ inline bool AllowFree(double dPriority)
 
 // Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
 // This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
-// instead of being performed inline.
+// instead of being performed inline; they use pSigHashContext, which must then outlive them.
 bool CheckInputs(const CTransaction& tx, CValidationState &state, CCoinsViewCache &view, bool fScriptChecks = true,
                  unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC,
-                 std::vector<CScriptCheck> *pvChecks = NULL);
+                 std::vector<CScriptCheck> *pvChecks = NULL, const CSigHashContext *pSigHashContext = NULL);
 
 // Apply the effects of this transaction on the UTXO set represented by view
 bool UpdateCoins(const CTransaction& tx, CCoinsViewCache &view, CTxUndo &txundo, int nHeight, const uint256 &txhash);
@@ -407,7 +455,8 @@ public:
 
 
 /** Closure representing one script verification
- *  Note that this stores references to the spending transaction */
+ *  Note that this stores references to the spending transaction, and to its
+ *  signature hash context if there is one */
 class CScriptCheck
 {
 private:
@@ -416,21 +465,31 @@ private:
     unsigned int nIn;
     unsigned int nFlags;
     int nHashType;
+    const CSigHashContext *pSigHashContext;
 
 public:
-    CScriptCheck() {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+    CScriptCheck() : pSigHashContext(NULL) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn,
+                 const CSigHashContext *pSigHashContextIn = NULL) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pSigHashContext(pSigHashContextIn) { }
 
     bool operator()() const;
 
+    // Whether the script's signature checks are worth deferring, see CanDeferSignatures
+    bool CanDefer() const;
+
+    // Run the script with the checks of signatures that aren't cached put off
+    // into vDeferred; it is only valid if those are
+    bool Defer(std::vector<CPendingSignature> &vDeferred) const;
+
     void swap(CScriptCheck &check) {
         scriptPubKey.swap(check.scriptPubKey);
         std::swap(ptxTo, check.ptxTo);
         std::swap(nIn, check.nIn);
         std::swap(nFlags, check.nFlags);
         std::swap(nHashType, check.nHashType);
+        std::swap(pSigHashContext, check.pSigHashContext);
     }
 };
 
@@ -588,6 +647,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+// Get the serialized block of pindex, to forward it without deserializing it
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -604,9 +665,15 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 // Add this block to the block index, and if necessary, switch the active block chain to this
 bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos);
 
+// Context-independent validity checks of a block header
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
+// Check a block header against its parent, and add it to the block index if it is new
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+
 // Store block on disk
 // if dbp is provided, the file is known to already reside on disk
 bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
@@ -702,6 +769,9 @@ public:
     // pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
 
+    // pointer to the index of some further predecessor of this block
+    CBlockIndex* pskip;
+
     // height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -734,11 +804,16 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // (memory only) nBits required of the blocks that follow this one, if they
+    // don't depend on the time of the block itself, or 0 if not computed yet
+    mutable unsigned int nNextBits;
+
 
     CBlockIndex()
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -753,12 +828,14 @@ public:
         nTime          = 0;
         nBits          = 0;
         nNonce         = 0;
+        nNextBits      = 0;
     }
 
-    CBlockIndex(CBlockHeader& block)
+    CBlockIndex(const CBlockHeader& block)
     {
         phashBlock = NULL;
         pprev = NULL;
+        pskip = NULL;
         nHeight = 0;
         nFile = 0;
         nDataPos = 0;
@@ -773,6 +850,7 @@ public:
         nTime          = block.nTime;
         nBits          = block.nBits;
         nNonce         = block.nNonce;
+        nNextBits      = 0;
     }
 
     CDiskBlockPos GetBlockPos() const {
@@ -816,13 +894,18 @@ public:
         return (int64)nTime;
     }
 
-    CBigNum GetBlockWork() const
+    uint256 GetBlockWork() const
     {
-        CBigNum bnTarget;
-        bnTarget.SetCompact(nBits);
-        if (bnTarget <= 0)
+        uint256 bnTarget;
+        bool fNegative, fOverflow;
+        bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
+        if (fNegative || fOverflow || bnTarget == 0)
             return 0;
-        return (CBigNum(1)<<256) / (bnTarget+1);
+        // 2**256 / (bnTarget+1) doesn't fit in 256 bits, but it is equal to
+        // ~bnTarget / (bnTarget+1) + 1
+        uint256 bnWork = ~bnTarget;
+        bnWork /= bnTarget + 1;
+        return bnWork + 1;
     }
 
     bool IsInMainChain() const
@@ -874,6 +957,14 @@ public:
     static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart,
                                 unsigned int nRequired, unsigned int nToCheck);
 
+    // Build the skip pointer; pprev and nHeight must be set, and the skip
+    // pointers of the ancestors built
+    void BuildSkip();
+
+    // Efficiently find an ancestor of this block
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     std::string ToString() const
     {
         return strprintf("CBlockIndex(pprev=%p, pnext=%p, nHeight=%d, merkle=%s, hashBlock=%s)",
@@ -1149,8 +1240,9 @@ public:
     // Modify the currently active block index
     virtual bool SetBestBlock(CBlockIndex *pindex);
 
-    // Do a bulk modification (multiple SetCoins + one SetBestBlock)
-    virtual bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    // Do a bulk modification (multiple SetCoins + one SetBestBlock).
+    // The coins in mapCoins may be taken over; the caller discards them afterwards.
+    virtual bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats);
@@ -1173,7 +1265,7 @@ public:
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
     void SetBackend(CCoinsView &viewIn);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
 };
 
@@ -1182,7 +1274,15 @@ class CCoinsViewCache : public CCoinsViewBacked
 {
 protected:
     CBlockIndex *pindexTip;
-    std::map<uint256,CCoins> cacheCoins;
+    CCoinsMap cacheCoins;
+
+    // Sum of the dynamic memory usage of the coins in cacheCoins, as of when
+    // they were last stored. Coins modified in place through GetCoins only
+    // shrink, so this stays an upper bound.
+    size_t cachedCoinsUsage;
+
+    uint64 nLookups;
+    uint64 nMisses;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -1193,13 +1293,22 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
 
     // Return a modifiable reference to a CCoins. Check HaveCoins first.
     // Many methods explicitly require a CCoinsViewCache because of this method, to reduce
-    // copying.
+    // copying. The coins are assumed to be modified, and will be written on flush.
     CCoins &GetCoins(const uint256 &txid);
 
+    // Return a read-only reference to a CCoins. Check HaveCoins first.
+    // Unlike GetCoins, this does not cause the coins to be written on flush.
+    const CCoins &AccessCoins(const uint256 &txid);
+
+    // Store the outputs of a newly created transaction. The caller guarantees
+    // that no unspent version of txid exists in the base view (BIP30), so if
+    // they are all spent before the next flush, they are never written at all.
+    bool SetNewCoins(const uint256 &txid, const CCoins &coins);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     bool Flush();
@@ -1207,6 +1316,23 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Estimate the heap memory used by the cache, in bytes
+    size_t DynamicMemoryUsage() const;
+
+    // Check whether txid has an entry in this cache, without fetching it
+    bool HaveCoinsInCache(const uint256 &txid) const;
+
+    // Store coins that were read from the base view by another thread, unless
+    // txid has an entry already. If the base view didn't have them (!fFound),
+    // an entry for fresh spent coins saves looking them up there again; that
+    // is only right in a cache that is dropped, or written back, once the
+    // block that creates them is connected.
+    void AddPrefetchedCoins(const uint256 &txid, CCoins &coins, bool fFound);
+
+    // Number of lookups of coins in this cache, and how many of them had to
+    // be passed on to the base view
+    void GetFetchStats(uint64 &nLookupsOut, uint64 &nMissesOut) const;
+
     /** Amount of bitcoins coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
@@ -1223,7 +1349,7 @@ public:
     const CTxOut &GetOutputFor(const CTxIn& input);
 
 private:
-    std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
+    CCoinsMap::iterator FetchCoins(const uint256 &txid);
 };
 
 /** CCoinsView that brings transactions from a memorypool into view.
@@ -1242,6 +1368,9 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the background writer below pcoinsTip (protected by cs_main) */
+extern CCoinsViewWriteBehind *pcoinsWriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
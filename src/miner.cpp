@@ -7,6 +7,7 @@
 #include "wallet.h"
 #include "miner.h"
 #include "main.h"
+#include "sha256.h"
 
 
 
@@ -60,32 +61,33 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 // All input buffers are 16-byte aligned.  nNonce is usually preserved
 // between calls, but periodically or if nNonce is 0xffff0000 or above,
 // the block is rebuilt and nNonce starts over at zero.
+// The nonces are tried in batches through SHA256ScanNonces, which works
+// on 4 or 8 of them per pass depending on the SHA256 backend of this CPU.
 //
-unsigned int static ScanHash_CryptoPP(char* pmidstate, char* pdata, char* phash1, char* phash, unsigned int& nHashesDone)
+unsigned int static ScanHash(char* pmidstate, char* pdata, char* phash, unsigned int& nHashesDone)
 {
     unsigned int& nNonce = *(unsigned int*)(pdata + 12);
+    nHashesDone = 0;
     for (;;)
     {
-        // Crypto++ SHA256
-        // Hash pdata using pmidstate as the starting state into
-        // pre-formatted buffer phash1, then hash phash1 into phash
-        nNonce++;
-        SHA256Transform(phash1, pdata, pmidstate);
-        SHA256Transform(phash, phash1, pSHA256InitState);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((unsigned short*)phash)[14] == 0)
+        // Try the nonces up to the next multiple of 0x1000, starting at nNonce+1
+        unsigned int nCount = 0x1000 - (nNonce & 0xfff);
+        unsigned int nNonceFound;
+        if (SHA256ScanNonces((uint32_t*)pmidstate, (uint32_t*)pdata, nNonce + 1, nCount, nNonceFound, (uint32_t*)phash))
+        {
+            // Return the nonce if the hash has at least some zero bits,
+            // caller will check if it has enough to reach the target
+            nHashesDone += nNonceFound - nNonce;
+            nNonce = nNonceFound;
             return nNonce;
+        }
+        nHashesDone += nCount;
+        nNonce += nCount;
 
         // If nothing found after trying for a while, return -1
         if ((nNonce & 0xffff) == 0)
-        {
-            nHashesDone = 0xffff+1;
             return (unsigned int) -1;
-        }
-        if ((nNonce & 0xfff) == 0)
-            boost::this_thread::interruption_point();
+        boost::this_thread::interruption_point();
     }
 }
 
@@ -234,7 +236,7 @@ CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
                     nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins &coins = view.GetCoins(txin.prevout.hash);
+                const CCoins &coins = view.AccessCoins(txin.prevout.hash);
 
                 int64 nValueIn = coins.vout[txin.prevout.n].nValue;
                 nTotalIn += nValueIn;
@@ -488,7 +490,7 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 
 void static BitcoinMiner(CWallet *pwallet)
 {
-    printf("BitcoinMiner started\n");
+    printf("BitcoinMiner started, scanning nonces with the %s SHA256 backend\n", SHA256BackendName(SHA256GetBackend()));
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("bitcoin-miner");
 
@@ -545,9 +547,7 @@ void static BitcoinMiner(CWallet *pwallet)
             unsigned int nHashesDone = 0;
             unsigned int nNonceFound;
 
-            // Crypto++ SHA256
-            nNonceFound = ScanHash_CryptoPP(pmidstate, pdata + 64, phash1,
-                                            (char*)&hash, nHashesDone);
+            nNonceFound = ScanHash(pmidstate, pdata + 64, (char*)&hash, nHashesDone);
 
             // Check if something found
             if (nNonceFound != (unsigned int) -1)
@@ -13,6 +13,12 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#if USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -31,6 +37,8 @@ using namespace boost;
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void AddSocketEvents(SOCKET hSocket, CNode *pnode);
+static void ScheduleNode(CNode* pnode, bool fSendTrickle);
 
 
 struct LocalServiceInfo {
@@ -53,6 +61,7 @@ uint64 nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageHandlerThreads = DEFAULT_MESSAGE_HANDLER_THREADS;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -493,6 +502,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        AddSocketEvents(hSocket, pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -503,12 +513,22 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     }
 }
 
+#if USE_EPOLL
+// Sockets are registered with hEpoll once, edge triggered
+static int hEpoll = -1;
+#endif
+
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET)
     {
         printf("disconnecting node %s\n", addrName.c_str());
+#if USE_EPOLL
+        // Closing doesn't unregister the socket if a copy of it is still open
+        // somewhere, and the node may be deleted once it is disconnected
+        epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -614,7 +634,7 @@ void CNode::copyStats(CNodeStats &stats)
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool &fComplete)
 {
     while (nBytes > 0) {
 
@@ -635,6 +655,9 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+            fComplete = true;
+
         pch += handled;
         nBytes -= handled;
     }
@@ -642,26 +665,98 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
     return true;
 }
 
+// Free receive buffers by size class. A message's buffer is taken from the
+// smallest class it fits and given back when the message is destroyed, so a
+// busy node doesn't allocate, and zero on freeing, a buffer per message.
+static const unsigned int RECV_BUFFER_CLASSES = 4;
+static const size_t nRecvBufferClassSize[RECV_BUFFER_CLASSES] = { 256, 4 * 1024, 64 * 1024, 1024 * 1024 };
+static const unsigned int nRecvBufferClassMax[RECV_BUFFER_CLASSES] = { 4096, 512, 64, 8 };
+
+static bool fRecvBufferPoolDestroyed = false;
+
+class CRecvBufferPool
+{
+public:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[RECV_BUFFER_CLASSES];
+
+    ~CRecvBufferPool()
+    {
+        fRecvBufferPoolDestroyed = true;
+    }
+}
+recvBufferPool;
+
+// Give stream an empty buffer for nSize bytes
+static void GetRecvBuffer(CDataStream& stream, unsigned int nSize)
+{
+    CSerializeData vch;
+    unsigned int nClass = 0;
+    while (nClass < RECV_BUFFER_CLASSES && nRecvBufferClassSize[nClass] < nSize)
+        nClass++;
+    if (nClass < RECV_BUFFER_CLASSES)
+    {
+        {
+            LOCK(recvBufferPool.cs);
+            if (!recvBufferPool.vFree[nClass].empty())
+            {
+                vch.swap(recvBufferPool.vFree[nClass].back());
+                recvBufferPool.vFree[nClass].pop_back();
+            }
+        }
+        if (vch.capacity() == 0)
+            vch.reserve(nRecvBufferClassSize[nClass]);
+    }
+    else
+        vch.reserve(nSize);
+    stream.GetAndReplace(vch);
+}
+
+// Take back the buffer of stream, if its class isn't full yet
+static void ReleaseRecvBuffer(CDataStream& stream)
+{
+    CSerializeData vch;
+    stream.GetAndReplace(vch);
+    if (fRecvBufferPoolDestroyed)
+        return;
+    unsigned int nClass = RECV_BUFFER_CLASSES;
+    while (nClass > 0 && nRecvBufferClassSize[nClass - 1] > vch.capacity())
+        nClass--;
+    if (nClass == 0 || vch.capacity() > 2 * nRecvBufferClassSize[nClass - 1])
+        return;
+    vch.clear();
+    LOCK(recvBufferPool.cs);
+    std::vector<CSerializeData>& vFree = recvBufferPool.vFree[nClass - 1];
+    if (vFree.size() < nRecvBufferClassMax[nClass - 1])
+    {
+        vFree.push_back(CSerializeData());
+        vFree.back().swap(vch);
+    }
+}
+
+CNetMessage::~CNetMessage()
+{
+    ReleaseRecvBuffer(vRecv);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdr[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (std::exception &e) {
-        return -1;
-    }
+    // deserialize to CMessageHeader, the fields being stored as they are
+    memcpy(hdr.pchMessageStart, &pchHdr[0], MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &pchHdr[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    memcpy(&hdr.nMessageSize, &pchHdr[CMessageHeader::MESSAGE_SIZE_OFFSET], sizeof(hdr.nMessageSize));
+    memcpy(&hdr.nChecksum, &pchHdr[CMessageHeader::CHECKSUM_OFFSET], sizeof(hdr.nChecksum));
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
@@ -669,7 +764,7 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    GetRecvBuffer(vRecv, hdr.nMessageSize);
 
     return nCopy;
 }
@@ -679,7 +774,8 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    // append, rather than filling in a buffer zeroed beforehand
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -693,25 +789,122 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+// Send buffers up to this size are kept for reuse, as many as fit in the pool.
+// Larger ones (blocks, mostly) are rare enough to be allocated each time.
+static const size_t MAX_POOLED_SEND_BUFFER_SIZE = 64 * 1024;
+static const unsigned int MAX_POOLED_SEND_BUFFERS = 256;
+
+static bool fSendBufferPoolDestroyed = false;
+
+class CSendBufferPool
+{
+public:
+    CCriticalSection cs;
+    std::vector<CSerializeData*> vFree;
+
+    ~CSendBufferPool()
+    {
+        // Nodes and messages that outlive the pool free their own buffers
+        fSendBufferPoolDestroyed = true;
+        BOOST_FOREACH(CSerializeData* pdata, vFree)
+            delete pdata;
+    }
+}
+sendBufferPool;
+
+static void ReleaseSendBuffer(CSerializeData* pdata)
+{
+    if (!fSendBufferPoolDestroyed && pdata->capacity() <= MAX_POOLED_SEND_BUFFER_SIZE)
+    {
+        pdata->clear();
+        LOCK(sendBufferPool.cs);
+        if (sendBufferPool.vFree.size() < MAX_POOLED_SEND_BUFFERS)
+        {
+            sendBufferPool.vFree.push_back(pdata);
+            return;
+        }
+    }
+    delete pdata;
+}
+
+CSendBuffer NewSendBuffer()
+{
+    CSerializeData* pdata = NULL;
+    {
+        LOCK(sendBufferPool.cs);
+        if (!sendBufferPool.vFree.empty())
+        {
+            pdata = sendBufferPool.vFree.back();
+            sendBufferPool.vFree.pop_back();
+        }
+    }
+    if (!pdata)
+        pdata = new CSerializeData();
+    return CSendBuffer(pdata, ReleaseSendBuffer);
+}
+
+void FinishMessageHeader(CSerializeData& vch)
+{
+    // Set the size
+    assert(vch.size() >= CMessageHeader::HEADER_SIZE);
+    unsigned int nSize = vch.size() - CMessageHeader::HEADER_SIZE;
+    memcpy(&vch[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(vch.begin() + CMessageHeader::HEADER_SIZE, vch.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy(&vch[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+// The most messages handed to the kernel in one call
+static const int MAX_SEND_IOVECS = 64;
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBuffer>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        size_t nRequested = (*it)->size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &(**it)[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as much of the queue as one call takes
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nRequested = 0;
+        for (std::deque<CSendBuffer>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; itIov++, nIov++) {
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = &(**itIov)[nOffset];
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nRequested += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nRequested) {
+                // could not send all of it; stop sending more
                 break;
             }
         } else {
@@ -738,74 +931,379 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+#if USE_EPOLL
+// Nodes with readiness reported that the socket thread hasn't used up yet,
+// because it had to hold off or couldn't get the locks
+static set<CNode*> setNodesReady;
+#endif
+
+bool InitSocketEvents(string& strError)
+{
+#if USE_EPOLL
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+    {
+        strError = strprintf("Error: Couldn't create the socket event queue (epoll_create1 returned error %d)", errno);
+        printf("%s\n", strError.c_str());
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Have the socket event loop watch a listening socket, or the socket of a new node
+static void AddSocketEvents(SOCKET hSocket, CNode *pnode)
+{
+#if USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    // Listening sockets stay level triggered, so a backlog of connections
+    // that wasn't accepted in one go is reported again
+    event.events = pnode ? (EPOLLIN | EPOLLOUT | EPOLLET) : EPOLLIN;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+    {
+        printf("AddSocketEvents() : epoll_ctl failed, error %d\n", errno);
+        if (pnode)
+            pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
+static void DisconnectNodes(unsigned int &nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
+            {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
+#if USE_EPOLL
+                setNodesReady.erase(pnode);
+#endif
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+        {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
+            {
+                bool fDelete = false;
+                {
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
+                    {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
+                        {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
+                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if (vNodes.size() != nPrevNodeCount)
+    {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+    }
+}
+
+// Accept a connection on a listening socket; returns false if there was none
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+#if USE_EPOLL
+    SOCKET hSocket = accept4(hListenSocket, (struct sockaddr*)&sockaddr, &len, SOCK_CLOEXEC);
+#else
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+#endif
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        AddSocketEvents(hSocket, pnode);
+    }
+    return true;
+}
+
+// requires LOCK(cs_vRecvMsg)
+// Receive what the socket has, up to the size of the buffer. Returns false
+// once there is nothing more to receive, or the connection is closed.
+static bool SocketRecvData(CNode *pnode, bool &fNewMessage)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fNewMessage))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        return !pnode->fDisconnect;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            printf("socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                printf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void CheckInactivity(CNode *pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            printf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            printf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#if USE_EPOLL
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    int64 nLastSweep = 0;
+    struct epoll_event events[256];
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        AddSocketEvents(hListenSocket, NULL);
+
     loop
     {
         //
-        // Disconnect nodes
+        // Disconnect nodes, and check for inactive ones. That needs a look
+        // at every node, so it isn't done on every wakeup.
         //
+        if (GetTimeMillis() - nLastSweep >= 100)
         {
+            nLastSweep = GetTimeMillis();
+            DisconnectNodes(nPrevNodeCount);
             LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    CheckInactivity(pnode);
+        }
+
+        //
+        // Wait for sockets to become ready. Nodes that are still left over
+        // from before are looked at again after at most 50ms.
+        //
+        int nEvents = epoll_wait(hEpoll, events, ARRAYLEN(events), setNodesReady.empty() ? 100 : 50);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                printf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+        // A node is only deleted by DisconnectNodes in this thread, after
+        // its socket was taken out of hEpoll, so no event for it can still
+        // turn up
+        bool fAccept = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL)
+            {
+                fAccept = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                pnode->fReadable = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fWritable = true;
+            setNodesReady.insert(pnode);
+        }
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                    boost::this_thread::interruption_point();
+        }
+
+        //
+        // Service each ready socket
+        //
+        vector<CNode*> vNodesReady(setNodesReady.begin(), setNodesReady.end());
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+        {
+            boost::this_thread::interruption_point();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+            if (pnode->hSocket == INVALID_SOCKET)
+            {
+                setNodesReady.erase(pnode);
+                continue;
+            }
+
+            //
+            // Send
+            //
+            bool fSendPending = true;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                {
+                    // Whatever is left over filled up the socket buffer, and
+                    // it will be reported again once there is room
+                    if (pnode->fWritable && !pnode->vSendMsg.empty())
+                        SocketSendData(pnode);
+                    pnode->fWritable = false;
+                    fSendPending = !pnode->vSendMsg.empty();
                 }
             }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            //
+            // Receive, with the same flow control as in the select() loop:
+            // first drain the send buffer, and leave the data in the socket
+            // while the receive buffer is full. An edge triggered socket is
+            // only reported again after it was read until it's empty.
+            //
+            bool fNewMessage = false;
+            if (pnode->fReadable && !fSendPending)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
                 {
-                    bool fDelete = false;
+                    while (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                           pnode->GetTotalRecvSize() <= ReceiveFloodSize())
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        if (!SocketRecvData(pnode, fNewMessage))
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            pnode->fReadable = false;
+                            break;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
             }
+            if (fNewMessage)
+                ScheduleNode(pnode, false);
+
+            if (!pnode->fReadable && !pnode->fWritable)
+                setNodesReady.erase(pnode);
         }
-        if (vNodes.size() != nPrevNodeCount)
-        {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
-        }
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    loop
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
 
         //
@@ -894,59 +1392,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
-                }
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
-            }
-            else
-            {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -970,40 +1417,14 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                bool fNewMessage = false;
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
+                        SocketRecvData(pnode, fNewMessage);
                 }
+                if (fNewMessage)
+                    ScheduleNode(pnode, false);
             }
 
             //
@@ -1021,26 +1442,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            CheckInactivity(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1051,6 +1453,7 @@ void ThreadSocketHandler()
         MilliSleep(10);
     }
 }
+#endif
 
 
 
@@ -1479,9 +1882,93 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+// Nodes with messages to handle or a send pass due, in the order they came
+// up. A node is in here at most once, and taken by one handler thread at a
+// time, so that its messages are processed in order.
+static boost::mutex csMessageQueue;
+static boost::condition_variable condMessageQueue;
+static deque<CNode*> vMessageQueue;
+
+static void ScheduleNode(CNode* pnode, bool fSendTrickle)
+{
+    LOCK(cs_vNodes);
+    boost::unique_lock<boost::mutex> lock(csMessageQueue);
+    pnode->fSendTrickle |= fSendTrickle;
+    if (pnode->fScheduled)
+    {
+        pnode->fRescheduled = true;
+        return;
+    }
+    pnode->fScheduled = true;
+    pnode->AddRef();
+    vMessageQueue.push_back(pnode);
+    condMessageQueue.notify_one();
+}
+
+// Receive and send messages for the nodes that are scheduled
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode;
+        bool fSendTrickle;
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageQueue);
+            while (vMessageQueue.empty())
+                condMessageQueue.wait(lock);
+            pnode = vMessageQueue.front();
+            vMessageQueue.pop_front();
+            fSendTrickle = pnode->fSendTrickle;
+            pnode->fSendTrickle = false;
+            pnode->fRescheduled = false;
+        }
+
+        if (!pnode->fDisconnect)
+        {
+            // Receive messages
+            {
+                LOCK(pnode->cs_vRecvMsg);
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
+            }
+            boost::this_thread::interruption_point();
+
+            // Send messages
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    g_signals.SendMessages(pnode, fSendTrickle);
+            }
+            boost::this_thread::interruption_point();
+        }
+
+        bool fRelease = false;
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageQueue);
+            if (pnode->fRescheduled && !pnode->fDisconnect)
+            {
+                vMessageQueue.push_back(pnode);
+                condMessageQueue.notify_one();
+            }
+            else
+            {
+                pnode->fScheduled = false;
+                fRelease = true;
+            }
+        }
+        if (fRelease)
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+    }
+}
+
+// Schedule every node for a send pass, and those that couldn't finish
+// processing their messages before for another try
+void ThreadMessageScheduler()
+{
     while (true)
     {
         bool fHaveSyncNode = false;
@@ -1500,32 +1987,12 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
-        {
-            if (pnode->fDisconnect)
-                continue;
-
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
-            }
-            boost::this_thread::interruption_point();
-        }
+            if (!pnode->fDisconnect)
+                ScheduleNode(pnode, pnode == pnodeTrickle);
 
         {
             LOCK(cs_vNodes);
@@ -1561,7 +2028,7 @@ bool BindListenPort(const CService &addrBind, string& strError)
         return false;
     }
 
-    SOCKET hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    SOCKET hListenSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
     if (hListenSocket == INVALID_SOCKET)
     {
         strError = strprintf("Error: Couldn't open socket for incoming connections (socket returned error %d)", WSAGetLastError());
@@ -1734,7 +2201,9 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgsched", &ThreadMessageScheduler));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1769,6 +2238,10 @@ public:
             if (hListenSocket != INVALID_SOCKET)
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     printf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
+#if USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
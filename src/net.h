@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -25,6 +26,9 @@
 
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The default and maximum number of threads handling peers' messages */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
 
 class CNode;
 class CBlockIndex;
@@ -45,10 +49,32 @@ CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
 void MapPort(bool fUseUPnP);
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
+bool InitSocketEvents(std::string& strError);
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A complete message as it goes on the wire. The buffers come from a pool
+ *  and go back to it once no send queue holds them anymore; one message can
+ *  be queued for any number of peers.
+ */
+typedef boost::shared_ptr<CSerializeData> CSendBuffer;
+CSendBuffer NewSendBuffer();
+// Fill in the size and checksum of the message in vch
+void FinishMessageHeader(CSerializeData& vch);
+
+// Serialize a message once, to push it to several peers with PushSerializedMessage
+template<typename T>
+CSendBuffer SerializeMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    CSendBuffer pbuf = NewSendBuffer();
+    ss.GetAndReplace(*pbuf);
+    FinishMessageHeader(*pbuf);
+    return pbuf;
+}
+
 // Signals for message handling
 struct CNodeSignals
 {
@@ -89,6 +115,7 @@ extern uint64 nLocalServices;
 extern uint64 nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageHandlerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
@@ -128,20 +155,26 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdr[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, in a buffer from the receive pool
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    uint256 hashData;               // double-SHA256 of the complete message data
+    bool fHashed;                   // whether hashData has been computed
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        hashData = 0;
+        fHashed = false;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -151,7 +184,6 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -174,7 +206,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64 nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBuffer> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -198,6 +230,13 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // readiness of the socket reported by the epoll event loop, that hasn't been used up yet
+    bool fReadable;
+    bool fWritable;
+    // the message handler threads' queue of nodes with work; under its lock
+    bool fScheduled; // queued, or being handled
+    bool fRescheduled; // more work came in while being handled
+    bool fSendTrickle;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in their version message that we should not relay tx invs
@@ -217,14 +256,20 @@ protected:
 
 public:
     uint256 hashContinue;
-    CBlockIndex* pindexLastGetBlocksBegin;
-    uint256 hashLastGetBlocksEnd;
+    CBlockIndex* pindexLastGetHeadersBegin;
+    uint256 hashLastGetHeadersEnd;
     int nStartingHeight;
     bool fStartSync;
 
+    // block download
+    CBlockIndex* pindexBestKnownBlock; // best block this peer is known to have
+    uint256 hashLastUnknownBlock;      // last block it announced that we had no header for
+    int nBlocksInFlight;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
@@ -255,14 +300,22 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fReadable = false;
+        fWritable = false;
+        fScheduled = false;
+        fRescheduled = false;
+        fSendTrickle = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
-        pindexLastGetBlocksBegin = 0;
-        hashLastGetBlocksEnd = 0;
+        pindexLastGetHeadersBegin = 0;
+        hashLastGetHeadersEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        pindexBestKnownBlock = NULL;
+        hashLastUnknownBlock = 0;
+        nBlocksInFlight = 0;
         fGetAddr = false;
         nMisbehavior = 0;
         fRelayTxes = false;
@@ -307,7 +360,8 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    // fComplete is set if a message was completed
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool &fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -332,6 +386,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -340,6 +395,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -427,30 +483,39 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        // Queue the message in a pooled buffer, and keep serializing into the
+        // one that buffer had
+        CSendBuffer pbuf = NewSendBuffer();
+        ssSend.GetAndReplace(*pbuf);
+        FinishMessageHeader(*pbuf);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%"PRIszu" bytes)\n", pbuf->size() - CMessageHeader::HEADER_SIZE);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        QueueSendBuffer(pbuf);
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendBuffer(const CSendBuffer& pbuf)
+    {
+        vSendMsg.push_back(pbuf);
+        nSendSize += pbuf->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Queue a message made by SerializeMessage
+    void PushSerializedMessage(const CSendBuffer& pbuf)
+    {
+        if (fDebug)
+            printf("sending: %s (%"PRIszu" bytes, shared)\n", std::string(&(*pbuf)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE).c_str(), pbuf->size() - CMessageHeader::HEADER_SIZE);
+        LOCK(cs_vSend);
+        QueueSendBuffer(pbuf);
     }
 
     void PushVersion();
@@ -138,12 +138,25 @@ Value getrawmempool(const Array& params, bool fHelp)
 
 Value getblockhash(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 1)
+    if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
-            "getblockhash <index>\n"
-            "Returns hash of block in best-block-chain at <index>.");
+            "getblockhash <index> [blockhash]\n"
+            "Returns hash of block in best-block-chain at <index>.\n"
+            "If [blockhash] is given, returns hash of block at <index> in the chain ending at block [blockhash] instead.");
 
     int nHeight = params[0].get_int();
+    if (params.size() > 1)
+    {
+        uint256 hash(params[1].get_str());
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        CBlockIndex* pblockindex = mi->second->GetAncestor(nHeight);
+        if (pblockindex == NULL)
+            throw runtime_error("Block number out of range.");
+        return pblockindex->GetBlockHash().GetHex();
+    }
+
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
@@ -172,6 +185,8 @@ Value getblock(const Array& params, bool fHelp)
 
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
+    if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not available (only its header is known)");
     ReadBlockFromDisk(block, pblockindex);
 
     if (!fVerbose)
@@ -1187,10 +1187,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
+        CBlockIndex *block = pindexBest->GetAncestor(target_height);
 
         lastblock = block ? block->GetBlockHash() : 0;
     }
@@ -3,7 +3,6 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 using namespace boost;
@@ -16,7 +15,8 @@ using namespace boost;
 #include "sync.h"
 #include "util.h"
 
-bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags,
+              const CSigHashContext* pSigHashContext, vector<CPendingSignature>* pvDeferred);
 
 
 
@@ -24,20 +24,10 @@ typedef vector<unsigned char> valtype;
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
+static const CScriptNum bnZero(0);
+static const CScriptNum bnOne(1);
+static const CScriptNum bnFalse(0);
+static const CScriptNum bnTrue(1);
 
 bool CastToBool(const valtype& vch)
 {
@@ -289,7 +279,8 @@ bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSigHashContext* pSigHashContext, vector<CPendingSignature>* pvDeferred)
 {
     CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
@@ -364,7 +355,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -540,7 +531,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
+                    CScriptNum bn(stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -590,7 +581,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1)).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -638,7 +629,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
+                    CScriptNum bn(stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -689,15 +680,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1));
                     switch (opcode)
                     {
                     case OP_1ADD:       bn += bnOne; break;
                     case OP_1SUB:       bn -= bnOne; break;
                     case OP_NEGATE:     bn = -bn; break;
                     case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_NOT:        bn = CScriptNum(bn == bnZero); break;
+                    case OP_0NOTEQUAL:  bn = CScriptNum(bn != bnZero); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
@@ -722,9 +713,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2));
+                    CScriptNum bn2(stacktop(-1));
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -735,15 +726,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
-                    case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
-                    case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
-                    case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
-                    case OP_LESSTHAN:            bn = (bn1 < bn2); break;
-                    case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
-                    case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
-                    case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                    case OP_BOOLAND:             bn = CScriptNum(bn1 != bnZero && bn2 != bnZero); break;
+                    case OP_BOOLOR:              bn = CScriptNum(bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_NUMEQUAL:            bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMEQUALVERIFY:      bn = CScriptNum(bn1 == bn2); break;
+                    case OP_NUMNOTEQUAL:         bn = CScriptNum(bn1 != bn2); break;
+                    case OP_LESSTHAN:            bn = CScriptNum(bn1 < bn2); break;
+                    case OP_GREATERTHAN:         bn = CScriptNum(bn1 > bn2); break;
+                    case OP_LESSTHANOREQUAL:     bn = CScriptNum(bn1 <= bn2); break;
+                    case OP_GREATERTHANOREQUAL:  bn = CScriptNum(bn1 >= bn2); break;
                     case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
                     case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
                     default:                     assert(!"invalid opcode"); break;
@@ -767,9 +758,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3));
+                    CScriptNum bn2(stacktop(-2));
+                    CScriptNum bn3(stacktop(-1));
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -843,7 +834,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                     bool fSuccess = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                     if (fSuccess)
-                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                        fSuccess = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashContext, pvDeferred);
 
                     popstack(stack);
                     popstack(stack);
@@ -867,7 +858,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i)).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -878,7 +869,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i)).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -905,7 +896,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         // Check signature
                         bool fOk = (!fStrictEncodings || (IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey)));
                         if (fOk)
-                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags);
+                            fOk = CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, pSigHashContext, pvDeferred);
 
                         if (fOk) {
                             isig++;
@@ -1024,67 +1015,243 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
     return ss.GetHash();
 }
 
+// An input with an empty script serializes to its prevout, a zero length and nSequence
+static const unsigned int nBlankTxInSize = sizeof(COutPoint) + 1 + sizeof(unsigned int);
+
+void CSigHashContext::Set(const CTransaction& txTo)
+{
+    ptxTo = &txTo;
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss.reserve(txTo.vin.size() * nBlankTxInSize + ::GetSerializeSize(txTo.vout, SER_GETHASH, 0) + 4);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+        ss << txin.prevout << CScript() << txin.nSequence;
+    ss << txTo.vout << txTo.nLockTime;
+    vchTail.assign(ss.begin(), ss.end());
+
+    vMidstate.clear();
+    vMidstate.reserve(txTo.vin.size());
+    CHashWriter hasher(SER_GETHASH, 0);
+    hasher << txTo.nVersion;
+    WriteCompactSize(hasher, txTo.vin.size());
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        vMidstate.push_back(hasher);
+        hasher.write((const char*)&vchTail[i * nBlankTxInSize], nBlankTxInSize);
+    }
+}
+
+uint256 CSigHashContext::SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const
+{
+    if (nIn >= vMidstate.size() || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE ||
+        (nHashType & SIGHASH_ANYONECANPAY))
+        return ::SignatureHash(scriptCode, *ptxTo, nIn, nHashType);
+
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    // The inputs in front of this one are hashed already; the rest is serialized
+    const CTxIn& txin = ptxTo->vin[nIn];
+    CHashWriter hasher(vMidstate[nIn]);
+    hasher << txin.prevout << scriptCode << txin.nSequence;
+    unsigned int nTail = (nIn + 1) * nBlankTxInSize;
+    hasher.write((const char*)&vchTail[nTail], vchTail.size() - nTail);
+    hasher << nHashType;
+    return hasher.GetHash();
+}
+
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
-class CSignatureCache
+CSignatureCache::CSignatureCache(size_t nBytes)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    nEntries = std::min(nBytes / sizeof(CEntry), (size_t)std::numeric_limits<unsigned int>::max());
+    pEntries = nEntries ? new CEntry[nEntries] : NULL;
+    for (unsigned int i = 0; i < nEntries; i++)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        pEntries[i].nSequence = 0;
+        pEntries[i].nGeneration = 0;
+        pEntries[i].key = 0;
+    }
+    salt = GetRandHash();
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+CSignatureCache::~CSignatureCache()
+{
+    delete[] pEntries;
+}
+
+uint256 CSignatureCache::ComputeKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << salt << hash << vchSig << pubKey;
+    return ss.GetHash();
+}
+
+void CSignatureCache::GetSlots(const uint256 &key, unsigned int (&pnSlot)[2]) const
+{
+    // The key is already uniformly distributed; map two of its words onto [0, nEntries)
+    const uint32_t* pn = (const uint32_t*)key.begin();
+    pnSlot[0] = ((uint64)pn[0] * nEntries) >> 32;
+    pnSlot[1] = ((uint64)pn[1] * nEntries) >> 32;
+}
+
+// Whether an entry written in nGeneration may be overwritten in nGenerationNow.
+// Entries from a newer generation (written by a concurrent Set) are never expired.
+static inline bool IsExpired(unsigned int nGeneration, unsigned int nGenerationNow)
+{
+    return (int)(nGenerationNow - nGeneration) >= 2;
+}
+
+bool CSignatureCache::Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    if (nEntries == 0)
         return false;
-    }
+    uint256 key = ComputeKey(hash, vchSig, pubKey);
+    unsigned int pnSlot[2];
+    GetSlots(key, pnSlot);
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    __sync_fetch_and_add(&stats.nLookups, 1);
+    for (int i = 0; i < 2; i++)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64 nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        const CEntry& entry = pEntries[pnSlot[i]];
+        unsigned int nSequence = entry.nSequence;
+        __sync_synchronize();
+        bool fMatch = (entry.key == key);
+        __sync_synchronize();
+        if ((nSequence & 1) || entry.nSequence != nSequence)
+        {
+            // Being rewritten: treat as a miss rather than wait for the writer
+            __sync_fetch_and_add(&stats.nContention, 1);
+            continue;
+        }
+        if (fMatch)
+        {
+            __sync_fetch_and_add(&stats.nHits, 1);
+            return true;
+        }
+    }
+    return false;
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+void CSignatureCache::Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (nEntries == 0)
+        return;
+    uint256 key = ComputeKey(hash, vchSig, pubKey);
+
+    // A new generation starts every nEntries/8 inserts. Entries that are two or
+    // more generations old are free to be overwritten, which keeps the live part
+    // of the table at most a quarter full: light enough for two-choice cuckoo
+    // hashing to almost never run out of displacements.
+    uint64 nInsert = __sync_fetch_and_add(&stats.nInserts, 1);
+    unsigned int nGenerationSize = std::max(nEntries / 8, 1U);
+    unsigned int nGenerationNow = nInsert / nGenerationSize;
+    unsigned int nGeneration = nGenerationNow;
+
+    unsigned int nSlotLast = nEntries;
+    for (int nDisplacements = 0; nDisplacements <= MAX_DISPLACEMENTS; nDisplacements++)
+    {
+        unsigned int pnSlot[2];
+        GetSlots(key, pnSlot);
 
-        while (static_cast<int64>(setValid.size()) > nMaxCacheSize)
+        // Prefer an empty or expired slot, then the older of the two, and never
+        // the slot the key was just displaced from
+        unsigned int nSlot = nEntries;
+        for (int i = 0; i < 2; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            const CEntry& entry = pEntries[pnSlot[i]];
+            if (entry.key == key)
+                return;
+            if (entry.key == 0 || IsExpired(entry.nGeneration, nGenerationNow))
+            {
+                nSlot = pnSlot[i];
+                break;
+            }
+        }
+        if (nSlot == nEntries)
+        {
+            if (pnSlot[0] == nSlotLast)
+                nSlot = pnSlot[1];
+            else if (pnSlot[1] == nSlotLast)
+                nSlot = pnSlot[0];
+            else
+                nSlot = ((int)(pEntries[pnSlot[0]].nGeneration - pEntries[pnSlot[1]].nGeneration) <= 0) ? pnSlot[0] : pnSlot[1];
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Claim the slot; if another writer holds it, give up: this is only a cache
+        CEntry& entry = pEntries[nSlot];
+        unsigned int nSequence = entry.nSequence;
+        if ((nSequence & 1) || !__sync_bool_compare_and_swap(&entry.nSequence, nSequence, nSequence + 1))
+        {
+            __sync_fetch_and_add(&stats.nContention, 1);
+            return;
+        }
+        uint256 keyOld = entry.key;
+        unsigned int nGenerationOld = entry.nGeneration;
+        entry.key = key;
+        entry.nGeneration = nGeneration;
+        __sync_synchronize();
+        entry.nSequence = nSequence + 2;
+
+        if (keyOld == 0 || IsExpired(nGenerationOld, nGenerationNow))
+            return;
+
+        // Move the displaced entry to its other slot, keeping its generation
+        key = keyOld;
+        nGeneration = nGenerationOld;
+        nSlotLast = nSlot;
     }
-};
+    __sync_fetch_and_add(&stats.nEvictions, 1);
+}
+
+CSignatureCacheStats CSignatureCache::GetStats() const
+{
+    CSignatureCacheStats ret;
+    ret.nLookups = __sync_fetch_and_add(&stats.nLookups, 0);
+    ret.nHits = __sync_fetch_and_add(&stats.nHits, 0);
+    ret.nInserts = __sync_fetch_and_add(&stats.nInserts, 0);
+    ret.nEvictions = __sync_fetch_and_add(&stats.nEvictions, 0);
+    ret.nContention = __sync_fetch_and_add(&stats.nContention, 0);
+    return ret;
+}
+
+static size_t GetSignatureCacheBytes()
+{
+    static const int64 nMaxBytes = (int64)16384 << 20;
+
+    // -maxsigcachesize, from before the cache was sized in memory, counts entries
+    if (!mapArgs.count("-sigcachemb") && mapArgs.count("-maxsigcachesize"))
+        return std::max(std::min(GetArg("-maxsigcachesize", 0), nMaxBytes / 40), (int64)0) * 40;
+    return std::max(std::min(GetArg("-sigcachemb", DEFAULT_SIG_CACHE_MB), nMaxBytes >> 20), (int64)0) << 20;
+}
+
+static CSignatureCache& GetSignatureCache()
+{
+    // DoS prevention: the cache has a fixed size in memory (40 bytes per entry).
+    // The default of 16MB always keeps the last ~50,000 signatures, several
+    // blocks worth at 20,000 signature operations per block at most.
+    static CSignatureCache signatureCache(GetSignatureCacheBytes());
+    return signatureCache;
+}
+
+CSignatureCacheStats GetSignatureCacheStats()
+{
+    return GetSignatureCache().GetStats();
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
+    return CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, flags, NULL, NULL);
+}
+
+bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, int flags, const CSigHashContext* pSigHashContext,
+              vector<CPendingSignature>* pvDeferred)
+{
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -1099,11 +1266,17 @@ bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubK
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = pSigHashContext ? pSigHashContext->SignatureHash(scriptCode, nIn, nHashType) : SignatureHash(scriptCode, txTo, nIn, nHashType);
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
 
+    // Taken to be valid for now; the caller verifies it later
+    if (pvDeferred) {
+        pvDeferred->push_back(CPendingSignature(pubkey, sighash, vchSig));
+        return true;
+    }
+
     if (!pubkey.Verify(sighash, vchSig))
         return false;
 
@@ -1511,14 +1684,16 @@ void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey,
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn,
-                  unsigned int flags, int nHashType)
+                  unsigned int flags, int nHashType, const CSigHashContext* pSigHashContext, vector<CPendingSignature>* pvDeferred)
 {
+    assert(pSigHashContext == NULL || &pSigHashContext->GetTransaction() == &txTo);
+
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pSigHashContext, pvDeferred))
         return false;
     if (flags & SCRIPT_VERIFY_P2SH)
         stackCopy = stack;
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pSigHashContext, pvDeferred))
         return false;
     if (stack.empty())
         return false;
@@ -1541,7 +1716,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pSigHashContext, pvDeferred))
             return false;
         if (stackCopy.empty())
             return false;
@@ -1552,14 +1727,37 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool CanDeferSignatures(const CScript& scriptSig, const CScript& scriptPubKey)
+{
+    if (!scriptSig.IsPushOnly())
+        return false;
+    txnouttype whichType;
+    vector<valtype> vSolutions;
+    if (!Solver(scriptPubKey, whichType, vSolutions))
+        return false;
+    switch (whichType)
+    {
+    case TX_PUBKEY:
+    case TX_PUBKEYHASH:
+        return true;
+    case TX_MULTISIG:
+        // With fewer signatures than keys, signatures are tried against keys
+        // they don't belong to, and those checks are meant to fail
+        return vSolutions.front() == vSolutions.back();
+    default:
+        return false;
+    }
+}
+
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSigHashContext* pSigHashContext)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = pSigHashContext ? pSigHashContext->SignatureHash(fromPubKey, nIn, nHashType) : SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
     if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
@@ -1573,7 +1771,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = pSigHashContext ? pSigHashContext->SignatureHash(subscript, nIn, nHashType) : SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
@@ -1584,17 +1782,18 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, 0, pSigHashContext);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSigHashContext* pSigHashContext)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
     assert(txin.prevout.n < txFrom.vout.size());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pSigHashContext);
 }
 
 static CScript PushAll(const vector<valtype>& values)
@@ -5,6 +5,8 @@
 #ifndef H_BITCOIN_SCRIPT
 #define H_BITCOIN_SCRIPT
 
+#include <limits>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -13,6 +15,7 @@
 
 #include "keystore.h"
 #include "bignum.h"
+#include "hash.h"
 
 class CCoins;
 class CTransaction;
@@ -212,11 +215,112 @@ enum opcodetype
 const char* GetOpName(opcodetype opcode);
 
 
+class scriptnum_error : public std::runtime_error
+{
+public:
+    explicit scriptnum_error(const std::string& str) : std::runtime_error(str) {}
+};
+
+/** Number on the script stack, as the numeric opcodes see it.
+ *
+ *  Operands are at most 4 bytes, little endian with the sign in the highest
+ *  bit of the last byte, so they lie in [-2^31+1, 2^31-1]. Results may be
+ *  larger (the sum of two operands takes 5 bytes); they can be pushed onto
+ *  the stack, but using them as an operand again fails. This is how the
+ *  interpreter behaved when it did its arithmetic with CBigNum, without the
+ *  allocations.
+ */
+class CScriptNum
+{
+private:
+    int64 nValue;
+
+    static int64 Parse(const std::vector<unsigned char>& vch)
+    {
+        if (vch.empty())
+            return 0;
+
+        int64 n = 0;
+        for (unsigned int i = 0; i < vch.size(); i++)
+            n |= (int64)vch[i] << (8 * i);
+
+        // The highest bit of the last byte is the sign; the rest is the magnitude
+        if (vch.back() & 0x80)
+            return -(n & ~((int64)0x80 << (8 * (vch.size() - 1))));
+        return n;
+    }
+
+public:
+    static const size_t nMaxNumSize = 4;
+
+    explicit CScriptNum(int64 n) : nValue(n) {}
+
+    explicit CScriptNum(const std::vector<unsigned char>& vch)
+    {
+        if (vch.size() > nMaxNumSize)
+            throw scriptnum_error("CScriptNum() : overflow");
+        nValue = Parse(vch);
+    }
+
+    bool operator==(const CScriptNum& b) const { return nValue == b.nValue; }
+    bool operator!=(const CScriptNum& b) const { return nValue != b.nValue; }
+    bool operator<=(const CScriptNum& b) const { return nValue <= b.nValue; }
+    bool operator< (const CScriptNum& b) const { return nValue <  b.nValue; }
+    bool operator>=(const CScriptNum& b) const { return nValue >= b.nValue; }
+    bool operator> (const CScriptNum& b) const { return nValue >  b.nValue; }
+
+    bool operator==(int64 n) const { return nValue == n; }
+    bool operator!=(int64 n) const { return nValue != n; }
+    bool operator< (int64 n) const { return nValue <  n; }
+
+    // Operands are 4 bytes at most, so none of these overflow
+    CScriptNum operator+(const CScriptNum& b) const { return CScriptNum(nValue + b.nValue); }
+    CScriptNum operator-(const CScriptNum& b) const { return CScriptNum(nValue - b.nValue); }
+    CScriptNum operator-() const { return CScriptNum(-nValue); }
+
+    CScriptNum& operator+=(const CScriptNum& b) { nValue += b.nValue; return *this; }
+    CScriptNum& operator-=(const CScriptNum& b) { nValue -= b.nValue; return *this; }
+
+    // The value, limited to the range of an int
+    int getint() const
+    {
+        if (nValue > std::numeric_limits<int>::max())
+            return std::numeric_limits<int>::max();
+        if (nValue < std::numeric_limits<int>::min())
+            return std::numeric_limits<int>::min();
+        return (int)nValue;
+    }
+
+    std::vector<unsigned char> getvch() const { return Serialize(nValue); }
+
+    // Shortest encoding of n: no more bytes than needed for the magnitude,
+    // plus one if its highest bit is taken, to hold the sign
+    static std::vector<unsigned char> Serialize(int64 n)
+    {
+        std::vector<unsigned char> vch;
+        if (n == 0)
+            return vch;
+
+        bool fNegative = n < 0;
+        uint64 nAbs = fNegative ? ~(uint64)n + 1 : (uint64)n;
+        while (nAbs)
+        {
+            vch.push_back(nAbs & 0xff);
+            nAbs >>= 8;
+        }
+        if (vch.back() & 0x80)
+            vch.push_back(fNegative ? 0x80 : 0);
+        else if (fNegative)
+            vch.back() |= 0x80;
+        return vch;
+    }
+};
+
 
 inline std::string ValueString(const std::vector<unsigned char>& vch)
 {
     if (vch.size() <= 4)
-        return strprintf("%d", CBigNum(vch).getint());
+        return strprintf("%d", CScriptNum(vch).getint());
     else
         return HexStr(vch);
 }
@@ -252,8 +356,7 @@ protected:
         }
         else
         {
-            CBigNum bn(n);
-            *this << bn.getvch();
+            *this << CScriptNum::Serialize(n);
         }
         return *this;
     }
@@ -360,6 +463,12 @@ public:
         return *this;
     }
 
+    CScript& operator<<(const CScriptNum& b)
+    {
+        *this << b.getvch();
+        return *this;
+    }
+
     CScript& operator<<(const std::vector<unsigned char>& b)
     {
         if (b.size() < OP_PUSHDATA1)
@@ -665,10 +774,122 @@ public:
     }
 };
 
+/** Default size of the signature cache, in megabytes (-sigcachemb) */
+static const unsigned int DEFAULT_SIG_CACHE_MB = 16;
+
+/** Counters maintained by CSignatureCache */
+struct CSignatureCacheStats
+{
+    uint64 nLookups;     // calls to Get
+    uint64 nHits;        // ... that found the signature
+    uint64 nInserts;     // calls to Set
+    uint64 nEvictions;   // live entries dropped because their cuckoo path was too long
+    uint64 nContention;  // slots skipped because another thread was writing to them
+
+    CSignatureCacheStats() : nLookups(0), nHits(0), nInserts(0), nEvictions(0), nContention(0) {}
+
+    double HitRate() const { return nLookups ? (double)nHits / nLookups : 0.0; }
+};
+
+/** Fixed-memory cache of valid (signature hash, signature, public key) triples.
+ *
+ * Every triple is reduced to a 32-byte key by hashing it together with a
+ * random per-cache salt, so an attacker cannot aim entries at particular
+ * slots. A key lives in one of two slots (cuckoo hashing). Each slot carries
+ * a sequence number that is odd while it is being written: readers take no
+ * lock and simply retry-or-miss when the sequence changes under them, and
+ * writers claim a slot with a single compare-and-swap.
+ *
+ * Eviction is by generation: every eighth of the capacity worth of inserts
+ * starts a new generation, and entries more than one generation old may be
+ * overwritten freely. Live entries are displaced to their other slot, up to
+ * a bounded number of times.
+ */
+class CSignatureCache
+{
+private:
+    struct CEntry
+    {
+        volatile unsigned int nSequence;
+        unsigned int nGeneration;
+        uint256 key;
+    };
+
+    CEntry* pEntries;
+    unsigned int nEntries;
+    uint256 salt;
+
+    // Counters are only ever incremented atomically
+    mutable CSignatureCacheStats stats;
+
+    uint256 ComputeKey(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void GetSlots(const uint256 &key, unsigned int (&pnSlot)[2]) const;
+
+    // No copying: the entries are owned
+    CSignatureCache(const CSignatureCache&);
+    CSignatureCache& operator=(const CSignatureCache&);
+
+public:
+    static const int MAX_DISPLACEMENTS = 8;
+
+    CSignatureCache(size_t nBytes);
+    ~CSignatureCache();
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    unsigned int GetCapacity() const { return nEntries; }
+    CSignatureCacheStats GetStats() const;
+};
+
+/** Counters of the signature cache used by CheckSig */
+CSignatureCacheStats GetSignatureCacheStats();
+
+/** The parts of the signature hashes of a transaction's inputs that are the
+ *  same for every input.
+ *
+ *  SignatureHash copies the transaction, blanks the scripts of the other
+ *  inputs and serializes the copy, once per input, which takes time
+ *  quadratic in the number of inputs. With SIGHASH_ALL, used by nearly all
+ *  signatures, the hashed data of one input differs from another only in
+ *  the script put in place of the input's own. This keeps everything else
+ *  serialized, and the hasher's state up to each input, so hashing an input
+ *  takes one pass over the data after it and nothing else. Other hash types
+ *  are handed to SignatureHash.
+ *
+ *  The scripts of the inputs aren't part of it, so it stays valid while they
+ *  are being signed; the rest of the transaction must not change, and the
+ *  transaction must outlive it.
+ */
+class CSigHashContext
+{
+private:
+    const CTransaction* ptxTo;
+    std::vector<CHashWriter> vMidstate; // state in front of each input
+    std::vector<unsigned char> vchTail; // the inputs with empty scripts, the outputs and nLockTime
+
+public:
+    CSigHashContext() : ptxTo(NULL) {}
+    explicit CSigHashContext(const CTransaction& txTo) : ptxTo(NULL) { Set(txTo); }
+
+    void Set(const CTransaction& txTo);
+    bool IsNull() const { return ptxTo == NULL; }
+    const CTransaction& GetTransaction() const { return *ptxTo; }
+
+    // What SignatureHash(scriptCode, GetTransaction(), nIn, nHashType) returns
+    uint256 SignatureHash(CScript scriptCode, unsigned int nIn, int nHashType) const;
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+
 bool IsCanonicalPubKey(const std::vector<unsigned char> &vchPubKey);
 bool IsCanonicalSignature(const std::vector<unsigned char> &vchSig);
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+// If pvDeferred is given, signatures that aren't in the signature cache are
+// taken to be valid and appended to it instead of being verified; the script
+// is only valid if all of those are.
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                const CSigHashContext* pSigHashContext = NULL, std::vector<CPendingSignature>* pvDeferred = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey);
@@ -677,9 +898,17 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType);
+// pSigHashContext, if given, must be set to txTo
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSigHashContext* pSigHashContext = NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSigHashContext* pSigHashContext = NULL);
+bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, unsigned int flags, int nHashType,
+                  const CSigHashContext* pSigHashContext = NULL, std::vector<CPendingSignature>* pvDeferred = NULL);
+// Whether deferring the signature checks of a script is worth it: with a
+// standard scriptPubKey and a scriptSig of pushes, a valid script only checks
+// signatures that are valid, so the deferred ones can be verified in a batch.
+bool CanDeferSignatures(const CScript& scriptSig, const CScript& scriptPubKey);
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
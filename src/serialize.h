@@ -1088,6 +1088,14 @@ public:
         vch.swap(data);
         CSerializeData().swap(vch);
     }
+
+    // Like GetAndClear, but goes on writing into the buffer data had, so its
+    // capacity is reused
+    void GetAndReplace(CSerializeData &data) {
+        vch.swap(data);
+        vch.clear();
+        nReadPos = 0;
+    }
 };
 
 
@@ -1358,4 +1366,47 @@ public:
     }
 };
 
+/** Read-only stream over a range of memory that it doesn't own, such as a
+ *  memory-mapped file, to deserialize from it without copying it first.
+ */
+class CSpanReader
+{
+private:
+    const char *pbegin;
+    const char *pend;
+    const char *pcur;
+
+public:
+    int nType;
+    int nVersion;
+
+    CSpanReader(const char *pbeginIn, const char *pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), pcur(pbeginIn), nType(nTypeIn), nVersion(nVersionIn) {
+    }
+
+    CSpanReader& read(char *pch, size_t nSize) {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CSpanReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    // number of bytes read so far
+    size_t GetPos() const {
+        return pcur - pbegin;
+    }
+
+    bool eof() const {
+        return pcur == pend;
+    }
+
+    template<typename T>
+    CSpanReader& operator>>(T& obj) {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -0,0 +1,503 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "sha256.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// The SIMD backends are compiled with per-function target attributes, so no
+// special compiler flags are needed; they are only called when the CPU
+// reports support for the instruction set at runtime.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_SHA256_X86 1
+#include <immintrin.h>
+#define SSE41_FUNCTION __attribute__((target("sse4.1")))
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+
+static const uint32_t pSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t pSHA256IV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t ReadBE32(const unsigned char* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void WriteBE32(unsigned char* p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// All transforms work on a lane-interleaved state: word w of lane l lives at
+// pstate[w*nLanes + l], so that a SIMD backend can load one word of every
+// lane with a single vector load.
+typedef void (*SHA256TransformFn)(uint32_t* pstate, const unsigned char* const* ppBlock);
+
+//
+// Scalar backend
+//
+
+static inline uint32_t Ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// Run the first nRounds rounds of the compression function on the working
+// variables v[0..7] (a..h), with message schedule w[0..15]. Both are updated
+// in place; the caller adds the chaining value afterwards.
+static inline void Compress(uint32_t* v, uint32_t* w, int nRounds)
+{
+    uint32_t a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    for (int i = 0; i < nRounds; i++)
+    {
+        if (i >= 16)
+        {
+            uint32_t w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+            w[i & 15] += (Ror(w2, 17) ^ Ror(w2, 19) ^ (w2 >> 10)) + w[(i - 7) & 15] +
+                         (Ror(w15, 7) ^ Ror(w15, 18) ^ (w15 >> 3));
+        }
+        uint32_t t1 = h + (Ror(e, 6) ^ Ror(e, 11) ^ Ror(e, 25)) + (g ^ (e & (f ^ g))) + pSHA256K[i] + w[i & 15];
+        uint32_t t2 = (Ror(a, 2) ^ Ror(a, 13) ^ Ror(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    v[0] = a; v[1] = b; v[2] = c; v[3] = d; v[4] = e; v[5] = f; v[6] = g; v[7] = h;
+}
+
+static void TransformScalar(uint32_t* s, const unsigned char* const* ppBlock)
+{
+    uint32_t v[8], w[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = s[i];
+    for (int i = 0; i < 16; i++)
+        w[i] = ReadBE32(ppBlock[0] + 4*i);
+    Compress(v, w, 64);
+    for (int i = 0; i < 8; i++)
+        s[i] += v[i];
+}
+
+// Full double-SHA256 of a block header for one nonce, see SHA256ScanNonces
+static void ScanHashScalar(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonce, uint32_t* phash)
+{
+    uint32_t v[8], w[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = pmidstate[i];
+    for (int i = 0; i < 16; i++)
+        w[i] = pdata[i];
+    w[3] = nNonce;
+    Compress(v, w, 64);
+
+    for (int i = 0; i < 8; i++)
+        w[i] = v[i] + pmidstate[i];
+    w[8] = 0x80000000;
+    for (int i = 9; i < 15; i++)
+        w[i] = 0;
+    w[15] = 256;
+    for (int i = 0; i < 8; i++)
+        v[i] = pSHA256IV[i];
+    Compress(v, w, 64);
+
+    for (int i = 0; i < 8; i++)
+        phash[i] = v[i] + pSHA256IV[i];
+}
+
+static void ScanScalar(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonce, uint32_t* pnLastWord)
+{
+    uint32_t phash[8];
+    ScanHashScalar(pmidstate, pdata, nNonce, phash);
+    pnLastWord[0] = phash[7];
+}
+
+#ifdef USE_SHA256_X86
+
+//
+// SSE4.1 backend, 4 lanes
+//
+
+static inline SSE41_FUNCTION __m128i Add4(__m128i x, __m128i y) { return _mm_add_epi32(x, y); }
+static inline SSE41_FUNCTION __m128i Xor4(__m128i x, __m128i y) { return _mm_xor_si128(x, y); }
+static inline SSE41_FUNCTION __m128i Ror4(__m128i x, int n) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+
+static inline SSE41_FUNCTION __m128i Load4(const unsigned char* const* pp, int nOffset)
+{
+    return _mm_set_epi32(ReadBE32(pp[3] + nOffset), ReadBE32(pp[2] + nOffset),
+                         ReadBE32(pp[1] + nOffset), ReadBE32(pp[0] + nOffset));
+}
+
+static inline SSE41_FUNCTION void Compress4(__m128i* v, __m128i* w, int nRounds)
+{
+    __m128i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    for (int i = 0; i < nRounds; i++)
+    {
+        if (i >= 16)
+        {
+            __m128i w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+            __m128i s1 = Xor4(Xor4(Ror4(w2, 17), Ror4(w2, 19)), _mm_srli_epi32(w2, 10));
+            __m128i s0 = Xor4(Xor4(Ror4(w15, 7), Ror4(w15, 18)), _mm_srli_epi32(w15, 3));
+            w[i & 15] = Add4(Add4(w[i & 15], s1), Add4(w[(i - 7) & 15], s0));
+        }
+        __m128i S1 = Xor4(Xor4(Ror4(e, 6), Ror4(e, 11)), Ror4(e, 25));
+        __m128i ch = Xor4(g, _mm_and_si128(e, Xor4(f, g)));
+        __m128i t1 = Add4(Add4(Add4(h, S1), Add4(ch, _mm_set1_epi32(pSHA256K[i]))), w[i & 15]);
+        __m128i S0 = Xor4(Xor4(Ror4(a, 2), Ror4(a, 13)), Ror4(a, 22));
+        __m128i maj = _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, _mm_or_si128(a, b)));
+        __m128i t2 = Add4(S0, maj);
+        h = g; g = f; f = e; e = Add4(d, t1); d = c; c = b; b = a; a = Add4(t1, t2);
+    }
+    v[0] = a; v[1] = b; v[2] = c; v[3] = d; v[4] = e; v[5] = f; v[6] = g; v[7] = h;
+}
+
+static SSE41_FUNCTION void TransformSSE41(uint32_t* s, const unsigned char* const* ppBlock)
+{
+    __m128i v[8], w[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm_loadu_si128((const __m128i*)(s + 4*i));
+    for (int i = 0; i < 16; i++)
+        w[i] = Load4(ppBlock, 4*i);
+    Compress4(v, w, 64);
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)(s + 4*i), Add4(v[i], _mm_loadu_si128((const __m128i*)(s + 4*i))));
+}
+
+// Only the last word of the final hash is needed to decide whether a nonce is
+// worth a closer look. It equals IV[7] plus the value of e after round 60, so
+// the last three rounds of the second hash are skipped.
+static SSE41_FUNCTION void ScanSSE41(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonce, uint32_t* pnLastWord)
+{
+    __m128i v[8], w[16], mid[8];
+    for (int i = 0; i < 8; i++)
+        v[i] = mid[i] = _mm_set1_epi32(pmidstate[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm_set1_epi32(pdata[i]);
+    w[3] = Add4(_mm_set1_epi32(nNonce), _mm_set_epi32(3, 2, 1, 0));
+    Compress4(v, w, 64);
+
+    for (int i = 0; i < 8; i++)
+        w[i] = Add4(v[i], mid[i]);
+    w[8] = _mm_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = _mm_setzero_si128();
+    w[15] = _mm_set1_epi32(256);
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm_set1_epi32(pSHA256IV[i]);
+    Compress4(v, w, 61);
+
+    _mm_storeu_si128((__m128i*)pnLastWord, Add4(v[4], _mm_set1_epi32(pSHA256IV[7])));
+}
+
+//
+// AVX2 backend, 8 lanes
+//
+
+static inline AVX2_FUNCTION __m256i Add8(__m256i x, __m256i y) { return _mm256_add_epi32(x, y); }
+static inline AVX2_FUNCTION __m256i Xor8(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+static inline AVX2_FUNCTION __m256i Ror8(__m256i x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+
+static inline AVX2_FUNCTION __m256i Load8(const unsigned char* const* pp, int nOffset)
+{
+    return _mm256_set_epi32(ReadBE32(pp[7] + nOffset), ReadBE32(pp[6] + nOffset),
+                            ReadBE32(pp[5] + nOffset), ReadBE32(pp[4] + nOffset),
+                            ReadBE32(pp[3] + nOffset), ReadBE32(pp[2] + nOffset),
+                            ReadBE32(pp[1] + nOffset), ReadBE32(pp[0] + nOffset));
+}
+
+static inline AVX2_FUNCTION void Compress8(__m256i* v, __m256i* w, int nRounds)
+{
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    for (int i = 0; i < nRounds; i++)
+    {
+        if (i >= 16)
+        {
+            __m256i w2 = w[(i - 2) & 15], w15 = w[(i - 15) & 15];
+            __m256i s1 = Xor8(Xor8(Ror8(w2, 17), Ror8(w2, 19)), _mm256_srli_epi32(w2, 10));
+            __m256i s0 = Xor8(Xor8(Ror8(w15, 7), Ror8(w15, 18)), _mm256_srli_epi32(w15, 3));
+            w[i & 15] = Add8(Add8(w[i & 15], s1), Add8(w[(i - 7) & 15], s0));
+        }
+        __m256i S1 = Xor8(Xor8(Ror8(e, 6), Ror8(e, 11)), Ror8(e, 25));
+        __m256i ch = Xor8(g, _mm256_and_si256(e, Xor8(f, g)));
+        __m256i t1 = Add8(Add8(Add8(h, S1), Add8(ch, _mm256_set1_epi32(pSHA256K[i]))), w[i & 15]);
+        __m256i S0 = Xor8(Xor8(Ror8(a, 2), Ror8(a, 13)), Ror8(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = Add8(S0, maj);
+        h = g; g = f; f = e; e = Add8(d, t1); d = c; c = b; b = a; a = Add8(t1, t2);
+    }
+    v[0] = a; v[1] = b; v[2] = c; v[3] = d; v[4] = e; v[5] = f; v[6] = g; v[7] = h;
+}
+
+static AVX2_FUNCTION void TransformAVX2(uint32_t* s, const unsigned char* const* ppBlock)
+{
+    __m256i v[8], w[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm256_loadu_si256((const __m256i*)(s + 8*i));
+    for (int i = 0; i < 16; i++)
+        w[i] = Load8(ppBlock, 4*i);
+    Compress8(v, w, 64);
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i*)(s + 8*i), Add8(v[i], _mm256_loadu_si256((const __m256i*)(s + 8*i))));
+}
+
+static AVX2_FUNCTION void ScanAVX2(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonce, uint32_t* pnLastWord)
+{
+    __m256i v[8], w[16], mid[8];
+    for (int i = 0; i < 8; i++)
+        v[i] = mid[i] = _mm256_set1_epi32(pmidstate[i]);
+    for (int i = 0; i < 16; i++)
+        w[i] = _mm256_set1_epi32(pdata[i]);
+    w[3] = Add8(_mm256_set1_epi32(nNonce), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+    Compress8(v, w, 64);
+
+    for (int i = 0; i < 8; i++)
+        w[i] = Add8(v[i], mid[i]);
+    w[8] = _mm256_set1_epi32(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = _mm256_setzero_si256();
+    w[15] = _mm256_set1_epi32(256);
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm256_set1_epi32(pSHA256IV[i]);
+    Compress8(v, w, 61);
+
+    _mm256_storeu_si256((__m256i*)pnLastWord, Add8(v[4], _mm256_set1_epi32(pSHA256IV[7])));
+}
+
+#endif // USE_SHA256_X86
+
+//
+// Backend selection
+//
+
+static const int MAX_SHA256_LANES = 8;
+
+typedef void (*SHA256ScanFn)(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonce, uint32_t* pnLastWord);
+
+static SHA256TransformFn GetTransform(SHA256Backend backend, int& nLanes, SHA256ScanFn* pscan = NULL)
+{
+#ifdef USE_SHA256_X86
+    if (backend == SHA256_BACKEND_AVX2)
+    {
+        nLanes = 8;
+        if (pscan)
+            *pscan = ScanAVX2;
+        return TransformAVX2;
+    }
+    if (backend == SHA256_BACKEND_SSE41)
+    {
+        nLanes = 4;
+        if (pscan)
+            *pscan = ScanSSE41;
+        return TransformSSE41;
+    }
+#endif
+    nLanes = 1;
+    if (pscan)
+        *pscan = ScanScalar;
+    return TransformScalar;
+}
+
+bool SHA256BackendSupported(SHA256Backend backend)
+{
+    switch (backend)
+    {
+    case SHA256_BACKEND_SCALAR:
+        return true;
+#ifdef USE_SHA256_X86
+    case SHA256_BACKEND_SSE41:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1");
+    case SHA256_BACKEND_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char* SHA256BackendName(SHA256Backend backend)
+{
+    switch (backend)
+    {
+    case SHA256_BACKEND_SCALAR: return "scalar";
+    case SHA256_BACKEND_SSE41:  return "sse4.1";
+    case SHA256_BACKEND_AVX2:   return "avx2";
+    default:                    return "unknown";
+    }
+}
+
+static SHA256Backend DetectBackend()
+{
+    if (SHA256BackendSupported(SHA256_BACKEND_AVX2))
+        return SHA256_BACKEND_AVX2;
+    if (SHA256BackendSupported(SHA256_BACKEND_SSE41))
+        return SHA256_BACKEND_SSE41;
+    return SHA256_BACKEND_SCALAR;
+}
+
+static SHA256Backend backendSelected = DetectBackend();
+
+SHA256Backend SHA256GetBackend()
+{
+    return backendSelected;
+}
+
+bool SHA256SetBackend(SHA256Backend backend)
+{
+    if (!SHA256BackendSupported(backend))
+        return false;
+    backendSelected = backend;
+    return true;
+}
+
+//
+// Multi-buffer driver
+//
+
+/** Progress of one vector lane through its current message */
+struct CSHA256Lane
+{
+    size_t nMsg;               // index of the message being hashed
+    const unsigned char* pch;  // message data
+    size_t nFull;              // number of complete 64-byte blocks in the message
+    size_t nBlocks;            // total number of blocks including padding
+    size_t nPos;               // next block to feed to the transform
+    unsigned char pchTail[128];// the last partial block plus padding
+
+    void Set(size_t nMsgIn, const unsigned char* pchIn, size_t nLen)
+    {
+        nMsg = nMsgIn;
+        pch = pchIn;
+        nFull = nLen / 64;
+        nPos = 0;
+
+        size_t nRem = nLen % 64;
+        size_t nTailSize = (nRem + 9 <= 64) ? 64 : 128;
+        memset(pchTail, 0, nTailSize);
+        if (nRem)
+            memcpy(pchTail, pch + nFull*64, nRem);
+        pchTail[nRem] = 0x80;
+        uint64_t nBits = (uint64_t)nLen << 3;
+        WriteBE32(pchTail + nTailSize - 8, (uint32_t)(nBits >> 32));
+        WriteBE32(pchTail + nTailSize - 4, (uint32_t)nBits);
+        nBlocks = nFull + nTailSize / 64;
+    }
+
+    const unsigned char* GetBlock() const
+    {
+        return nPos < nFull ? pch + 64*nPos : pchTail + 64*(nPos - nFull);
+    }
+};
+
+// Single SHA256 of nCount messages, interleaving them across the lanes of the
+// transform. A lane that finishes its message immediately picks up the next
+// one, so messages of different lengths keep all lanes busy.
+static void SHA256Multi(SHA256TransformFn transform, int nLanes, const unsigned char* const* ppIn, const size_t* pnLen, unsigned char* pOut, size_t nCount)
+{
+    static const unsigned char pchIdle[64] = {0}; // fed to lanes without work
+    uint32_t state[8 * MAX_SHA256_LANES];
+    CSHA256Lane lanes[MAX_SHA256_LANES];
+    bool fActive[MAX_SHA256_LANES];
+    const unsigned char* ppBlock[MAX_SHA256_LANES];
+
+    size_t nNext = 0;
+    int nActive = 0;
+    for (int l = 0; l < nLanes; l++)
+    {
+        fActive[l] = (nNext < nCount);
+        if (fActive[l])
+        {
+            lanes[l].Set(nNext, ppIn[nNext], pnLen[nNext]);
+            for (int w = 0; w < 8; w++)
+                state[w*nLanes + l] = pSHA256IV[w];
+            nNext++;
+            nActive++;
+        }
+    }
+
+    while (nActive > 0)
+    {
+        for (int l = 0; l < nLanes; l++)
+            ppBlock[l] = fActive[l] ? lanes[l].GetBlock() : pchIdle;
+
+        transform(state, ppBlock);
+
+        for (int l = 0; l < nLanes; l++)
+        {
+            if (!fActive[l] || ++lanes[l].nPos < lanes[l].nBlocks)
+                continue;
+
+            // Lane finished its message: emit the digest and refill it
+            unsigned char* pchOut = pOut + 32*lanes[l].nMsg;
+            for (int w = 0; w < 8; w++)
+                WriteBE32(pchOut + 4*w, state[w*nLanes + l]);
+
+            if (nNext < nCount)
+            {
+                lanes[l].Set(nNext, ppIn[nNext], pnLen[nNext]);
+                for (int w = 0; w < 8; w++)
+                    state[w*nLanes + l] = pSHA256IV[w];
+                nNext++;
+            }
+            else
+            {
+                fActive[l] = false;
+                nActive--;
+            }
+        }
+    }
+}
+
+void SHA256DBatch(const unsigned char* const* ppIn, const size_t* pnLen, unsigned char* pOut, size_t nCount)
+{
+    if (nCount == 0)
+        return;
+
+    int nLanes;
+    SHA256TransformFn transform = GetTransform(nCount > 1 ? backendSelected : SHA256_BACKEND_SCALAR, nLanes);
+
+    // First pass over the messages
+    std::vector<unsigned char> vFirst(32 * nCount);
+    SHA256Multi(transform, nLanes, ppIn, pnLen, &vFirst[0], nCount);
+
+    // Second pass over the 32-byte intermediate digests
+    std::vector<const unsigned char*> vpFirst(nCount);
+    std::vector<size_t> vnFirst(nCount, 32);
+    for (size_t i = 0; i < nCount; i++)
+        vpFirst[i] = &vFirst[32*i];
+    SHA256Multi(transform, nLanes, &vpFirst[0], &vnFirst[0], pOut, nCount);
+}
+
+bool SHA256ScanNonces(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonceBegin, uint32_t nCount, uint32_t& nNonceFound, uint32_t* phash)
+{
+    int nLanes;
+    SHA256ScanFn scan;
+    GetTransform(backendSelected, nLanes, &scan);
+
+    uint32_t pnLastWord[MAX_SHA256_LANES];
+    for (uint32_t n = 0; n < nCount; n += nLanes)
+    {
+        scan(pmidstate, pdata, nNonceBegin + n, pnLastWord);
+        for (int l = 0; l < nLanes && n + l < nCount; l++)
+        {
+            if ((pnLastWord[l] & 0xffff) != 0)
+                continue;
+            nNonceFound = nNonceBegin + n + l;
+            ScanHashScalar(pmidstate, pdata, nNonceFound, phash);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_SHA256_H
+#define BITCOIN_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Implementations of the multi-buffer SHA256 engine.
+ *  The SIMD backends run one independent message per vector lane. */
+enum SHA256Backend
+{
+    SHA256_BACKEND_SCALAR = 0,  // one message at a time, portable C++
+    SHA256_BACKEND_SSE41  = 1,  // 4 lanes of 32 bits in an SSE register
+    SHA256_BACKEND_AVX2   = 2,  // 8 lanes of 32 bits in an AVX2 register
+
+    SHA256_BACKEND_COUNT
+};
+
+/** Whether the given backend can run on this CPU */
+bool SHA256BackendSupported(SHA256Backend backend);
+
+/** Human-readable name of a backend ("scalar", "sse4.1", "avx2") */
+const char* SHA256BackendName(SHA256Backend backend);
+
+/** The backend used by SHA256DBatch. Picked from the CPU features on first use. */
+SHA256Backend SHA256GetBackend();
+
+/** Override the automatically selected backend (used by tests and benchmarks).
+ *  Returns false, and leaves the selection untouched, if it is not supported. */
+bool SHA256SetBackend(SHA256Backend backend);
+
+/** Compute the double-SHA256 of nCount independent messages.
+ *  Message i is pnLen[i] bytes at ppIn[i]; its hash is written to pOut + 32*i. */
+void SHA256DBatch(const unsigned char* const* ppIn, const size_t* pnLen, unsigned char* pOut, size_t nCount);
+
+/** Scan a range of nonces of a block header for the built-in miner, 4 or 8 at a
+ *  time depending on the backend.
+ *  pmidstate is the SHA256 state after the first 64 bytes of the header and pdata
+ *  the padded second 64-byte block as 16 host-order words, whose word 3 is the
+ *  nonce (the layout produced by FormatHashBuffers).
+ *  Tries nCount nonces starting at nNonceBegin, and returns true for the first one
+ *  whose double-SHA256 has a zero in the low 16 bits of its last state word. That
+ *  nonce is stored in nNonceFound and the 8 final state words in phash; the caller
+ *  still has to compare the hash against the target. */
+bool SHA256ScanNonces(const uint32_t* pmidstate, const uint32_t* pdata, uint32_t nNonceBegin, uint32_t nCount, uint32_t& nNonceFound, uint32_t* phash);
+
+#endif
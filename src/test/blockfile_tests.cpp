@@ -0,0 +1,72 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "blockfile.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(blockfile_tests)
+
+// Append a record the way WriteBlockToDisk does, and return its position
+static CDiskBlockPos AppendRecord(int nFile, const std::vector<unsigned char> &vch)
+{
+    boost::filesystem::path path = GetDataDir() / "blocks" / strprintf("tst%05u.dat", nFile);
+    boost::filesystem::create_directories(path.parent_path());
+    CAutoFile file(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(file != NULL);
+    file << FLATDATA(Params().MessageStart()) << (unsigned int)vch.size();
+    CDiskBlockPos pos(nFile, ftell(file));
+    file.write((const char*)&vch[0], vch.size());
+    return pos;
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_read)
+{
+    CBlockFileReader reader("tst", 2);
+    std::vector<unsigned char> vch1(1000, 0x11), vch2(200000, 0x22), vch3(10, 0x33);
+    CDiskBlockPos pos1 = AppendRecord(0, vch1);
+
+    CBlockFileSpan span1;
+    BOOST_CHECK(reader.ReadBlock(pos1, span1));
+    BOOST_CHECK(std::vector<unsigned char>(span1.begin(), span1.end()) == vch1);
+
+    // The file grows after it was mapped; the earlier span stays valid
+    CDiskBlockPos pos2 = AppendRecord(0, vch2);
+    CBlockFileSpan span2;
+    BOOST_CHECK(reader.ReadBlock(pos2, span2));
+    BOOST_CHECK(std::vector<unsigned char>(span2.begin(), span2.end()) == vch2);
+    BOOST_CHECK(std::vector<unsigned char>(span1.begin(), span1.end()) == vch1);
+
+    // More files than mappings, and a forgotten file, are read all the same
+    CDiskBlockPos pos3 = AppendRecord(1, vch3);
+    AppendRecord(2, vch3);
+    reader.Forget(0);
+    CBlockFileSpan span3;
+    BOOST_CHECK(reader.ReadBlock(pos3, span3));
+    BOOST_CHECK(std::vector<unsigned char>(span3.begin(), span3.end()) == vch3);
+    BOOST_CHECK(reader.ReadBlock(pos1, span1));
+    BOOST_CHECK(std::vector<unsigned char>(span1.begin(), span1.end()) == vch1);
+
+    // Positions without a block header, or past the end, fail
+    CBlockFileSpan spanBad;
+    BOOST_CHECK(!reader.ReadBlock(CDiskBlockPos(0, pos1.nPos + 1), spanBad));
+    BOOST_CHECK(!reader.Read(CDiskBlockPos(1, 0), 1000, spanBad));
+    BOOST_CHECK(!reader.ReadBlock(CDiskBlockPos(7, 8), spanBad));
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_spanreader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << 12345 << std::string("span");
+    CSpanReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    int n;
+    std::string str;
+    reader >> n >> str;
+    BOOST_CHECK_EQUAL(n, 12345);
+    BOOST_CHECK_EQUAL(str, "span");
+    BOOST_CHECK(reader.eof());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
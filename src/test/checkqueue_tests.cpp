@@ -0,0 +1,123 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <vector>
+
+#include "checkqueue.h"
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+// Counts its executions, and fails if told to
+class CTestCheck
+{
+private:
+    bool fResult;
+    volatile unsigned int *pnRuns;
+
+public:
+    CTestCheck() : fResult(true), pnRuns(NULL) {}
+    CTestCheck(bool fResultIn, volatile unsigned int *pnRunsIn) : fResult(fResultIn), pnRuns(pnRunsIn) {}
+
+    bool operator()() const {
+        __sync_fetch_and_add(pnRuns, 1);
+        return fResult;
+    }
+
+    void swap(CTestCheck &check) {
+        std::swap(fResult, check.fResult);
+        std::swap(pnRuns, check.pnRuns);
+    }
+};
+
+// Add nChecks checks in batches of varying size, the nFail'th of which (if any) fails
+static void AddChecks(CCheckQueueControl<CTestCheck> &control, unsigned int nChecks, volatile unsigned int *pnRuns, unsigned int nFail = (unsigned int)-1)
+{
+    unsigned int nAdded = 0;
+    for (unsigned int nBatch = 1; nAdded < nChecks; nBatch = nBatch % 37 + 1) {
+        std::vector<CTestCheck> vChecks;
+        for (unsigned int i = 0; i < nBatch && nAdded < nChecks; i++, nAdded++)
+            vChecks.push_back(CTestCheck(nAdded != nFail, pnRuns));
+        control.Add(vChecks);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    CCheckQueue<CTestCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 4; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+
+    // Every check runs exactly once
+    for (unsigned int nChecks = 0; nChecks < 3000; nChecks += 271) {
+        volatile unsigned int nRuns = 0;
+        CCheckQueueControl<CTestCheck> control(&queue);
+        AddChecks(control, nChecks, &nRuns);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRuns, nChecks);
+    }
+
+    // A failure is reported, and later checks of the same control may be skipped
+    {
+        volatile unsigned int nRuns = 0;
+        CCheckQueueControl<CTestCheck> control(&queue);
+        AddChecks(control, 2000, &nRuns, 10);
+        BOOST_CHECK(!control.Wait());
+        BOOST_CHECK(nRuns <= 2000);
+    }
+
+    // Two controls at once: a failure in one doesn't affect the other, and
+    // aborting a control skips what it has left
+    {
+        volatile unsigned int nRunsFirst = 0, nRunsSecond = 0, nRunsThird = 0;
+        CCheckQueueControl<CTestCheck> controlFirst(&queue);
+        CCheckQueueControl<CTestCheck> controlSecond(&queue);
+        AddChecks(controlFirst, 1000, &nRunsFirst, 999);
+        AddChecks(controlSecond, 1000, &nRunsSecond);
+        BOOST_CHECK(!controlFirst.Wait());
+        BOOST_CHECK(controlSecond.Wait());
+        BOOST_CHECK_EQUAL(nRunsSecond, 1000U);
+
+        CCheckQueueControl<CTestCheck> controlThird(&queue);
+        controlThird.Abort();
+        AddChecks(controlThird, 1000, &nRunsThird);
+        BOOST_CHECK(!controlThird.Wait());
+        BOOST_CHECK_EQUAL(nRunsThird, 0U);
+    }
+
+    // A control that goes out of scope without Wait() still drains its checks
+    volatile unsigned int nRunsUnwaited = 0;
+    {
+        CCheckQueueControl<CTestCheck> control(&queue);
+        AddChecks(control, 1000, &nRunsUnwaited);
+    }
+    BOOST_CHECK(nRunsUnwaited <= 1000);
+    {
+        volatile unsigned int nRuns = 0;
+        CCheckQueueControl<CTestCheck> control(&queue);
+        AddChecks(control, 100, &nRuns);
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRuns, 100U);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    // Without worker threads, the waiting thread does all the work
+    CCheckQueue<CTestCheck> queue(16);
+    volatile unsigned int nRuns = 0;
+    CCheckQueueControl<CTestCheck> control(&queue);
+    AddChecks(control, 500, &nRuns);
+    BOOST_CHECK(control.Wait());
+    BOOST_CHECK_EQUAL(nRuns, 500U);
+
+    // A NULL queue means the checks were already done inline
+    CCheckQueueControl<CTestCheck> controlNone(NULL);
+    BOOST_CHECK(controlNone.Wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,198 @@
+#include <boost/test/unit_test.hpp>
+#include <map>
+
+#include "coinsmap.h"
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(coinsmap_tests)
+
+BOOST_AUTO_TEST_CASE(coinsmap_siphash)
+{
+    // Reference SipHash-2-4 output for key 00..0f and message 00..1f
+    uint256 val;
+    for (int i = 0; i < 32; i++)
+        val.begin()[i] = i;
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_insert_find)
+{
+    CCoinsMap map;
+    std::map<uint256, int> mapRef;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(GetRandHash()) == map.end());
+
+    // Insert enough entries to grow the index several times, and keep references
+    std::vector<CCoins*> vpCoins;
+    for (int i = 0; i < 5000; i++)
+    {
+        uint256 txid = GetRandHash();
+        std::pair<CCoinsMap::iterator, bool> ret = map.insert(txid);
+        BOOST_CHECK(ret.second);
+        BOOST_CHECK(ret.first->txid == txid);
+        ret.first->coins.nHeight = i;
+        vpCoins.push_back(&ret.first->coins);
+        mapRef[txid] = i;
+    }
+    BOOST_CHECK_EQUAL(map.size(), mapRef.size());
+
+    int i = 0;
+    for (std::map<uint256, int>::iterator it = mapRef.begin(); it != mapRef.end(); it++, i++)
+    {
+        CCoinsMap::iterator mi = map.find(it->first);
+        BOOST_CHECK(mi != map.end());
+        BOOST_CHECK_EQUAL(mi->coins.nHeight, it->second);
+        BOOST_CHECK(&mi->coins == vpCoins[it->second]);
+
+        // Inserting an existing txid returns the existing entry
+        std::pair<CCoinsMap::iterator, bool> ret = map.insert(it->first);
+        BOOST_CHECK(!ret.second);
+        BOOST_CHECK(ret.first == mi);
+    }
+    BOOST_CHECK_EQUAL(map.size(), mapRef.size());
+    BOOST_CHECK(map.find(GetRandHash()) == map.end());
+
+    size_t nUsage = map.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= map.size() * sizeof(CCoinsCacheEntry));
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(map.find(mapRef.begin()->first) == map.end());
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_memory_usage)
+{
+    CCoinsView viewDummy;
+    CCoinsViewCache view(viewDummy);
+    size_t nUsageEmpty = view.DynamicMemoryUsage();
+
+    CTransaction tx;
+    tx.vout.resize(10);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        tx.vout[i].scriptPubKey = CScript() << std::vector<unsigned char>(100, i) << OP_CHECKSIG;
+    CCoins coins(tx, 1);
+    BOOST_CHECK(coins.DynamicMemoryUsage() >= 10 * (sizeof(CTxOut) + 100));
+
+    // Outputs and scripts are accounted for, and overwriting does not count twice
+    view.SetCoins(tx.GetHash(), coins);
+    size_t nUsage = view.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= nUsageEmpty + coins.DynamicMemoryUsage());
+    view.SetCoins(tx.GetHash(), coins);
+    BOOST_CHECK_EQUAL(view.DynamicMemoryUsage(), nUsage);
+    view.SetCoins(tx.GetHash(), CCoins());
+    BOOST_CHECK(view.DynamicMemoryUsage() < nUsage);
+
+    CCoins coinsOut;
+    BOOST_CHECK(view.GetCoins(tx.GetHash(), coinsOut));
+    BOOST_CHECK(coinsOut.vout.empty());
+    BOOST_CHECK(!view.HaveCoins(GetRandHash()));
+}
+
+// Coins view that remembers what was handed to it in BatchWrite
+class CCoinsViewFlushed : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> mapBase;
+    std::map<uint256, unsigned char> mapFlushed;
+
+    bool GetCoins(const uint256 &txid, CCoins &coins)
+    {
+        std::map<uint256, CCoins>::iterator it = mapBase.find(txid);
+        if (it == mapBase.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+    bool HaveCoins(const uint256 &txid) { return mapBase.count(txid) > 0; }
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex)
+    {
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+            mapFlushed[it->txid] = it->nFlags;
+        return true;
+    }
+};
+
+BOOST_AUTO_TEST_CASE(coinsmap_dirty_fresh)
+{
+    CTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CCoins coins(tx, 1);
+    uint256 hashBase = GetRandHash(), hashRead = GetRandHash();
+    uint256 hashSpent = GetRandHash(), hashNew = GetRandHash(), hashLater = GetRandHash();
+
+    CCoinsViewFlushed base;
+    base.mapBase[hashBase] = coins;
+    base.mapBase[hashRead] = coins;
+    CCoinsViewCache tip(base);
+    {
+        CCoinsViewCache view(tip, true);
+        // Reading doesn't make coins dirty; modifying them does
+        BOOST_CHECK(view.AccessCoins(hashRead).IsAvailable(0));
+        BOOST_CHECK(view.GetCoins(hashBase).Spend(0));
+        // New coins that get spent before the flush don't reach the parent
+        BOOST_CHECK(view.SetNewCoins(hashSpent, coins));
+        BOOST_CHECK(view.GetCoins(hashSpent).Spend(0));
+        BOOST_CHECK(view.SetNewCoins(hashNew, coins));
+        BOOST_CHECK(view.SetNewCoins(hashLater, coins));
+        BOOST_CHECK(view.Flush());
+    }
+    // hashRead was pulled into tip by the read, but hashSpent never got there
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 4U);
+    BOOST_CHECK(!tip.HaveCoins(hashSpent));
+    {
+        // Spending fresh coins in the parent keeps them fresh
+        CCoinsViewCache view(tip, true);
+        BOOST_CHECK(view.GetCoins(hashLater).Spend(0));
+        BOOST_CHECK(view.Flush());
+    }
+    BOOST_CHECK(tip.AccessCoins(hashRead).IsAvailable(0));
+    BOOST_CHECK(tip.Flush());
+
+    BOOST_CHECK(!base.mapFlushed.count(hashSpent));
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashBase], CCoinsCacheEntry::DIRTY);
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashNew], CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashLater], CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH);
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashRead], 0);
+    BOOST_CHECK_EQUAL(base.mapFlushed.size(), 4U);
+}
+
+BOOST_AUTO_TEST_CASE(coinsmap_prefetched)
+{
+    CTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1;
+    CCoins coins(tx, 1);
+    uint256 hashFound = GetRandHash(), hashMissing = GetRandHash();
+
+    CCoinsViewFlushed base;
+    CCoinsViewCache tip(base);
+    CCoins coinsFound = coins, coinsMissing;
+    tip.AddPrefetchedCoins(hashFound, coinsFound, true);
+    tip.AddPrefetchedCoins(hashMissing, coinsMissing, false);
+    BOOST_CHECK(tip.HaveCoinsInCache(hashFound));
+    BOOST_CHECK(!tip.HaveCoinsInCache(GetRandHash()));
+
+    // Prefetched coins and misses are both answered without asking the base
+    BOOST_CHECK(tip.AccessCoins(hashFound) == coins);
+    BOOST_CHECK(tip.AccessCoins(hashMissing).IsPruned());
+    uint64 nLookups, nMisses;
+    tip.GetFetchStats(nLookups, nMisses);
+    BOOST_CHECK_EQUAL(nLookups, 2U);
+    BOOST_CHECK_EQUAL(nMisses, 0U);
+
+    // An existing entry is not overwritten
+    CCoins coinsOther;
+    tip.AddPrefetchedCoins(hashFound, coinsOther, false);
+    BOOST_CHECK(tip.AccessCoins(hashFound) == coins);
+
+    // Nothing was modified, so nothing is written
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashFound], 0);
+    BOOST_CHECK_EQUAL(base.mapFlushed[hashMissing], CCoinsCacheEntry::FRESH);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
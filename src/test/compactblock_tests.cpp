@@ -0,0 +1,142 @@
+#include <boost/test/unit_test.hpp>
+
+#include "compactblock.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+// A block of nTx transactions, which only differ in what they spend
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (i == 0)
+            tx.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        else
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Send cmpctblock over the wire
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+    CBlockHeaderAndShortTxIDs cmpctblockRecv;
+    ss >> cmpctblockRecv;
+    BOOST_CHECK(ss.empty());
+    return cmpctblockRecv;
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_reconstruct)
+{
+    CBlock block = BuildBlock(20);
+    CBlockHeaderAndShortTxIDs cmpctblock = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), 20U);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+
+    // The pool has all but transactions 3 and 17, and one of another block
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (i != 3 && i != 17)
+            pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+    CTransaction txOther = BuildBlock(2).vtx[1];
+    pool.mapTx[txOther.GetHash()] = txOther;
+
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, pool));
+    std::vector<unsigned int> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK_EQUAL(vMissing[0], 3U);
+    BOOST_CHECK_EQUAL(vMissing[1], 17U);
+
+    // getblocktxn and blocktxn over the wire
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    req.vIndexes = vMissing;
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << req;
+    CBlockTransactionsRequest reqRecv;
+    ss >> reqRecv;
+    BOOST_CHECK(reqRecv.vIndexes == vMissing);
+    CBlockTransactions resp;
+    resp.blockhash = reqRecv.blockhash;
+    BOOST_FOREACH(unsigned int nIndex, reqRecv.vIndexes)
+        resp.vtx.push_back(block.vtx[nIndex]);
+
+    CBlock blockRecv;
+    BOOST_CHECK(partial.FillBlock(blockRecv, resp.vtx));
+    BOOST_CHECK(blockRecv.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockRecv.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockRecv.vtx[i].GetHash() == block.vtx[i].GetHash());
+
+    // Too few, too many or the wrong transactions don't make the block
+    BOOST_CHECK(!partial.FillBlock(blockRecv, std::vector<CTransaction>(1, block.vtx[3])));
+    resp.vtx.push_back(block.vtx[5]);
+    BOOST_CHECK(!partial.FillBlock(blockRecv, resp.vtx));
+    resp.vtx.pop_back();
+    resp.vtx[1] = block.vtx[16];
+    BOOST_CHECK(!partial.FillBlock(blockRecv, resp.vtx));
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_malformed)
+{
+    CBlock block = BuildBlock(5);
+    CTxMemPool pool;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        pool.mapTx[block.vtx[i].GetHash()] = block.vtx[i];
+
+    // Duplicate short IDs can't be told apart
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vShortTxIDs[1] = cmpctblock.vShortTxIDs[0];
+    CPartialBlock partial;
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    // Prefilled transactions out of range
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.vPrefilledTxn.push_back(CPrefilledTransaction(7, block.vtx[1]));
+    cmpctblock.vShortTxIDs.pop_back();
+    BOOST_CHECK(!partial.Init(RoundTrip(cmpctblock), pool));
+
+    // Prefilled indexes past 0xffff are refused when read
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.GetBlockHeader() << (uint64)0;
+    WriteCompactSize(ss, 0);
+    WriteCompactSize(ss, 1);
+    WriteCompactSize(ss, 0x10000);
+    ss << block.vtx[0];
+    BOOST_CHECK_THROW(ss >> cmpctblock, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_shortids)
+{
+    CBlock block = BuildBlock(2);
+    CBlockHeaderAndShortTxIDs cmpctblock1(block), cmpctblock2(block);
+    uint256 hash = block.vtx[1].GetHash();
+
+    // Six bytes, and keyed by the nonce
+    BOOST_CHECK_EQUAL(cmpctblock1.GetShortID(hash) >> 48, 0U);
+    BOOST_CHECK(cmpctblock1.nNonce != cmpctblock2.nNonce);
+    BOOST_CHECK(cmpctblock1.GetShortID(hash) != cmpctblock2.GetShortID(hash));
+    BOOST_CHECK_EQUAL(RoundTrip(cmpctblock1).GetShortID(hash), cmpctblock1.GetShortID(hash));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
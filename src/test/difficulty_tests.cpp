@@ -0,0 +1,212 @@
+//
+// Regression tests for the difficulty code: the native 256-bit versions must
+// give exactly what the CBigNum versions they replaced gave.
+//
+#include <boost/test/unit_test.hpp>
+#include <math.h>
+
+#include "bignum.h"
+#include "chainparams.h"
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(difficulty_tests)
+
+// The retargeting parameters of main.cpp
+static const int64 nTargetSpacing = 90;
+static const int64 nInterval = 2;
+static const int64 nAveragingInterval = nInterval * 20;
+static const int64 nAveragingTargetTimespan = nAveragingInterval * nTargetSpacing;
+static const int64 nMinActualTimespan = nAveragingTargetTimespan * (100 - 10) / 100;
+static const int64 nMaxActualTimespan = nAveragingTargetTimespan * (100 + 20) / 100;
+static const CBigNum bnLimit(~uint256(0) >> 20);
+
+// GetNextWorkRequired_V1 as it was, on the main network
+static unsigned int RefWorkRequiredV1(const CBlockIndex* pindexLast)
+{
+    if (pindexLast->nHeight+1 < nAveragingInterval)
+        return bnLimit.GetCompact();
+    if ((pindexLast->nHeight+1) % nInterval != 0)
+        return pindexLast->nBits;
+
+    const CBlockIndex* pindexFirst = pindexLast;
+    for (int i = 0; pindexFirst && i < nAveragingInterval-1; i++)
+        pindexFirst = pindexFirst->pprev;
+    int64 nActualTimespan = pindexLast->GetBlockTime() - pindexFirst->GetBlockTime();
+    nActualTimespan = std::max(nMinActualTimespan, std::min(nMaxActualTimespan, nActualTimespan));
+
+    CBigNum bnNew;
+    bnNew.SetCompact(pindexLast->nBits);
+    bnNew *= nActualTimespan;
+    bnNew /= nAveragingTargetTimespan;
+    if (bnNew > bnLimit)
+        bnNew = bnLimit;
+    return bnNew.GetCompact();
+}
+
+// KimotoGravityWell as it was, with the parameters of GetNextWorkRequired_V2
+static unsigned int RefKimotoGravityWell(const CBlockIndex* pindexLast)
+{
+    const uint64 TargetBlocksSpacingSeconds = 180;
+    const uint64 PastBlocksMin = (int64)(60 * 60 * 24 * 0.23) / 180;
+    const uint64 PastBlocksMax = 60 * 60 * 24 / 180;
+
+    const CBlockIndex *BlockReading = pindexLast;
+    uint64 PastBlocksMass = 0;
+    int64 PastRateActualSeconds = 0;
+    int64 PastRateTargetSeconds = 0;
+    CBigNum PastDifficultyAverage, PastDifficultyAveragePrev;
+
+    if (pindexLast->nHeight == 0 || (uint64)pindexLast->nHeight < PastBlocksMin)
+        return bnLimit.GetCompact();
+
+    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
+        if (i > PastBlocksMax)
+            break;
+        PastBlocksMass++;
+        if (i == 1)
+            PastDifficultyAverage.SetCompact(BlockReading->nBits);
+        else
+            PastDifficultyAverage = ((CBigNum().SetCompact(BlockReading->nBits) - PastDifficultyAveragePrev) / i) + PastDifficultyAveragePrev;
+        PastDifficultyAveragePrev = PastDifficultyAverage;
+
+        PastRateActualSeconds = std::max(pindexLast->GetBlockTime() - BlockReading->GetBlockTime(), (int64)0);
+        PastRateTargetSeconds = TargetBlocksSpacingSeconds * PastBlocksMass;
+        double PastRateAdjustmentRatio = 1;
+        if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0)
+            PastRateAdjustmentRatio = double(PastRateTargetSeconds) / double(PastRateActualSeconds);
+        double EventHorizonDeviation = 1 + (0.7084 * pow((double(PastBlocksMass)/double(28.2)), -1.228));
+        if (PastBlocksMass >= PastBlocksMin &&
+            (PastRateAdjustmentRatio <= 1 / EventHorizonDeviation || PastRateAdjustmentRatio >= EventHorizonDeviation))
+            break;
+        if (BlockReading->pprev == NULL)
+            break;
+        BlockReading = BlockReading->pprev;
+    }
+
+    CBigNum bnNew(PastDifficultyAverage);
+    if (PastRateActualSeconds != 0 && PastRateTargetSeconds != 0) {
+        bnNew *= PastRateActualSeconds;
+        bnNew /= PastRateTargetSeconds;
+    }
+    if (bnNew > bnLimit)
+        bnNew = bnLimit;
+    return bnNew.GetCompact();
+}
+
+// A random target at most the limit, in compact form
+static unsigned int RandomBits()
+{
+    if (GetRand(10) == 0)
+        return bnLimit.GetCompact();
+    CBigNum bn(GetRandHash() >> (20 + GetRand(40)));
+    return bn.GetCompact();
+}
+
+// A chain of nBlocks random blocks, the first of which is at height nStartHeight
+static void BuildChain(std::vector<CBlockIndex> &vChain, int nStartHeight, int nBlocks)
+{
+    vChain.resize(nBlocks);
+    unsigned int nTime = 1400000000;
+    for (int i = 0; i < nBlocks; i++)
+    {
+        CBlockIndex &index = vChain[i];
+        index = CBlockIndex();
+        index.pprev = i ? &vChain[i-1] : NULL;
+        index.nHeight = nStartHeight + i;
+        // Mostly regular blocks, sometimes out of order, and sometimes after a long gap
+        int nRand = GetRand(100);
+        if (nRand == 0)
+            nTime += GetRand(1 << 26);
+        else if (nRand < 10)
+            nTime -= GetRand(600);
+        else
+            nTime += GetRand(400);
+        index.nTime = nTime;
+        index.nBits = GetRand(4) ? RandomBits() : (i ? vChain[i-1].nBits : bnLimit.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(difficulty_compact)
+{
+    unsigned int nCompacts[] = { 0, 0x00123456, 0x01003456, 0x01123456, 0x02008000, 0x03123456, 0x04123456,
+                                 0x04923456, 0x05009234, 0x1d00ffff, 0x1e0fffff, 0x20123456, 0x207fffff,
+                                 0x21010000, 0x22000001, 0x23000001, 0xff123456 };
+    for (unsigned int i = 0; i < sizeof(nCompacts)/sizeof(nCompacts[0]); i++)
+    {
+        CBigNum bn;
+        bn.SetCompact(nCompacts[i]);
+        uint256 n;
+        bool fNegative, fOverflow;
+        n.SetCompact(nCompacts[i], &fNegative, &fOverflow);
+        BOOST_CHECK_EQUAL(fNegative, bn < 0);
+        BOOST_CHECK_EQUAL(fOverflow, CBigNum(bn.getuint256()) != (bn < 0 ? -bn : bn));
+        if (!fOverflow)
+            BOOST_CHECK_EQUAL(n.GetCompact(fNegative), bn.GetCompact());
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 n = GetRandHash() >> GetRand(256);
+        BOOST_CHECK_EQUAL(n.GetCompact(), CBigNum(n).GetCompact());
+        BOOST_CHECK(uint256().SetCompact(n.GetCompact()) == CBigNum().SetCompact(n.GetCompact()).getuint256());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(difficulty_retarget)
+{
+    std::vector<CBlockIndex> vChain;
+    CBlockHeader header;
+
+    // Before block 450000, retargeting looks at a fixed number of blocks
+    BuildChain(vChain, 0, 1000);
+    for (unsigned int i = 0; i < vChain.size(); i++)
+        BOOST_CHECK_EQUAL(GetNextWorkRequired(&vChain[i], &header), RefWorkRequiredV1(&vChain[i]));
+
+    // After it, Kimoto Gravity Well looks at a varying number of them
+    for (int nRun = 0; nRun < 3; nRun++)
+    {
+        BuildChain(vChain, 449000, 2000);
+        for (unsigned int i = nAveragingInterval; i < vChain.size(); i++)
+        {
+            CBlockIndex *pindex = &vChain[i];
+            unsigned int nRef = pindex->nHeight+1 >= 450000 ? RefKimotoGravityWell(pindex) : RefWorkRequiredV1(pindex);
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex, &header), nRef);
+            // Asking again gives the same, whether or not it was remembered
+            BOOST_CHECK_EQUAL(GetNextWorkRequired(pindex, &header), nRef);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(difficulty_minwork)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        unsigned int nBase = RandomBits();
+        int64 nTime = GetRand(60 * 60 * 24 * 10);
+
+        CBigNum bnResult;
+        bnResult.SetCompact(nBase);
+        for (int64 n = nTime; n > 0 && bnResult < bnLimit; n -= 180 * 4)
+            bnResult *= 4;
+        if (bnResult > bnLimit)
+            bnResult = bnLimit;
+        BOOST_CHECK_EQUAL(ComputeMinWork(nBase, nTime), bnResult.GetCompact());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(difficulty_checkpow)
+{
+    for (int i = 0; i < 2000; i++)
+    {
+        unsigned int nBits = GetRand(3) ? RandomBits() : (unsigned int)GetRand(0x100000000ULL);
+        uint256 hash = GetRandHash() >> GetRand(256);
+
+        CBigNum bnTarget;
+        bnTarget.SetCompact(nBits);
+        bool fRef = bnTarget > 0 && bnTarget <= CBigNum(Params().ProofOfWorkLimit()) && hash <= bnTarget.getuint256();
+        BOOST_CHECK_EQUAL(CheckProofOfWork(hash, nBits), fRef);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,8 +1,12 @@
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <string>
 #include <vector>
 
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+
 #include "key.h"
 #include "base58.h"
 #include "uint256.h"
@@ -138,4 +142,122 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+
+// What CPubKey::Verify did before it had a verifier of its own
+static bool OpenSSLVerify(const CPubKey &pubkey, const uint256 &hash, const vector<unsigned char> &vchSig)
+{
+    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    const unsigned char *pbegin = pubkey.begin();
+    bool fOk = o2i_ECPublicKey(&pkey, &pbegin, pubkey.size()) &&
+               ECDSA_verify(0, (unsigned char*)&hash, sizeof(hash), vchSig.empty() ? NULL : &vchSig[0], vchSig.size(), pkey) == 1;
+    EC_KEY_free(pkey);
+    return fOk;
+}
+
+// The DER encoding of the signature (r, s), with s replaced by n - s if fNegateS
+// and r by r + nAddR
+static vector<unsigned char> ModifySignature(const vector<unsigned char> &vchSig, bool fNegateS, int nAddR)
+{
+    const unsigned char *p = &vchSig[0];
+    ECDSA_SIG *sig = d2i_ECDSA_SIG(NULL, &p, vchSig.size());
+    BOOST_REQUIRE(sig != NULL);
+    if (fNegateS)
+    {
+        EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+        BIGNUM *order = BN_new();
+        EC_GROUP_get_order(group, order, NULL);
+        BN_sub(sig->s, order, sig->s);
+        BN_free(order);
+        EC_GROUP_free(group);
+    }
+    if (nAddR < 0)
+        BN_sub_word(sig->r, -nAddR);
+    else
+        BN_add_word(sig->r, nAddR);
+    vector<unsigned char> vchRet(i2d_ECDSA_SIG(sig, NULL));
+    unsigned char *pout = &vchRet[0];
+    i2d_ECDSA_SIG(sig, &pout);
+    ECDSA_SIG_free(sig);
+    return vchRet;
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_openssl)
+{
+    // Whatever verifier CPubKey::Verify uses, it must accept exactly what
+    // OpenSSL accepts
+    for (int i = 0; i < 300; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+        uint256 hash = GetRandHash();
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hash, vchSig));
+
+        vector<vector<unsigned char> > vSigs;
+        vSigs.push_back(vchSig);
+        vSigs.push_back(ModifySignature(vchSig, true, 0));
+        vSigs.push_back(ModifySignature(vchSig, false, 1));
+        vSigs.push_back(ModifySignature(vchSig, true, -1));
+        vSigs.push_back(vector<unsigned char>(vchSig.begin(), vchSig.end() - 1));
+        vSigs.push_back(vchSig);
+        vSigs.back().push_back(0);
+        vSigs.push_back(vchSig);
+        vSigs.back()[GetRand(vchSig.size())] ^= 1 << GetRand(8);
+        vSigs.push_back(vector<unsigned char>());
+
+        BOOST_FOREACH(const vector<unsigned char> &vch, vSigs)
+        {
+            BOOST_CHECK_EQUAL(pubkey.Verify(hash, vch), OpenSSLVerify(pubkey, hash, vch));
+            BOOST_CHECK_EQUAL(pubkey.Verify(~hash, vch), OpenSSLVerify(pubkey, ~hash, vch));
+        }
+        BOOST_CHECK(pubkey.Verify(hash, vSigs[0]));
+        BOOST_CHECK(pubkey.Verify(hash, vSigs[1]));
+    }
+}
+
+// nSigs valid signatures by nKeys keys
+static void RandomPendingSignatures(vector<CPendingSignature> &vSigs, unsigned int nSigs, unsigned int nKeys)
+{
+    vector<CKey> vKeys(nKeys);
+    for (unsigned int i = 0; i < nKeys; i++)
+        vKeys[i].MakeNewKey(GetRand(2) == 0);
+    vSigs.resize(nSigs);
+    for (unsigned int i = 0; i < nSigs; i++)
+    {
+        const CKey &key = vKeys[GetRand(nKeys)];
+        vSigs[i].pubkey = key.GetPubKey();
+        vSigs[i].hash = GetRandHash();
+        BOOST_CHECK(key.Sign(vSigs[i].hash, vSigs[i].vchSig));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(key_verify_batch)
+{
+    BOOST_CHECK(VerifySignatureBatch(vector<CPendingSignature>()));
+
+    // A batch passes if and only if each of its signatures passes on its own
+    for (int i = 0; i < 100; i++)
+    {
+        vector<CPendingSignature> vSigs;
+        RandomPendingSignatures(vSigs, 1 + GetRand(40), 1 + GetRand(10));
+        BOOST_CHECK(VerifySignatureBatch(vSigs));
+
+        CPendingSignature &bad = vSigs[GetRand(vSigs.size())];
+        switch (GetRand(6))
+        {
+        case 0: bad.hash = ~bad.hash; break;
+        case 1: bad.vchSig = ModifySignature(bad.vchSig, true, 0); break;
+        case 2: bad.vchSig = ModifySignature(bad.vchSig, false, 1); break;
+        case 3: bad.vchSig.push_back(0); break;
+        case 4: bad.vchSig[GetRand(bad.vchSig.size())] ^= 1 << GetRand(8); break;
+        case 5: bad.pubkey = vSigs[GetRand(vSigs.size())].pubkey; break;
+        }
+        bool fAll = true;
+        BOOST_FOREACH(const CPendingSignature &sig, vSigs)
+            fAll = fAll && sig.pubkey.Verify(sig.hash, sig.vchSig);
+        BOOST_CHECK_EQUAL(VerifySignatureBatch(vSigs), fAll);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -191,6 +191,36 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     delete pblocktemplate;
     mempool.clear();
 
+    // Checking a template, also with its inputs prefetched, must not leave
+    // the outputs of its transactions looking spent: a child of one of them
+    // can still enter the memory pool
+    int nPrefetchThreadsOld = nPrefetchThreads;
+    nPrefetchThreads = 1;
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    tx.vin[0].prevout.hash = txFirst[0]->GetHash();
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout[0].nValue = 4900000000LL;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    hash = tx.GetHash();
+    mempool.addUnchecked(hash, tx);
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(reservekey));
+    delete pblocktemplate;
+    BOOST_CHECK(!pcoinsTip->HaveCoinsInCache(hash));
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(hash, 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 4800000000LL;
+    txChild.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(SignSignature(keystore, tx, txChild, 0));
+    CValidationState state;
+    BOOST_CHECK(mempool.accept(state, txChild, false, NULL));
+    mempool.clear();
+    nPrefetchThreads = nPrefetchThreadsOld;
+
     // subsidy changing
     int nHeight = pindexBest->nHeight;
     pindexBest->nHeight = 209999;
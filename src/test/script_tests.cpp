@@ -20,6 +20,7 @@ using namespace json_spirit;
 using namespace boost::algorithm;
 
 extern uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+extern bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, int flags);
 
 static const unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC;
 
@@ -444,4 +445,172 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(GetRandHash(), vchSig));
+
+    // A zero-sized cache stores nothing
+    CSignatureCache cacheEmpty(0);
+    uint256 hash = GetRandHash();
+    cacheEmpty.Set(hash, vchSig, pubkey);
+    BOOST_CHECK(!cacheEmpty.Get(hash, vchSig, pubkey));
+
+    CSignatureCache cache(1000 * 40);
+    BOOST_CHECK(cache.GetCapacity() > 0);
+    unsigned int nCapacity = cache.GetCapacity();
+
+    // Every part of the triple is part of the key
+    cache.Set(hash, vchSig, pubkey);
+    BOOST_CHECK(cache.Get(hash, vchSig, pubkey));
+    BOOST_CHECK(!cache.Get(GetRandHash(), vchSig, pubkey));
+    vector<unsigned char> vchSigOther(vchSig);
+    vchSigOther.back() ^= 1;
+    BOOST_CHECK(!cache.Get(hash, vchSigOther, pubkey));
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(!cache.Get(hash, vchSig, keyOther.GetPubKey()));
+
+    // Keep inserting: the most recent nCapacity/8 entries are never expired, so
+    // they can only be missing if their displacement path was too long
+    vector<uint256> vHashes;
+    for (unsigned int i = 0; i < 5 * nCapacity; i++)
+    {
+        vHashes.push_back(GetRandHash());
+        cache.Set(vHashes.back(), vchSig, pubkey);
+    }
+    unsigned int nMissing = 0;
+    for (unsigned int i = vHashes.size() - nCapacity / 8; i < vHashes.size(); i++)
+        if (!cache.Get(vHashes[i], vchSig, pubkey))
+            nMissing++;
+
+    CSignatureCacheStats stats = cache.GetStats();
+    BOOST_CHECK(nMissing <= stats.nEvictions);
+    BOOST_CHECK(nMissing < nCapacity / 60);
+    BOOST_CHECK_EQUAL(stats.nInserts, 5 * nCapacity + 1);
+    BOOST_CHECK(stats.nHits >= nCapacity / 8 - nMissing + 1);
+    BOOST_CHECK(stats.nLookups >= stats.nHits);
+    BOOST_CHECK_EQUAL(stats.nContention, 0U);
+}
+
+// A transaction spending nInputs random outputs to nOutputs random scripts
+static CTransaction RandomTransaction(unsigned int nInputs, unsigned int nOutputs)
+{
+    CTransaction tx;
+    tx.nVersion = GetRand(3);
+    tx.nLockTime = GetRand(2) ? 0 : GetRand(500000000);
+    tx.vin.resize(nInputs);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+    {
+        txin.prevout = COutPoint(GetRandHash(), GetRand(10));
+        txin.scriptSig << vector<unsigned char>(GetRand(100), 1);
+        txin.nSequence = GetRand(2) ? std::numeric_limits<unsigned int>::max() : GetRand(1000);
+    }
+    tx.vout.resize(nOutputs);
+    BOOST_FOREACH(CTxOut& txout, tx.vout)
+    {
+        txout.nValue = GetRand(100 * COIN);
+        txout.scriptPubKey << OP_DUP << OP_HASH160 << vector<unsigned char>(20, GetRand(256)) << OP_EQUALVERIFY << OP_CHECKSIG;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(script_sighash_context)
+{
+    int nHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, SIGHASH_ALL | SIGHASH_ANYONECANPAY,
+                         SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY, 0, 0x41, 0x7f };
+    for (int n = 0; n < 200; n++)
+    {
+        CTransaction tx = RandomTransaction(1 + GetRand(20), GetRand(20));
+        CSigHashContext sighash(tx);
+        for (unsigned int i = 0; i < tx.vin.size() + 1; i++)
+        {
+            CScript scriptCode;
+            scriptCode << vector<unsigned char>(GetRand(80), 2);
+            if (GetRand(2))
+                scriptCode << OP_CODESEPARATOR << OP_CHECKSIG;
+            int nHashType = GetRand(3) ? nHashTypes[GetRand(sizeof(nHashTypes) / sizeof(nHashTypes[0]))] : (int)GetRand(0x100000000ULL);
+            BOOST_CHECK(sighash.SignatureHash(scriptCode, i, nHashType) == SignatureHash(scriptCode, tx, i, nHashType));
+        }
+
+        // Signing an input doesn't change the others' hashes
+        tx.vin[0].scriptSig << OP_0 << vector<unsigned char>(72, 3);
+        CScript scriptCode;
+        scriptCode << OP_CHECKSIG;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            BOOST_CHECK(sighash.SignatureHash(scriptCode, i, SIGHASH_ALL) == SignatureHash(scriptCode, tx, i, SIGHASH_ALL));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_deferred_sigs)
+{
+    static const unsigned int flagsNoCache = flags | SCRIPT_VERIFY_NOCACHE;
+    for (int n = 0; n < 200; n++)
+    {
+        vector<CKey> keys(2);
+        keys[0].MakeNewKey(GetRand(2) == 0);
+        keys[1].MakeNewKey(GetRand(2) == 0);
+        CKey keyOther;
+        keyOther.MakeNewKey(true);
+
+        CTransaction txTo = RandomTransaction(1, 1);
+        int nType = GetRand(4);
+        CScript scriptPubKey;
+        if (nType == 0)
+            scriptPubKey.SetDestination(keys[0].GetPubKey().GetID());
+        else if (nType == 1)
+            scriptPubKey << keys[0].GetPubKey() << OP_CHECKSIG;
+        else
+            scriptPubKey << (nType == 2 ? OP_2 : OP_1) << keys[0].GetPubKey() << keys[1].GetPubKey() << OP_2 << OP_CHECKMULTISIG;
+
+        // Signed by the right keys or not, and spent by the signed transaction or not
+        bool fGoodKey = GetRand(3) != 0;
+        CScript scriptSig;
+        if (nType < 2)
+        {
+            uint256 hash = SignatureHash(scriptPubKey, txTo, 0, SIGHASH_ALL);
+            vector<unsigned char> vchSig;
+            BOOST_CHECK((fGoodKey ? keys[0] : keyOther).Sign(hash, vchSig));
+            vchSig.push_back((unsigned char)SIGHASH_ALL);
+            scriptSig << vchSig;
+            if (nType == 0)
+                scriptSig << keys[0].GetPubKey();
+        }
+        else
+        {
+            if (!fGoodKey)
+                keys[GetRand(2)] = keyOther;
+            else if (nType == 3)
+                keys.erase(keys.begin() + GetRand(2));
+            scriptSig = sign_multisig(scriptPubKey, keys, txTo);
+        }
+        if (GetRand(4) == 0)
+            txTo.vout[0].nValue++;
+
+        // The 1-of-2 is tried against the wrong key first when signed by the
+        // second, so it isn't worth deferring; the result is right anyway
+        BOOST_CHECK_EQUAL(CanDeferSignatures(scriptSig, scriptPubKey), nType != 3);
+        bool fValid = VerifyScript(scriptSig, scriptPubKey, txTo, 0, flagsNoCache, 0);
+        vector<CPendingSignature> vSigs;
+        bool fDeferred = VerifyScript(scriptSig, scriptPubKey, txTo, 0, flagsNoCache, 0, NULL, &vSigs);
+        if (fValid)
+            BOOST_CHECK(fDeferred);
+        if (fDeferred && VerifySignatureBatch(vSigs))
+            BOOST_CHECK(fValid);
+        if (fValid && nType != 3)
+            BOOST_CHECK(VerifySignatureBatch(vSigs));
+    }
+
+    // Scripts that aren't just pushes aren't deferred
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    BOOST_CHECK(!CanDeferSignatures(CScript() << OP_1 << OP_DROP << OP_0 << key.GetPubKey(), scriptPubKey));
+    BOOST_CHECK(CanDeferSignatures(CScript() << OP_0 << key.GetPubKey(), scriptPubKey));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,251 @@
+//
+// Differential tests of CScriptNum against CBigNum, which the script
+// interpreter used for its arithmetic before.
+//
+#include <boost/test/unit_test.hpp>
+
+#include "bignum.h"
+#include "main.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+typedef vector<unsigned char> valtype;
+
+BOOST_AUTO_TEST_SUITE(scriptnum_tests)
+
+// What CastToBigNum used to turn a stack element into
+static CBigNum RefCastToBigNum(const valtype& vch)
+{
+    if (vch.size() > 4)
+        throw runtime_error("RefCastToBigNum() : overflow");
+    return CBigNum(CBigNum(vch).getvch());
+}
+
+// A stack element of up to nMaxSize bytes, with a bias to the edge cases:
+// zeros, negative zeros, padding and the largest operands
+static valtype RandomElement(unsigned int nMaxSize)
+{
+    valtype vch(GetRand(nMaxSize + 1));
+    for (unsigned int i = 0; i < vch.size(); i++)
+    {
+        switch (GetRand(6))
+        {
+        case 0:  vch[i] = 0; break;
+        case 1:  vch[i] = 0xff; break;
+        case 2:  vch[i] = 0x80; break;
+        case 3:  vch[i] = 0x7f; break;
+        default: vch[i] = GetRand(256); break;
+        }
+    }
+    return vch;
+}
+
+// The numeric part of EvalScript as it was with CBigNum, for scripts that
+// only push data and do arithmetic and stack shuffling
+static bool RefEvalScript(vector<valtype>& stack, const CScript& script)
+{
+    try
+    {
+        CScript::const_iterator pc = script.begin();
+        opcodetype opcode;
+        valtype vchPushValue;
+        while (pc < script.end())
+        {
+            if (!script.GetOp(pc, opcode, vchPushValue))
+                return false;
+            if (opcode <= OP_PUSHDATA4)
+            {
+                stack.push_back(vchPushValue);
+                continue;
+            }
+
+            switch (opcode)
+            {
+            case OP_1NEGATE:
+            case OP_1: case OP_2: case OP_3: case OP_4: case OP_5: case OP_6: case OP_7: case OP_8:
+            case OP_9: case OP_10: case OP_11: case OP_12: case OP_13: case OP_14: case OP_15: case OP_16:
+                stack.push_back(CBigNum((int)opcode - (int)(OP_1 - 1)).getvch());
+                break;
+
+            case OP_DEPTH:
+                stack.push_back(CBigNum(stack.size()).getvch());
+                break;
+
+            case OP_DUP:
+                if (stack.size() < 1)
+                    return false;
+                stack.push_back(stack.back());
+                break;
+
+            case OP_SWAP:
+                if (stack.size() < 2)
+                    return false;
+                swap(stack[stack.size() - 2], stack[stack.size() - 1]);
+                break;
+
+            case OP_PICK:
+            {
+                if (stack.size() < 2)
+                    return false;
+                int n = RefCastToBigNum(stack.back()).getint();
+                stack.pop_back();
+                if (n < 0 || n >= (int)stack.size())
+                    return false;
+                stack.push_back(stack[stack.size() - n - 1]);
+                break;
+            }
+
+            case OP_SIZE:
+                if (stack.size() < 1)
+                    return false;
+                stack.push_back(CBigNum(stack.back().size()).getvch());
+                break;
+
+            case OP_1ADD: case OP_1SUB: case OP_NEGATE: case OP_ABS: case OP_NOT: case OP_0NOTEQUAL:
+            {
+                if (stack.size() < 1)
+                    return false;
+                CBigNum bn = RefCastToBigNum(stack.back());
+                switch (opcode)
+                {
+                case OP_1ADD:       bn += 1; break;
+                case OP_1SUB:       bn -= 1; break;
+                case OP_NEGATE:     bn = -bn; break;
+                case OP_ABS:        if (bn < 0) bn = -bn; break;
+                case OP_NOT:        bn = (bn == 0); break;
+                case OP_0NOTEQUAL:  bn = (bn != 0); break;
+                default:            break;
+                }
+                stack.back() = bn.getvch();
+                break;
+            }
+
+            case OP_WITHIN:
+            {
+                if (stack.size() < 3)
+                    return false;
+                CBigNum bn1 = RefCastToBigNum(stack[stack.size() - 3]);
+                CBigNum bn2 = RefCastToBigNum(stack[stack.size() - 2]);
+                CBigNum bn3 = RefCastToBigNum(stack[stack.size() - 1]);
+                stack.resize(stack.size() - 3);
+                stack.push_back((bn2 <= bn1 && bn1 < bn3) ? valtype(1, 1) : valtype());
+                break;
+            }
+
+            default:
+            {
+                if (stack.size() < 2)
+                    return false;
+                CBigNum bn1 = RefCastToBigNum(stack[stack.size() - 2]);
+                CBigNum bn2 = RefCastToBigNum(stack[stack.size() - 1]);
+                CBigNum bn;
+                switch (opcode)
+                {
+                case OP_ADD:                 bn = bn1 + bn2; break;
+                case OP_SUB:                 bn = bn1 - bn2; break;
+                case OP_BOOLAND:             bn = (bn1 != 0 && bn2 != 0); break;
+                case OP_BOOLOR:              bn = (bn1 != 0 || bn2 != 0); break;
+                case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
+                case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
+                case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
+                case OP_LESSTHAN:            bn = (bn1 < bn2); break;
+                case OP_GREATERTHAN:         bn = (bn1 > bn2); break;
+                case OP_LESSTHANOREQUAL:     bn = (bn1 <= bn2); break;
+                case OP_GREATERTHANOREQUAL:  bn = (bn1 >= bn2); break;
+                case OP_MIN:                 bn = (bn1 < bn2 ? bn1 : bn2); break;
+                case OP_MAX:                 bn = (bn1 > bn2 ? bn1 : bn2); break;
+                default:                     return false;
+                }
+                stack.resize(stack.size() - 2);
+                stack.push_back(bn.getvch());
+                if (opcode == OP_NUMEQUALVERIFY)
+                {
+                    if (bn == 0)
+                        return false;
+                    stack.pop_back();
+                }
+                break;
+            }
+            }
+        }
+    }
+    catch (...)
+    {
+        return false;
+    }
+    return true;
+}
+
+static const opcodetype vOps[] = {
+    OP_1NEGATE, OP_1, OP_2, OP_16, OP_DEPTH, OP_DUP, OP_SWAP, OP_PICK, OP_SIZE,
+    OP_1ADD, OP_1SUB, OP_NEGATE, OP_ABS, OP_NOT, OP_0NOTEQUAL,
+    OP_ADD, OP_SUB, OP_BOOLAND, OP_BOOLOR, OP_NUMEQUAL, OP_NUMEQUALVERIFY, OP_NUMNOTEQUAL,
+    OP_LESSTHAN, OP_GREATERTHAN, OP_LESSTHANOREQUAL, OP_GREATERTHANOREQUAL, OP_MIN, OP_MAX, OP_WITHIN
+};
+
+// A random script of pushes and the opcodes above
+static CScript RandomArithmeticScript()
+{
+    CScript script;
+    int nOps = 1 + GetRand(30);
+    for (int i = 0; i < nOps; i++)
+    {
+        if (GetRand(3) == 0)
+            script << RandomElement(5);
+        else
+            script << vOps[GetRand(sizeof(vOps) / sizeof(vOps[0]))];
+    }
+    return script;
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_serialize)
+{
+    int64 nValues[] = { 0, 1, -1, 127, 128, -127, -128, 255, 256, 32767, 32768, -32768, 0x7fffffff, -0x7fffffff,
+                        0x80000000LL, -0x80000000LL, 0xffffffffLL, 0xfffffffeLL, -0xfffffffeLL, 0x7fffffffffffffffLL };
+    for (unsigned int i = 0; i < sizeof(nValues) / sizeof(nValues[0]); i++)
+        BOOST_CHECK(CScriptNum::Serialize(nValues[i]) == CBigNum(nValues[i]).getvch());
+
+    for (int i = 0; i < 10000; i++)
+    {
+        int64 n = (int64)GetRand(0x200000000ULL) - 0x100000000LL;
+        BOOST_CHECK(CScriptNum::Serialize(n) == CBigNum(n).getvch());
+        BOOST_CHECK(CScript() << n == CScript() << CBigNum(n));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_parse)
+{
+    for (int i = 0; i < 10000; i++)
+    {
+        valtype vch = RandomElement(5);
+        if (vch.size() > 4)
+        {
+            BOOST_CHECK_THROW(CScriptNum num(vch), scriptnum_error);
+            continue;
+        }
+        CScriptNum num(vch);
+        CBigNum bn = RefCastToBigNum(vch);
+        BOOST_CHECK(num.getvch() == bn.getvch());
+        BOOST_CHECK_EQUAL(num.getint(), bn.getint());
+        BOOST_CHECK_EQUAL(ValueString(vch), strprintf("%d", bn.getint()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scriptnum_eval)
+{
+    // Random scripts must succeed or fail and leave the same stack as with CBigNum
+    for (int i = 0; i < 20000; i++)
+    {
+        CScript script = RandomArithmeticScript();
+        vector<valtype> stack, stackRef;
+        bool fOk = EvalScript(stack, script, CTransaction(), 0, 0, 0);
+        bool fRef = RefEvalScript(stackRef, script);
+        BOOST_CHECK_EQUAL(fOk, fRef);
+        if (fOk && fRef)
+            BOOST_CHECK(stack == stackRef);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,111 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+#include <openssl/rand.h>
+#include <vector>
+
+#include "sha256.h"
+#include "hash.h"
+#include "util.h"
+#include "main.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sha256_tests)
+
+// Messages of every length around the block and padding boundaries, plus some longer ones
+static vector<vector<unsigned char> > GetTestMessages()
+{
+    vector<vector<unsigned char> > vMsgs;
+    for (unsigned int n = 0; n < 200; n++)
+        vMsgs.push_back(vector<unsigned char>(n));
+    vMsgs.push_back(vector<unsigned char>(1000));
+    vMsgs.push_back(vector<unsigned char>(4099));
+    for (unsigned int i = 0; i < vMsgs.size(); i++)
+        RAND_bytes(vMsgs[i].size() ? &vMsgs[i][0] : NULL, vMsgs[i].size());
+    return vMsgs;
+}
+
+BOOST_AUTO_TEST_CASE(sha256_backends)
+{
+    vector<vector<unsigned char> > vMsgs = GetTestMessages();
+    vector<pair<const unsigned char*, size_t> > vInputs;
+    BOOST_FOREACH(const vector<unsigned char>& vMsg, vMsgs)
+        vInputs.push_back(make_pair(vMsg.empty() ? NULL : &vMsg[0], vMsg.size()));
+
+    SHA256Backend backendAuto = SHA256GetBackend();
+    BOOST_CHECK(SHA256BackendSupported(SHA256_BACKEND_SCALAR));
+    BOOST_CHECK(SHA256BackendSupported(backendAuto));
+
+    for (int b = 0; b < SHA256_BACKEND_COUNT; b++)
+    {
+        SHA256Backend backend = (SHA256Backend)b;
+        if (!SHA256SetBackend(backend))
+            continue;
+
+        vector<uint256> vHashes;
+        HashBatch(vInputs, vHashes);
+        BOOST_CHECK_EQUAL(vHashes.size(), vMsgs.size());
+        for (unsigned int i = 0; i < vMsgs.size(); i++)
+            BOOST_CHECK_MESSAGE(vHashes[i] == Hash(vMsgs[i].begin(), vMsgs[i].end()),
+                                strprintf("%s: mismatch for %"PRIszu"-byte message", SHA256BackendName(backend), vMsgs[i].size()));
+
+        // Batches smaller than the number of lanes
+        vector<pair<const unsigned char*, size_t> > vFew(vInputs.begin() + 60, vInputs.begin() + 63);
+        HashBatch(vFew, vHashes);
+        for (unsigned int i = 0; i < vFew.size(); i++)
+            BOOST_CHECK(vHashes[i] == Hash(vMsgs[60+i].begin(), vMsgs[60+i].end()));
+    }
+
+    SHA256SetBackend(backendAuto);
+
+    vector<uint256> vEmpty;
+    HashBatch(vector<pair<const unsigned char*, size_t> >(), vEmpty);
+    BOOST_CHECK(vEmpty.empty());
+}
+
+BOOST_AUTO_TEST_CASE(sha256_scan_nonces)
+{
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = 1380000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 0;
+
+    char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
+    char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
+    char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
+    FormatHashBuffers(&block, pmidstate, pdata, phash1);
+
+    // Every backend must find the same first candidate nonce, and report its full hash
+    SHA256Backend backendAuto = SHA256GetBackend();
+    uint32_t nNonceFirst = 0;
+    for (int b = 0; b < SHA256_BACKEND_COUNT; b++)
+    {
+        SHA256Backend backend = (SHA256Backend)b;
+        if (!SHA256SetBackend(backend))
+            continue;
+
+        uint32_t nNonceFound = 0;
+        uint256 hash;
+        BOOST_CHECK(SHA256ScanNonces((uint32_t*)pmidstate, (uint32_t*)(pdata + 64), 1, 0x1000000, nNonceFound, (uint32_t*)&hash));
+        for (unsigned int i = 0; i < sizeof(hash)/4; i++)
+            ((unsigned int*)&hash)[i] = ByteReverse(((unsigned int*)&hash)[i]);
+
+        block.nNonce = ByteReverse(nNonceFound);
+        BOOST_CHECK_MESSAGE(hash == block.GetHash(), SHA256BackendName(backend));
+        BOOST_CHECK((hash >> 240) == 0);
+        if (b == 0)
+            nNonceFirst = nNonceFound;
+        BOOST_CHECK_EQUAL(nNonceFound, nNonceFirst);
+
+        // Ranges that end right before the candidate, or are not a multiple of the lane count
+        uint32_t nNonceIgnored;
+        BOOST_CHECK(!SHA256ScanNonces((uint32_t*)pmidstate, (uint32_t*)(pdata + 64), 1, nNonceFirst - 1, nNonceIgnored, (uint32_t*)&hash));
+        BOOST_CHECK(SHA256ScanNonces((uint32_t*)pmidstate, (uint32_t*)(pdata + 64), nNonceFirst - 2, 3, nNonceIgnored, (uint32_t*)&hash));
+    }
+    SHA256SetBackend(backendAuto);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
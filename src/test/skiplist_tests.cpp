@@ -0,0 +1,77 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+static const int SKIPLIST_LENGTH = 300000;
+
+BOOST_AUTO_TEST_CASE(skiplist_ancestor)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i = 0; i < SKIPLIST_LENGTH; i++)
+    {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildSkip();
+    }
+
+    // Skip pointers point back, and never to the block itself
+    for (int i = 0; i < SKIPLIST_LENGTH; i++)
+    {
+        if (i > 0)
+        {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        }
+        else
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        int nFrom = GetRand(SKIPLIST_LENGTH);
+        int nTo = GetRand(nFrom + 1);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nTo) == &vIndex[nTo]);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(nFrom + 1) == NULL);
+        BOOST_CHECK(vIndex[nFrom].GetAncestor(-1) == NULL);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_fork)
+{
+    // A tree of forks: every block builds on a random earlier one
+    std::vector<CBlockIndex> vIndex(50000);
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        vIndex[i].pprev = i ? &vIndex[GetRand(i)] : NULL;
+        vIndex[i].nHeight = i ? vIndex[i].pprev->nHeight + 1 : 0;
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        CBlockIndex* pa = &vIndex[GetRand(vIndex.size())];
+        CBlockIndex* pb = &vIndex[GetRand(vIndex.size())];
+
+        // Ancestors found with the skip pointers are those found walking back
+        int nHeight = GetRand(pa->nHeight + 1);
+        CBlockIndex* pwalk = pa;
+        while (pwalk->nHeight > nHeight)
+            pwalk = pwalk->pprev;
+        BOOST_CHECK(pa->GetAncestor(nHeight) == pwalk);
+
+        // The fork point is an ancestor of both, and its successors differ
+        CBlockIndex* pfork = LastCommonAncestor(pa, pb);
+        BOOST_CHECK(pfork != NULL);
+        BOOST_CHECK(pa->GetAncestor(pfork->nHeight) == pfork);
+        BOOST_CHECK(pb->GetAncestor(pfork->nHeight) == pfork);
+        if (pfork != pa && pfork != pb)
+            BOOST_CHECK(pa->GetAncestor(pfork->nHeight + 1) != pb->GetAncestor(pfork->nHeight + 1));
+    }
+    BOOST_CHECK(LastCommonAncestor(&vIndex[0], NULL) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
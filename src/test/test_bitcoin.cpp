@@ -28,7 +28,8 @@ struct TestingSetup {
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(*pcoinsdbview);
+        pcoinsWriter = new CCoinsViewWriteBehind(*pcoinsdbview);
+        pcoinsTip = new CCoinsViewCache(*pcoinsWriter);
         InitBlockIndex();
         bool fFirstRun;
         pwalletMain = new CWallet("wallet.dat");
@@ -45,6 +46,7 @@ struct TestingSetup {
         delete pwalletMain;
         pwalletMain = NULL;
         delete pcoinsTip;
+        delete pcoinsWriter;
         delete pcoinsdbview;
         delete pblocktree;
         bitdb.Flush(true);
@@ -0,0 +1,117 @@
+#include <boost/test/unit_test.hpp>
+#include <vector>
+
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+// A chain of block indexes, registered in mapBlockIndex while it exists
+class CTestChain
+{
+public:
+    std::vector<CBlockIndex*> vBlocks;
+
+    CTestChain(int nBlocks)
+    {
+        for (int i = 0; i < nBlocks; i++)
+        {
+            CBlockIndex *pindex = new CBlockIndex();
+            pindex->nHeight = i;
+            pindex->pprev = i ? vBlocks.back() : NULL;
+            pindex->phashBlock = &mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first->first;
+            vBlocks.push_back(pindex);
+        }
+    }
+
+    ~CTestChain()
+    {
+        BOOST_FOREACH(CBlockIndex *pindex, vBlocks)
+        {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+    }
+};
+
+static CCoins MakeCoins(int nHeight)
+{
+    CTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nHeight + 1;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return CCoins(tx, nHeight);
+}
+
+BOOST_AUTO_TEST_CASE(txdb_chunked)
+{
+    CTestChain chain(2);
+    CCoinsViewDB db(1 << 20, true);
+
+    CCoinsMap mapCoins;
+    std::vector<uint256> vTxid;
+    for (int i = 0; i < 1000; i++)
+    {
+        vTxid.push_back(GetRandHash());
+        CCoinsCacheEntry &entry = *mapCoins.insert(vTxid.back()).first;
+        entry.coins = MakeCoins(i);
+        entry.nFlags = CCoinsCacheEntry::DIRTY;
+    }
+
+    // Many small batches end up as a complete write
+    BOOST_CHECK(db.BatchWriteChunked(mapCoins, chain.vBlocks[1], 1000));
+    BOOST_CHECK(db.GetBestBlock() == chain.vBlocks[1]);
+    BOOST_CHECK(db.GetFlushTarget() == NULL);
+    for (int i = 0; i < 1000; i++)
+    {
+        CCoins coins;
+        BOOST_CHECK(db.GetCoins(vTxid[i], coins));
+        BOOST_CHECK(coins == MakeCoins(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(txdb_writebehind)
+{
+    CTestChain chain(3);
+    CCoinsViewDB db(1 << 20, true);
+    CCoinsViewWriteBehind writer(db);
+    CCoinsViewCache cache(writer);
+
+    std::vector<uint256> vTxid;
+    for (int nRound = 0; nRound < 3; nRound++)
+    {
+        // Spend the coins of the previous round, and create new ones
+        BOOST_FOREACH(const uint256 &txid, vTxid)
+            BOOST_CHECK(cache.GetCoins(txid).Spend(0));
+        std::vector<uint256> vSpent;
+        vSpent.swap(vTxid);
+        for (int i = 0; i < 2000; i++)
+        {
+            vTxid.push_back(GetRandHash());
+            BOOST_CHECK(cache.SetCoins(vTxid.back(), MakeCoins(nRound)));
+        }
+        BOOST_CHECK(cache.SetBestBlock(chain.vBlocks[nRound]));
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK_EQUAL(cache.GetCacheSize(), 0U);
+
+        // Whether or not the write finished, the writer shows its outcome
+        BOOST_CHECK(writer.GetBestBlock() == chain.vBlocks[nRound]);
+        BOOST_FOREACH(const uint256 &txid, vSpent)
+            BOOST_CHECK(!writer.HaveCoins(txid));
+        BOOST_FOREACH(const uint256 &txid, vTxid)
+        {
+            CCoins coins;
+            BOOST_CHECK(writer.GetCoins(txid, coins));
+            BOOST_CHECK(coins == MakeCoins(nRound));
+        }
+    }
+
+    // GetStats waits for the write to be done
+    CCoinsStats stats;
+    BOOST_CHECK(writer.GetStats(stats));
+    BOOST_CHECK(db.GetBestBlock() == chain.vBlocks[2]);
+    BOOST_CHECK_EQUAL(stats.nTransactions, vTxid.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,6 +1,9 @@
 #include <boost/test/unit_test.hpp>
 
+#include "bignum.h"
+#include "main.h"
 #include "uint256.h"
+#include "util.h"
 
 BOOST_AUTO_TEST_SUITE(uint256_tests)
 
@@ -15,4 +18,43 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_divide)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        uint256 a = GetRandHash(), b = GetRandHash();
+        b >>= GetRand(256);
+        if (b == 0)
+            continue;
+        BOOST_CHECK((CBigNum(a) / CBigNum(b)).getuint256() == a / b);
+        uint256 c = a >> 3;
+        BOOST_CHECK((CBigNum(c) * 6).getuint256() == c * 6);
+    }
+    BOOST_CHECK(uint256(1000) / uint256(7) == 142);
+    BOOST_CHECK(uint256(7) / uint256(1000) == 0);
+    BOOST_CHECK_THROW(uint256(7) / uint256(0), uint_error);
+
+    // The product in MulDiv may be wider than 256 bits, the result may not
+    uint256 bn = ~uint256(0) >> 20;
+    BOOST_CHECK(bn.MulDiv(1 << 30, 1 << 20));
+    BOOST_CHECK(bn == (~uint256(0) >> 20) << 10);
+    BOOST_CHECK(!bn.MulDiv(1ULL << 40, 1));
+}
+
+BOOST_AUTO_TEST_CASE(uint256_blockwork)
+{
+    // The work of a block is computed without CBigNum, and must not change
+    CBlockIndex index;
+    unsigned int nCompacts[] = { 0x1d00ffff, 0x1b0404cb, 0x207fffff, 0x03123456, 0x01003456, 0x1c05a3f4,
+                                 0x21010000, 0x04923456, 0x00000000, 0xff123456 };
+    for (unsigned int i = 0; i < sizeof(nCompacts)/sizeof(nCompacts[0]) + 1000; i++)
+    {
+        index.nBits = i < sizeof(nCompacts)/sizeof(nCompacts[0]) ? nCompacts[i] : (unsigned int)GetRand(0x100000000ULL);
+        CBigNum bnTarget;
+        bnTarget.SetCompact(index.nBits);
+        uint256 bnWork = bnTarget <= 0 ? 0 : ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+        BOOST_CHECK_MESSAGE(index.GetBlockWork() == bnWork, strprintf("nBits %08x", index.nBits));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
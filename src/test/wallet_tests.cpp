@@ -291,4 +291,85 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(wallet_scan_filter)
+{
+    CBasicKeyStore keystore;
+    vector<CKey> vKeys(6);
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        if (i < 4)
+            keystore.AddKey(vKeys[i]);
+    }
+    CScript scriptOther;
+    scriptOther.SetDestination(vKeys[4].GetPubKey().GetID());
+
+    // Scripts to pay to directly, and behind pay-to-script-hash: ours or not
+    vector<CScript> vScripts;
+    for (unsigned int i = 0; i < vKeys.size(); i++)
+    {
+        CPubKey pubkey = vKeys[i].GetPubKey();
+        CScript script;
+        script.SetDestination(pubkey.GetID());
+        vScripts.push_back(script);
+        vScripts.push_back(CScript() << pubkey << OP_CHECKSIG);
+        // The other encoding of the key pays to a different key ID
+        CPubKey pubkeyOtherForm = pubkey;
+        if (pubkeyOtherForm.Decompress() && pubkey.IsCompressed())
+            vScripts.push_back(CScript() << pubkeyOtherForm << OP_CHECKSIG);
+        // A P2PKH with a needless PUSHDATA1 is IsMine all the same
+        script = CScript() << OP_DUP << OP_HASH160 << OP_PUSHDATA1;
+        script.push_back(20);
+        script += CScript() << OP_EQUALVERIFY << OP_CHECKSIG;
+        CKeyID keyID = pubkey.GetID();
+        script.insert(script.begin() + 4, keyID.begin(), keyID.end());
+        vScripts.push_back(script);
+    }
+    vScripts.push_back(CScript() << OP_1 << vKeys[0].GetPubKey() << vKeys[1].GetPubKey() << OP_2 << OP_CHECKMULTISIG);
+    vScripts.push_back(CScript() << OP_1 << vKeys[0].GetPubKey() << vKeys[4].GetPubKey() << OP_2 << OP_CHECKMULTISIG);
+    vScripts.push_back(CScript() << OP_RETURN);
+    vScripts.push_back(CScript() << vector<unsigned char>(33, 2) << OP_CHECKSIG);
+    vScripts.push_back(CScript() << vector<unsigned char>(65, 9) << OP_CHECKSIG);
+    unsigned int nDirect = vScripts.size();
+    for (unsigned int i = 0; i < nDirect; i++)
+    {
+        if (i % 3 == 0)
+            keystore.AddCScript(vScripts[i]);
+        CScript script;
+        script.SetDestination(vScripts[i].GetID());
+        vScripts.push_back(script);
+    }
+
+    std::set<CKeyID> setKeyID;
+    keystore.GetKeys(setKeyID);
+    vector<CScriptID> vScriptID;
+    for (unsigned int i = 0; i < nDirect; i += 3)
+        if (IsMine(keystore, vScripts[i]))
+            vScriptID.push_back(vScripts[i].GetID());
+    vector<uint256> vWalletTx(1, GetRandHash());
+    CWalletScanFilter filter(keystore, setKeyID, vScriptID, vWalletTx);
+
+    BOOST_FOREACH(const CScript& script, vScripts)
+        BOOST_CHECK_EQUAL(filter.IsMine(script), IsMine(keystore, script));
+
+    // A transaction is a candidate for being in the wallet, spending from it or paying to it
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[1].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptOther;
+    BOOST_CHECK(!filter.IsCandidate(tx, tx.GetHash()));
+    BOOST_CHECK(filter.IsCandidate(tx, vWalletTx[0]));
+    tx.vin[1].prevout.hash = vWalletTx[0];
+    BOOST_CHECK(filter.IsCandidate(tx, tx.GetHash()));
+    tx.vin[1].prevout.hash = GetRandHash();
+    BOOST_CHECK(filter.AddWalletTx(tx.vin[1].prevout.hash));
+    BOOST_CHECK(!filter.AddWalletTx(tx.vin[1].prevout.hash));
+    BOOST_CHECK(filter.IsCandidate(tx, tx.GetHash()));
+    tx.vin[1].prevout.hash = GetRandHash();
+    tx.vout.push_back(CTxOut(1, vScripts[0]));
+    BOOST_CHECK(filter.IsCandidate(tx, tx.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
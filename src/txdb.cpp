@@ -7,6 +7,7 @@
 #include "main.h"
 #include "hash.h"
 #include "chainparams.h"
+#include "ui_interface.h"
 
 using namespace std;
 
@@ -42,7 +43,7 @@ CBlockIndex *CCoinsViewDB::GetBestBlock() {
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return NULL;
-    std::map<uint256, CBlockIndex*>::iterator it = mapBlockIndex.find(hashBestChain);
+    BlockMap::iterator it = mapBlockIndex.find(hashBestChain);
     if (it == mapBlockIndex.end())
         return NULL;
     return it->second;
@@ -54,18 +55,222 @@ bool CCoinsViewDB::SetBestBlock(CBlockIndex *pindex) {
     return db.WriteBatch(batch);
 }
 
-bool CCoinsViewDB::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) {
-    printf("Committing %u changed transactions to coin database...\n", (unsigned int)mapCoins.size());
+// Skip coins that weren't modified, and ones that were created and spent
+// again without ever being written
+static bool IsWriteNeeded(const CCoinsCacheEntry &entry) {
+    if (!(entry.nFlags & CCoinsCacheEntry::DIRTY))
+        return false;
+    return !((entry.nFlags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned());
+}
 
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
     CLevelDBBatch batch;
-    for (std::map<uint256, CCoins>::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
-        BatchWriteCoins(batch, it->first, it->second);
-    if (pindex)
+    unsigned int nWritten = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!IsWriteNeeded(*it))
+            continue;
+        BatchWriteCoins(batch, it->txid, it->coins);
+        nWritten++;
+    }
+    printf("Committing %u changed transactions to coin database (%u writes avoided)...\n", nWritten, (unsigned int)mapCoins.size() - nWritten);
+    if (pindex) {
         BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+        batch.Erase('F');
+    }
 
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::BatchWriteChunked(const CCoinsMap &mapCoins, CBlockIndex *pindex, size_t nChunkSize) {
+    CLevelDBBatch batch;
+    batch.Write('F', pindex->GetBlockHash());
+    unsigned int nWritten = 0, nBatches = 1;
+    size_t nBatchSize = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        if (!IsWriteNeeded(*it))
+            continue;
+        BatchWriteCoins(batch, it->txid, it->coins);
+        nWritten++;
+        nBatchSize += sizeof(CCoins) + it->coins.DynamicMemoryUsage();
+        if (nBatchSize >= nChunkSize) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            nBatchSize = 0;
+            nBatches++;
+        }
+    }
+    BatchWriteHashBestChain(batch, pindex->GetBlockHash());
+    batch.Erase('F');
+    if (!db.WriteBatch(batch))
+        return false;
+    printf("Committed %u changed transactions to coin database in %u batches (%u writes avoided)\n", nWritten, nBatches, (unsigned int)mapCoins.size() - nWritten);
+    return true;
+}
+
+CBlockIndex *CCoinsViewDB::GetFlushTarget() {
+    uint256 hashTarget;
+    if (!db.Read('F', hashTarget))
+        return NULL;
+    BlockMap::iterator it = mapBlockIndex.find(hashTarget);
+    if (it == mapBlockIndex.end())
+        return NULL;
+    return it->second;
+}
+
+// Coins written per batch by the background writer
+static const size_t nWriteBehindChunkSize = 16 << 20;
+
+CCoinsViewWriteBehind::CCoinsViewWriteBehind(CCoinsViewDB &dbIn, bool fBackgroundIn) : db(dbIn), fBackground(fBackgroundIn),
+    fWriting(false), pindexFrom(NULL), pindexWriting(NULL), pindexWritten(NULL), fFailed(false) {
+    if (fBackground)
+        thread = boost::thread(&CCoinsViewWriteBehind::ThreadWrite, this);
+}
+
+CCoinsViewWriteBehind::~CCoinsViewWriteBehind() {
+    if (fBackground) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            WaitForWrite(lock);
+        }
+        thread.interrupt();
+        thread.join();
+    }
+}
+
+void CCoinsViewWriteBehind::WaitForWrite(boost::unique_lock<boost::mutex> &lock) {
+    // Callers rely on the write being finished, so don't let an interruption get in the way
+    boost::this_thread::disable_interruption di;
+    while (fWriting)
+        cond.wait(lock);
+}
+
+void CCoinsViewWriteBehind::ThreadWrite() {
+    RenameThread("bitcoin-coinswriter");
+
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fWriting)
+                cond.wait(lock);
+        }
+
+        // mapWriting and the blocks don't change until fWriting is reset.
+        // Only a write that extends the chain can be completed after a crash,
+        // by connecting the blocks in between again; others are done at once.
+        bool fChunked = false;
+        if (pindexFrom != NULL && pindexWriting != NULL) {
+            CBlockIndex *pindex = pindexWriting;
+            while (pindex != NULL && pindex->nHeight > pindexFrom->nHeight)
+                pindex = pindex->pprev;
+            fChunked = (pindex == pindexFrom);
+        }
+
+        bool fOk = false;
+        try {
+            if (fChunked)
+                fOk = db.BatchWriteChunked(mapWriting, pindexWriting, nWriteBehindChunkSize);
+            else
+                fOk = db.BatchWrite(mapWriting, pindexWriting);
+        } catch (std::exception &e) {
+            printf("CCoinsViewWriteBehind::ThreadWrite() : %s\n", e.what());
+        }
+        if (!fOk)
+            AbortNode(_("Failed to write to coin database"));
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapWriting.clear();
+        fWriting = false;
+        fFailed |= !fOk;
+        cond.notify_all();
+    }
+}
+
+bool CCoinsViewWriteBehind::GetCoins(const uint256 &txid, CCoins &coins) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end()) {
+                // Spent coins are about to be erased from the database
+                if (it->coins.IsPruned())
+                    return false;
+                coins = it->coins;
+                return true;
+            }
+        }
+    }
+    // Coins that aren't being written are not affected by the write
+    return db.GetCoins(txid, coins);
+}
+
+bool CCoinsViewWriteBehind::HaveCoins(const uint256 &txid) {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end())
+                return !it->coins.IsPruned();
+        }
+    }
+    return db.HaveCoins(txid);
+}
+
+bool CCoinsViewWriteBehind::SetCoins(const uint256 &txid, const CCoins &coins) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitForWrite(lock);
+    return db.SetCoins(txid, coins);
+}
+
+CBlockIndex *CCoinsViewWriteBehind::GetBestBlock() {
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fWriting && pindexWriting != NULL)
+            return pindexWriting;
+    }
+    return db.GetBestBlock();
+}
+
+bool CCoinsViewWriteBehind::SetBestBlock(CBlockIndex *pindex) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitForWrite(lock);
+    pindexWritten = pindex;
+    return db.SetBestBlock(pindex);
+}
+
+bool CCoinsViewWriteBehind::BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitForWrite(lock);
+    if (fFailed)
+        return false;
+    if (pindexWritten == NULL)
+        pindexWritten = db.GetBestBlock();
+    if (!fBackground) {
+        if (!db.BatchWrite(mapCoins, pindex))
+            return false;
+    } else {
+        // Hand the coins over to the writer thread; mapCoins gets the empty map back
+        mapWriting.swap(mapCoins);
+        pindexFrom = pindexWritten;
+        pindexWriting = pindex;
+        fWriting = true;
+        cond.notify_all();
+    }
+    if (pindex != NULL)
+        pindexWritten = pindex;
+    return true;
+}
+
+bool CCoinsViewWriteBehind::GetStats(CCoinsStats &stats) {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    WaitForWrite(lock);
+    return db.GetStats(stats);
+}
+
+CBlockIndex *CCoinsViewWriteBehind::GetInterruptedWrite() {
+    return db.GetFlushTarget();
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDB(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -186,6 +391,17 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+// Hash the headers of a batch of block index entries and check their proof of
+// work, which is most of the time it takes to load the block index. Each thread
+// takes every nStep'th entry, starting at nStart.
+void static CheckBlockIndexBatch(const vector<CDiskBlockIndex> *pvBatch, vector<uint256> *pvHash, vector<char> *pvValid, unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < pvBatch->size(); i += nStep) {
+        (*pvHash)[i] = (*pvBatch)[i].GetBlockHash();
+        (*pvValid)[i] = CheckProofOfWork((*pvHash)[i], (*pvBatch)[i].nBits);
+    }
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     leveldb::Iterator *pcursor = NewIterator();
@@ -194,48 +410,84 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
+    // Entries are read in batches. The hashes and proofs of work of a batch
+    // are split over nScriptCheckThreads threads, this one included; the
+    // others are started for that batch and joined before its entries are
+    // linked into mapBlockIndex.
+    const unsigned int nBatchSize = 16384;
+    unsigned int nThreads = std::max(nScriptCheckThreads, 1);
+    vector<CDiskBlockIndex> vBatch;
+    vector<uint256> vHash;
+    vector<char> vValid;
+    bool fDone = false;
+
     // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    while (!fDone) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
+        vBatch.clear();
+        while (vBatch.size() < nBatchSize) {
+            if (!pcursor->Valid()) {
+                fDone = true;
+                break;
+            }
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 'b') {
+                    fDone = true;
+                    break;
+                }
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                // Watch for genesis block
-                if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == Params().HashGenesisBlock())
-                    pindexGenesisBlock = pindexNew;
-
-                if (!pindexNew->CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
-
+                vBatch.push_back(CDiskBlockIndex());
+                ssValue >> vBatch.back();
                 pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+            } catch (std::exception &e) {
+                delete pcursor;
+                return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+            }
+        }
+
+        vHash.resize(vBatch.size());
+        vValid.resize(vBatch.size());
+        if (nThreads > 1 && vBatch.size() > 1) {
+            boost::thread_group threadGroup;
+            for (unsigned int i = 1; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&CheckBlockIndexBatch, &vBatch, &vHash, &vValid, i, nThreads));
+            CheckBlockIndexBatch(&vBatch, &vHash, &vValid, 0, nThreads);
+            threadGroup.join_all();
+        } else {
+            CheckBlockIndexBatch(&vBatch, &vHash, &vValid, 0, 1);
+        }
+
+        for (unsigned int i = 0; i < vBatch.size(); i++) {
+            const CDiskBlockIndex &diskindex = vBatch[i];
+
+            // Construct block index object
+            CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nTx            = diskindex.nTx;
+
+            // Watch for genesis block
+            if (pindexGenesisBlock == NULL && vHash[i] == Params().HashGenesisBlock())
+                pindexGenesisBlock = pindexNew;
+
+            if (!vValid[i]) {
+                delete pcursor;
+                return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
             }
-        } catch (std::exception &e) {
-            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
         }
     }
     delete pcursor;
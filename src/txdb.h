@@ -8,6 +8,8 @@
 #include "main.h"
 #include "leveldb.h"
 
+#include <boost/thread.hpp>
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -21,8 +23,67 @@ public:
     bool HaveCoins(const uint256 &txid);
     CBlockIndex *GetBestBlock();
     bool SetBestBlock(CBlockIndex *pindex);
-    bool BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
+    bool GetStats(CCoinsStats &stats);
+
+    // Like BatchWrite, but split into batches of about nChunkSize bytes of
+    // coins. The target block is recorded first, and the best block is only
+    // updated by the last batch. If the write is interrupted, it can be
+    // completed by applying the blocks between the best block and the
+    // target again (see GetFlushTarget).
+    bool BatchWriteChunked(const CCoinsMap &mapCoins, CBlockIndex *pindex, size_t nChunkSize);
+
+    // Retrieve the target block of an unfinished BatchWriteChunked, if any
+    CBlockIndex *GetFlushTarget();
+};
+
+/** CCoinsView that writes to a CCoinsViewDB in the background.
+ *
+ *  BatchWrite takes over the coins handed to it and returns right away. A
+ *  dedicated thread then writes them to the database, in chunks if the new
+ *  best block extends the previous one. Until that is done, lookups are
+ *  answered from the coins being written. Only one write is in progress at a
+ *  time: a BatchWrite while the previous one is still running waits for it.
+ */
+class CCoinsViewWriteBehind : public CCoinsView
+{
+private:
+    CCoinsViewDB &db;
+    bool fBackground;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    boost::thread thread;
+
+    // The coins being written, and the best block before and after the write
+    bool fWriting;
+    CCoinsMap mapWriting;
+    CBlockIndex *pindexFrom;
+    CBlockIndex *pindexWriting;
+
+    // The best block of the database once the current write is done
+    CBlockIndex *pindexWritten;
+
+    // Whether a write failed. Nothing is written after that.
+    bool fFailed;
+
+    void ThreadWrite();
+    void WaitForWrite(boost::unique_lock<boost::mutex> &lock);
+
+public:
+    CCoinsViewWriteBehind(CCoinsViewDB &dbIn, bool fBackgroundIn = true);
+    ~CCoinsViewWriteBehind();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins);
+    bool SetCoins(const uint256 &txid, const CCoins &coins);
+    bool HaveCoins(const uint256 &txid);
+    CBlockIndex *GetBestBlock();
+    bool SetBestBlock(CBlockIndex *pindex);
+    bool BatchWrite(CCoinsMap &mapCoins, CBlockIndex *pindex);
     bool GetStats(CCoinsStats &stats);
+
+    // Retrieve the target block of a write that was interrupted by a crash, if any
+    CBlockIndex *GetInterruptedWrite();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,11 @@ typedef unsigned long long  uint64;
 
 inline int Testuint256AdHoc(std::vector<std::string> vArg);
 
+class uint_error : public std::runtime_error
+{
+public:
+    explicit uint_error(const std::string& str) : std::runtime_error(str) {}
+};
 
 
 /** Base class without constructors for uint256 and uint160.
@@ -180,6 +186,108 @@ public:
     }
 
 
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64 carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64 n = carry + (uint64)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
+
+    base_uint& operator*=(const base_uint& b)
+    {
+        // schoolbook multiplication, dropping what doesn't fit
+        base_uint a;
+        for (int i = 0; i < WIDTH; i++)
+            a.pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++)
+        {
+            uint64 carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64 n = carry + a.pn[i+j] + (uint64)pn[j] * b.pn[i];
+                a.pn[i+j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
+        }
+        *this = a;
+        return *this;
+    }
+
+    base_uint& operator/=(uint32_t b32)
+    {
+        // short division, one word at a time
+        if (b32 == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+        uint64 rem = 0;
+        for (int i = WIDTH-1; i >= 0; i--)
+        {
+            uint64 n = (rem << 32) | pn[i];
+            pn[i] = (uint32_t)(n / b32);
+            rem = n % b32;
+        }
+        return *this;
+    }
+
+    base_uint& operator/=(const base_uint& b)
+    {
+        // long division, one bit of the quotient at a time
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0)
+            throw uint_error("base_uint::operator/= : division by zero");
+        if (nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        while (nShift >= 0)
+        {
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+            nShift--;
+        }
+        return *this;
+    }
+
+    // Copy to an integer of another width, dropping the bits that don't fit
+    template<unsigned int BITS2>
+    base_uint<BITS2> Resize() const
+    {
+        base_uint<BITS2> ret;
+        for (int i = 0; i < base_uint<BITS2>::WIDTH; i++)
+            ret.pn[i] = i < WIDTH ? pn[i] : 0;
+        return ret;
+    }
+
+    // Number of significant bits, i.e. the position of the highest set bit plus one
+    unsigned int bits() const
+    {
+        for (int pos = WIDTH-1; pos >= 0; pos--)
+        {
+            if (pn[pos])
+            {
+                for (int nBits = 31; nBits > 0; nBits--)
+                    if (pn[pos] & (1U << nBits))
+                        return 32*pos + nBits + 1;
+                return 32*pos + 1;
+            }
+        }
+        return 0;
+    }
+
+
     base_uint& operator++()
     {
         // prefix operator
@@ -396,6 +504,7 @@ public:
     }
 
 
+    template<unsigned int BITS2> friend class base_uint;
     friend class uint160;
     friend class uint256;
     friend inline int Testuint256AdHoc(std::vector<std::string> vArg);
@@ -587,6 +696,72 @@ public:
         else
             *this = 0;
     }
+
+    // Decode the compact representation used for nBits, like CBigNum::SetCompact.
+    // Values that are negative, or don't fit in 256 bits, are flagged.
+    uint256& SetCompact(unsigned int nCompact, bool *pfNegative = NULL, bool *pfOverflow = NULL)
+    {
+        unsigned int nSize = nCompact >> 24;
+        unsigned int nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
+        {
+            nWord >>= 8*(3-nSize);
+            *this = nWord;
+        }
+        else
+        {
+            *this = nWord;
+            *this <<= 8*(nSize-3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > 34) ||
+                                         (nWord > 0xff && nSize > 33) ||
+                                         (nWord > 0xffff && nSize > 32));
+        return *this;
+    }
+
+    // Encode in the compact representation, like CBigNum::GetCompact
+    unsigned int GetCompact(bool fNegative = false) const
+    {
+        unsigned int nSize = (bits() + 7) / 8;
+        unsigned int nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8*(3-nSize);
+        else
+        {
+            uint256 bn = *this;
+            bn >>= 8*(nSize-3);
+            nCompact = bn.Get64();
+        }
+        // The 0x00800000 bit is the sign, so a mantissa that would set it
+        // is shifted down a byte instead
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        nCompact |= (fNegative && (nCompact & 0x007fffff) ? 0x00800000 : 0);
+        return nCompact;
+    }
+
+    // Multiply by nMul and divide by nDiv, with a product that may be wider
+    // than 256 bits. Returns false if the result itself doesn't fit.
+    bool MulDiv(uint64 nMul, uint64 nDiv)
+    {
+        base_uint<320> bnProduct = Resize<320>();
+        base_uint<320> bnMul, bnDiv;
+        bnMul = nMul;
+        bnDiv = nDiv;
+        bnProduct *= bnMul;
+        bnProduct /= bnDiv;
+        if (bnProduct.bits() > 256)
+            return false;
+        *this = bnProduct.Resize<256>();
+        return true;
+    }
 };
 
 inline bool operator==(const uint256& a, uint64 b)                           { return (base_uint256)a == b; }
@@ -637,6 +812,10 @@ inline const uint256 operator&(const uint256& a, const uint256& b)      { return
 inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
 inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
 inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline const uint256 operator*(const uint256& a, uint32_t b)             { return uint256(a) *= b; }
+inline const uint256 operator*(const uint256& a, const uint256& b)      { return uint256(a) *= b; }
+inline const uint256 operator/(const uint256& a, const uint256& b)      { return uint256(a) /= b; }
+inline const uint256 operator/(const uint256& a, uint32_t b)             { return uint256(a) /= b; }
 
 
 
@@ -283,6 +283,17 @@ inline int64 abs64(int64 n)
     return (n >= 0 ? n : -n);
 }
 
+/** Estimate of the heap memory used by an allocation of nAlloc bytes,
+ *  including the malloc overhead and alignment (as on glibc). */
+inline size_t MallocUsage(size_t nAlloc)
+{
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
 template<typename T>
 std::string HexStr(const T itbegin, const T itend, bool fSpaces=false)
 {
@@ -8,7 +8,9 @@
 #include "crypter.h"
 #include "ui_interface.h"
 #include "base58.h"
+#include "checkqueue.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -784,34 +786,178 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
+CWalletScanFilter::CWalletScanFilter(const CKeyStore &keystoreIn, const std::set<CKeyID> &setKeyIDIn,
+                                     const std::vector<CScriptID> &vScriptIDIn, const std::vector<uint256> &vWalletTxIn) :
+    keystore(keystoreIn), setKeyID(setKeyIDIn.begin(), setKeyIDIn.end()),
+    setScriptID(vScriptIDIn.begin(), vScriptIDIn.end()), setWalletTx(vWalletTxIn.begin(), vWalletTxIn.end())
+{
+}
+
+bool CWalletScanFilter::IsMine(const CScript& scriptPubKey) const
+{
+    const CScript &s = scriptPubKey;
+    if (s.size() == 25 && s[0] == OP_DUP && s[1] == OP_HASH160 && s[2] == 20 && s[23] == OP_EQUALVERIFY && s[24] == OP_CHECKSIG)
+        return setKeyID.count(uint160(std::vector<unsigned char>(s.begin() + 3, s.begin() + 23))) > 0;
+    if (s.IsPayToScriptHash())
+        return setScriptID.count(uint160(std::vector<unsigned char>(s.begin() + 2, s.begin() + 22))) > 0;
+    if ((s.size() == 35 && s[0] == 33) || (s.size() == 67 && s[0] == 65))
+        if (s.back() == OP_CHECKSIG)
+            return setKeyID.count(CPubKey(s.begin() + 1, s.end() - 1).GetID()) > 0;
+    return ::IsMine(keystore, scriptPubKey);
+}
+
+bool CWalletScanFilter::IsCandidate(const CTransaction& tx, const uint256& hash) const
+{
+    if (setWalletTx.count(hash))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setWalletTx.count(txin.prevout.hash))
+            return true;
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        if (IsMine(txout.scriptPubKey))
+            return true;
+    return false;
+}
+
+bool CWalletScanFilter::AddWalletTx(const uint256& hash)
+{
+    return setWalletTx.insert(hash).second;
+}
+
+/** A block of a rescan, and which of its transactions are candidates */
+struct CWalletScanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    std::vector<char> vCandidate;
+};
+
+/** Reads a block of a rescan, and matches its transactions against the filter */
+class CWalletScanCheck
+{
+private:
+    const CWalletScanFilter *pfilter;
+    CWalletScanBlock *pscan;
+
+public:
+    CWalletScanCheck() : pfilter(NULL), pscan(NULL) {}
+    CWalletScanCheck(const CWalletScanFilter *pfilterIn, CWalletScanBlock *pscanIn) : pfilter(pfilterIn), pscan(pscanIn) {}
+
+    bool operator()() const {
+        CBlock &block = pscan->block;
+        pscan->fRead = ReadBlockFromDisk(block, pscan->pindex);
+        if (!pscan->fRead)
+            return true;
+        block.BuildMerkleTree();
+        pscan->vCandidate.resize(block.vtx.size());
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            pscan->vCandidate[i] = pfilter->IsCandidate(block.vtx[i], block.GetTxHash(i));
+        return true;
+    }
+
+    void swap(CWalletScanCheck &check) {
+        std::swap(pfilter, check.pfilter);
+        std::swap(pscan, check.pscan);
+    }
+};
+
+static CCheckQueue<CWalletScanCheck> walletscanqueue(1);
+
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+//
+// Blocks are read and filtered by a pool of threads, a range at a time;
+// only the candidate transactions are then handed to
+// AddToWalletIfInvolvingMe, in block chain order.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    // no need to read and scan blocks that were created before our wallet
+    // birthday (as adjusted for block time variability)
+    std::vector<CBlockIndex*> vScan;
+    for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->GetNextInMainChain())
+        if (!nTimeFirstKey || pindex->nTime >= nTimeFirstKey - 7200)
+            vScan.push_back(pindex);
+
     {
         LOCK(cs_wallet);
-        while (pindex)
-        {
-            // no need to read and scan block, if block was created before
-            // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->GetNextInMainChain();
-                continue;
-            }
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        std::set<CKeyID> setKeyID;
+        GetKeys(setKeyID);
+        std::vector<std::pair<CScriptID, CScript> > vScripts;
+        {
+            LOCK(cs_KeyStore);
+            vScripts.assign(mapScripts.begin(), mapScripts.end());
+        }
+        std::vector<CScriptID> vScriptID;
+        for (unsigned int i = 0; i < vScripts.size(); i++)
+            if (::IsMine(*this, vScripts[i].second))
+                vScriptID.push_back(vScripts[i].first);
+        std::vector<uint256> vWalletTx;
+        vWalletTx.reserve(mapWallet.size());
+        BOOST_FOREACH(const PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+            vWalletTx.push_back(item.first);
+        CWalletScanFilter filter(*this, setKeyID, vScriptID, vWalletTx);
+
+        // The thread that waits for a range reads blocks too
+        int nThreads = std::max(nScriptCheckThreads, 1);
+        boost::thread_group threadGroup;
+        for (int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CWalletScanCheck>::Thread, &walletscanqueue));
+
+        try {
+            std::vector<CWalletScanBlock> vRange;
+            for (unsigned int nStart = 0; nStart < vScan.size(); nStart += vRange.size())
             {
-                if (AddToWalletIfInvolvingMe(tx.GetHash(), tx, &block, fUpdate))
-                    ret++;
+                vRange.clear();
+                vRange.resize(std::min((size_t)(8 * nThreads), vScan.size() - nStart));
+                std::vector<CWalletScanCheck> vChecks;
+                for (unsigned int i = 0; i < vRange.size(); i++) {
+                    vRange[i].pindex = vScan[nStart + i];
+                    vChecks.push_back(CWalletScanCheck(&filter, &vRange[i]));
+                }
+                {
+                    CCheckQueueControl<CWalletScanCheck> control(&walletscanqueue);
+                    control.Add(vChecks);
+                    control.Wait();
+                }
+
+                // Transactions that entered the wallet in this range weren't
+                // known to the filter when the later blocks were matched
+                std::set<uint256> setAdded;
+                BOOST_FOREACH(CWalletScanBlock& scan, vRange)
+                {
+                    if (!scan.fRead)
+                        continue;
+                    CBlock& block = scan.block;
+                    for (unsigned int i = 0; i < block.vtx.size(); i++)
+                    {
+                        const CTransaction& tx = block.vtx[i];
+                        const uint256& hash = block.GetTxHash(i);
+                        if (!scan.vCandidate[i]) {
+                            bool fSpendsAdded = setAdded.count(hash) > 0;
+                            for (unsigned int j = 0; j < tx.vin.size() && !fSpendsAdded && !setAdded.empty(); j++)
+                                fSpendsAdded = setAdded.count(tx.vin[j].prevout.hash) > 0;
+                            if (!fSpendsAdded)
+                                continue;
+                        }
+                        if (AddToWalletIfInvolvingMe(hash, tx, &block, fUpdate))
+                            ret++;
+                        if (mapWallet.count(hash) && filter.AddWalletTx(hash))
+                            setAdded.insert(hash);
+                    }
+                }
             }
-            pindex = pindex->GetNextInMainChain();
+        } catch (...) {
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
         }
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
     }
     return ret;
 }
@@ -1286,10 +1432,12 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64> >& vecSend,
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
                     wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
-                // Sign
+                // Sign; only the input scripts change while signing, so the
+                // inputs can share the rest of the signature hash
                 int nIn = 0;
+                CSigHashContext sighash(wtxNew);
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+                    if (!SignSignature(*this, *coin.first, wtxNew, nIn++, SIGHASH_ALL, &sighash))
                     {
                         strFailReason = _("Signing transaction failed");
                         return false;
@@ -1936,7 +2084,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
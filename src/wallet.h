@@ -12,6 +12,8 @@
 
 #include <stdlib.h>
 
+#include <boost/unordered_set.hpp>
+
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -64,6 +66,44 @@ public:
     )
 };
 
+/** What a rescan looks for, so that telling whether a transaction may involve
+ *  the wallet takes hash table lookups instead of Solver and the wallet's maps.
+ *
+ *  A transaction is a candidate if it is in the wallet already, spends one of
+ *  its transactions' outputs, or has an output that IsMine. Outputs of the
+ *  standard forms are looked up by key or script ID; others get ::IsMine. For
+ *  any other transaction AddToWalletIfInvolvingMe does nothing.
+ */
+class CWalletScanFilter
+{
+private:
+    struct CIDHasher
+    {
+        size_t operator()(const uint160& id) const { return id.Get64(); }
+    };
+    struct CTxidHasher
+    {
+        size_t operator()(const uint256& hash) const { return hash.Get64(); }
+    };
+
+    const CKeyStore &keystore;
+    boost::unordered_set<uint160, CIDHasher> setKeyID;
+    boost::unordered_set<uint160, CIDHasher> setScriptID; // pay-to-script-hash scripts that are IsMine
+    boost::unordered_set<uint256, CTxidHasher> setWalletTx;
+
+public:
+    CWalletScanFilter(const CKeyStore &keystoreIn, const std::set<CKeyID> &setKeyIDIn,
+                      const std::vector<CScriptID> &vScriptIDIn, const std::vector<uint256> &vWalletTxIn);
+
+    // What ::IsMine(keystore, scriptPubKey) returns
+    bool IsMine(const CScript& scriptPubKey) const;
+
+    bool IsCandidate(const CTransaction& tx, const uint256& hash) const;
+
+    // Note a transaction that is in the wallet now; true if it wasn't before
+    bool AddWalletTx(const uint256& hash);
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */